@@ -33,9 +33,11 @@ G_BEGIN_DECLS
 #define   REALM_DBUS_KERBEROS_INTERFACE            "org.freedesktop.realmd.Kerberos"
 #define   REALM_DBUS_KERBEROS_MEMBERSHIP_INTERFACE "org.freedesktop.realmd.KerberosMembership"
 #define   REALM_DBUS_SERVICE_INTERFACE             "org.freedesktop.realmd.Service"
+#define   REALM_DBUS_METRICS_INTERFACE             "org.freedesktop.realmd.Metrics"
 
 #define   REALM_DBUS_DIAGNOSTICS_SIGNAL            "Diagnostics"
 
+#define   REALM_DBUS_ERROR_PREFIX                  "org.freedesktop.realmd.Error."
 #define   REALM_DBUS_ERROR_INTERNAL                "org.freedesktop.realmd.Error.Internal"
 #define   REALM_DBUS_ERROR_FAILED                  "org.freedesktop.realmd.Error.Failed"
 #define   REALM_DBUS_ERROR_BUSY                    "org.freedesktop.realmd.Error.Busy"
@@ -60,6 +62,10 @@ G_BEGIN_DECLS
 #define   REALM_DBUS_OPTION_SERVER_SOFTWARE        "server-software"
 #define   REALM_DBUS_OPTION_CLIENT_SOFTWARE        "client-software"
 #define   REALM_DBUS_OPTION_MEMBERSHIP_SOFTWARE    "membership-software"
+#define   REALM_DBUS_OPTION_REMOVE                 "remove"
+#define   REALM_DBUS_OPTION_QUEUE_PRIORITY         "queue-priority"
+#define   REALM_DBUS_OPTION_QUEUE_TIMEOUT          "queue-timeout"
+#define   REALM_DBUS_OPTION_TIMING_REPORT          "timing-report"
 
 #define   REALM_DBUS_IDENTIFIER_ACTIVE_DIRECTORY   "active-directory"
 #define   REALM_DBUS_IDENTIFIER_WINBIND            "winbind"
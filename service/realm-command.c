@@ -17,7 +17,10 @@
 #include "realm-daemon.h"
 #include "realm-command.h"
 #include "realm-diagnostics.h"
+#include "realm-invocation.h"
+#include "realm-metrics.h"
 #include "realm-settings.h"
+#include "realm-trace.h"
 
 #include <glib/gi18n-lib.h>
 
@@ -46,6 +49,9 @@ typedef struct {
 	GDBusMethodInvocation *invocation;
 	GSubprocess *process;
 	gint cancel_sig;
+	gchar *label;
+	gint64 started;
+	RealmTraceSpan *span;
 } CommandClosure;
 
 static void
@@ -58,7 +64,10 @@ command_closure_free (gpointer data)
 		g_object_unref (command->invocation);
 	if (command->process)
 		g_object_unref (command->process);
-	g_string_free (command->output, TRUE);
+	if (command->output)
+		g_string_free (command->output, TRUE);
+	g_free (command->label);
+	realm_trace_end (command->span);
 	g_assert (command->cancel_sig == 0);
 	g_slice_free (CommandClosure, command);
 }
@@ -417,14 +426,30 @@ on_cancellable_cancelled (GCancellable *cancellable,
 	g_subprocess_request_exit (command->process);
 }
 
-void
-realm_command_runv_async (gchar **argv,
-                          gchar **environ,
-                          GBytes *input,
-                          GDBusMethodInvocation *invocation,
-                          GCancellable *cancellable,
-                          GAsyncReadyCallback callback,
-                          gpointer user_data)
+/*
+ * Service management and cache flushes are known commands too, but are
+ * traced separately so that a timing report can tell them apart from
+ * enrollment tools.
+ */
+static const gchar *
+command_trace_category (const gchar *label)
+{
+	if (g_str_has_suffix (label, "-service"))
+		return "service";
+	if (g_str_equal (label, "name-caches-flush"))
+		return "cache-flush";
+	return "command";
+}
+
+static void
+command_runv_async (gchar **argv,
+                    gchar **environ,
+                    GBytes *input,
+                    GDBusMethodInvocation *invocation,
+                    GCancellable *cancellable,
+                    const gchar *label,
+                    GAsyncReadyCallback callback,
+                    gpointer user_data)
 {
 	GSimpleAsyncResult *res;
 	CommandClosure *command;
@@ -484,6 +509,10 @@ realm_command_runv_async (gchar **argv,
 	command->output = g_string_sized_new (128);
 	command->invocation = invocation ? g_object_ref (invocation) : NULL;
 	command->process = process;
+	command->label = label ? g_strdup (label) : g_path_get_basename (argv[0]);
+	command->started = g_get_monotonic_time ();
+	command->span = realm_trace_begin (invocation, command_trace_category (command->label),
+	                                   "%s", command->label);
 	g_simple_async_result_set_op_res_gpointer (res, command, command_closure_free);
 
 	if (error) {
@@ -498,6 +527,10 @@ realm_command_runv_async (gchar **argv,
 	g_subprocess_wait (process, NULL,
 	                   on_unix_process_child_exited, g_object_ref (res));
 
+	/* Unless told otherwise, stop the process when the caller goes away */
+	if (cancellable == NULL && invocation != NULL)
+		cancellable = realm_invocation_get_cancellable (invocation);
+
 	if (cancellable) {
 		command->cancel_sig = g_cancellable_connect (cancellable,
 		                                             G_CALLBACK (on_cancellable_cancelled),
@@ -507,6 +540,20 @@ realm_command_runv_async (gchar **argv,
 	g_object_unref (res);
 }
 
+void
+realm_command_runv_async (gchar **argv,
+                          gchar **environ,
+                          GBytes *input,
+                          GDBusMethodInvocation *invocation,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data)
+{
+	g_return_if_fail (argv != NULL);
+	command_runv_async (argv, environ, input, invocation, cancellable,
+	                    NULL, callback, user_data);
+}
+
 static gboolean
 is_only_whitespace (const gchar *string)
 {
@@ -564,7 +611,8 @@ realm_command_run_known_async (const gchar *known_command,
 		argv = g_strdupv ((gchar **)invalid_argv);
 	}
 
-	realm_command_runv_async (argv, environ, NULL, invocation, cancellable, callback, user_data);
+	command_runv_async (argv, environ, NULL, invocation, cancellable,
+	                    known_command, callback, user_data);
 	g_strfreev (argv);
 }
 
@@ -581,15 +629,21 @@ realm_command_run_finish (GAsyncResult *result,
 	                      realm_command_runv_async), -1);
 
 	res = G_SIMPLE_ASYNC_RESULT (result);
+	command = g_simple_async_result_get_op_res_gpointer (res);
+
+	realm_metrics_observe (REALM_METRIC_COMMAND, command->label,
+	                       g_get_monotonic_time () - command->started);
+	realm_trace_end (command->span);
+	command->span = NULL;
 
 	if (g_simple_async_result_propagate_error (res, error))
 		return -1;
 
-	command = g_simple_async_result_get_op_res_gpointer (res);
 	if (command->output->len)
-		realm_diagnostics_info_data (command->invocation,
-		                             command->output->str,
-		                             command->output->len);
+		realm_diagnostics_info_command (command->invocation,
+		                                command->label,
+		                                command->output->str,
+		                                command->output->len);
 	if (output) {
 		*output = command->output;
 		command->output = NULL;
@@ -20,11 +20,17 @@
 #include "realm-dbus-generated.h"
 #include "realm-diagnostics.h"
 #include "realm-errors.h"
+#include "realm-invocation.h"
+#include "realm-kerberos.h"
 #include "realm-kerberos-provider.h"
+#include "realm-log.h"
+#include "realm-metrics.h"
 #include "realm-samba-provider.h"
 #include "realm-settings.h"
 #include "realm-sssd-ad-provider.h"
 #include "realm-sssd-ipa-provider.h"
+#include "realm-trace.h"
+#include "realm-worker.h"
 
 #include <glib.h>
 #include <glib/gi18n.h>
@@ -36,155 +42,338 @@
 #define TIMEOUT        60 /* seconds */
 #define HOLD_INTERNAL  (GUINT_TO_POINTER (~0))
 
-static GObject *current_invocation = NULL;
 static GMainLoop *main_loop = NULL;
 
 static gboolean service_persist = FALSE;
-static GHashTable *service_clients = NULL;
 static gint64 service_quit_at = 0;
 static guint service_timeout_id = 0;
 static guint service_bus_name_owner_id = 0;
 static gboolean service_bus_name_claimed = FALSE;
 static GDBusObjectManagerServer *object_server = NULL;
+static RealmDbusMetrics *service_metrics = NULL;
 static gboolean service_debug = FALSE;
 
 typedef struct {
-	guint watch;
 	gchar *locale;
 } RealmClient;
 
+/*
+ * Clients and holds, keyed by bus name or hold name. New clients are
+ * registered from the dbus thread, so this is locked. Only removed
+ * from the main thread.
+ */
+G_LOCK_DEFINE_STATIC (service_clients);
+static GHashTable *service_clients = NULL;
+
 /* We use this for registering the dbus errors */
 GQuark realm_error = 0;
 
-/* We use a lock here because it's called from dbus threads */
-G_LOCK_DEFINE(polkit_authority);
+/* Only used from the main thread */
 static PolkitAuthority *polkit_authority = NULL;
 
-static void
-on_invocation_gone (gpointer unused,
-                    GObject *where_the_object_was)
+/*
+ * Polkit decisions that didn't involve the user, keyed by sender and
+ * action. These are looked up from dbus threads, and are dropped when
+ * the sender goes away.
+ */
+G_LOCK_DEFINE_STATIC (authorized_cache);
+static GHashTable *authorized_cache = NULL;
+
+gboolean
+realm_daemon_has_debug_flag (void)
 {
-	g_warning ("a GDBusMethodInvocation was released but the invocation was "
-	           "registered as part of a realm_daemon_lock_for_action()");
-	g_assert (where_the_object_was == current_invocation);
-	current_invocation = NULL;
+	return service_debug;
 }
 
-gboolean
-realm_daemon_lock_for_action (GDBusMethodInvocation *invocation)
+void
+realm_daemon_set_locale_until_loop (GDBusMethodInvocation *invocation)
 {
-	g_return_val_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation), FALSE);
+	/* TODO: Not yet implemented, need threadsafe implementation */
+}
 
-	if (current_invocation)
-		return FALSE;
+typedef struct {
+	GDBusInterfaceSkeleton *iface;
+	GDBusMethodInvocation *invocation;
+	gchar *action_id;
+} AuthorizeClosure;
+
+static void
+authorize_closure_free (AuthorizeClosure *closure)
+{
+	g_object_unref (closure->iface);
+	g_object_unref (closure->invocation);
+	g_free (closure->action_id);
+	g_slice_free (AuthorizeClosure, closure);
+}
 
-	current_invocation = G_OBJECT (invocation);
-	g_object_weak_ref (current_invocation, on_invocation_gone, NULL);
+static gboolean
+authorized_cache_flush (const gchar *sender)
+{
+	gboolean ret = FALSE;
 
-	/* Hold the daemon up while action */
-	realm_daemon_hold ("current-invocation");
+	G_LOCK (authorized_cache);
+	if (authorized_cache)
+		ret = g_hash_table_remove (authorized_cache, sender);
+	G_UNLOCK (authorized_cache);
 
-	return TRUE;
+	return ret;
 }
 
-void
-realm_daemon_unlock_for_action (GDBusMethodInvocation *invocation)
+static void
+reject_method (GDBusMethodInvocation *invocation)
+{
+	g_debug ("rejecting access to: %s.%s method on %s",
+	         g_dbus_method_invocation_get_interface_name (invocation),
+	         g_dbus_method_invocation_get_method_name (invocation),
+	         g_dbus_method_invocation_get_object_path (invocation));
+	g_dbus_method_invocation_return_dbus_error (invocation, REALM_DBUS_ERROR_NOT_AUTHORIZED,
+	                                            _("Not authorized to perform this action"));
+}
+
+static void
+authorize_complete (AuthorizeClosure *closure,
+                    gboolean authorized)
 {
-	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
+	const GDBusInterfaceVTable *vtable;
+	GDBusMethodInvocation *invocation = closure->invocation;
 
-	if (current_invocation != G_OBJECT (invocation)) {
-		g_warning ("trying to realm_daemon_unlock_for_action() with an invocation "
-		           "that is not registered as the current locked action.");
+	if (!authorized) {
+		reject_method (invocation);
 		return;
 	}
 
-	g_object_weak_unref (current_invocation, on_invocation_gone, NULL);
-	current_invocation = NULL;
-
-	/* Matches the hold in realm_daemon_lock_for_action() */
-	realm_daemon_release ("current-invocation");
+	/* Dispatch as the skeleton would have, had we authorized it right away */
+	vtable = g_dbus_interface_skeleton_get_vtable (closure->iface);
+	(vtable->method_call) (g_dbus_method_invocation_get_connection (invocation),
+	                       g_dbus_method_invocation_get_sender (invocation),
+	                       g_dbus_method_invocation_get_object_path (invocation),
+	                       g_dbus_method_invocation_get_interface_name (invocation),
+	                       g_dbus_method_invocation_get_method_name (invocation),
+	                       g_dbus_method_invocation_get_parameters (invocation),
+	                       g_object_ref (invocation), closure->iface);
 }
 
-gboolean
-realm_daemon_has_debug_flag (void)
+static void
+on_check_authorization (GObject *source,
+                        GAsyncResult *result,
+                        gpointer user_data)
 {
-	return service_debug;
+	AuthorizeClosure *closure = user_data;
+	PolkitAuthorizationResult *auth;
+	GCancellable *cancellable;
+	GError *error = NULL;
+	GHashTable *decisions;
+	const gchar *sender;
+	gboolean authorized = FALSE;
+
+	auth = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source), result, &error);
+	if (auth == NULL) {
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug ("polkit authorization check cancelled: %s", error->message);
+		else
+			g_warning ("couldn't check polkit authorization: %s", error->message);
+		g_error_free (error);
+
+	} else {
+		authorized = polkit_authorization_result_get_is_authorized (auth);
+		cancellable = realm_invocation_get_cancellable (closure->invocation);
+
+		/*
+		 * Only remember decisions that didn't involve the user. And not
+		 * for a client that has already left, as it was flushed then.
+		 */
+		if (g_cancellable_is_cancelled (cancellable)) {
+			g_debug ("not remembering authorization for vanished client");
+
+		} else if ((authorized && polkit_authorization_result_get_temporary_authorization_id (auth) == NULL) ||
+		           (!authorized && !polkit_authorization_result_get_is_challenge (auth))) {
+			sender = g_dbus_method_invocation_get_sender (closure->invocation);
+			G_LOCK (authorized_cache);
+			if (authorized_cache == NULL)
+				authorized_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+				                                          (GDestroyNotify)g_hash_table_unref);
+			decisions = g_hash_table_lookup (authorized_cache, sender);
+			if (decisions == NULL) {
+				decisions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+				g_hash_table_insert (authorized_cache, g_strdup (sender), decisions);
+			}
+			g_hash_table_replace (decisions, g_strdup (closure->action_id),
+			                      GINT_TO_POINTER (authorized ? 1 : -1));
+			G_UNLOCK (authorized_cache);
+		}
+
+		g_object_unref (auth);
+	}
+
+	authorize_complete (closure, authorized);
+	authorize_closure_free (closure);
 }
 
-void
-realm_daemon_set_locale_until_loop (GDBusMethodInvocation *invocation)
+static void
+check_authorization (AuthorizeClosure *closure)
 {
-	/* TODO: Not yet implemented, need threadsafe implementation */
+	GCancellable *cancellable;
+	PolkitSubject *subject;
+
+	/* Cancelled along with the rest of the client's work, if it leaves */
+	cancellable = realm_invocation_get_cancellable (closure->invocation);
+
+	subject = polkit_system_bus_name_new (g_dbus_method_invocation_get_sender (closure->invocation));
+	polkit_authority_check_authorization (polkit_authority, subject, closure->action_id, NULL,
+	                                      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+	                                      cancellable, on_check_authorization, closure);
+	g_object_unref (subject);
 }
 
-gboolean
-realm_daemon_check_dbus_action (const gchar *sender,
-                                 const gchar *action_id)
+static void
+on_polkit_authority (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
 {
-	PolkitAuthorizationResult *result;
+	AuthorizeClosure *closure = user_data;
 	PolkitAuthority *authority;
-	PolkitSubject *subject;
 	GError *error = NULL;
-	gboolean ret;
 
-	g_return_val_if_fail (sender != NULL, FALSE);
-	g_return_val_if_fail (action_id != NULL, FALSE);
+	authority = polkit_authority_get_finish (result, &error);
+	if (authority == NULL) {
+		g_warning ("failure to get polkit authority: %s", error->message);
+		g_error_free (error);
+		authorize_complete (closure, FALSE);
+		authorize_closure_free (closure);
+		return;
+	}
 
-	G_LOCK (polkit_authority);
+	if (polkit_authority == NULL)
+		polkit_authority = authority;
+	else
+		g_object_unref (authority);
 
-	authority = polkit_authority ? g_object_ref (polkit_authority) : NULL;
+	check_authorization (closure);
+}
 
-	G_UNLOCK (polkit_authority);
+static gboolean
+on_idle_check_authorization (gpointer user_data)
+{
+	AuthorizeClosure *closure = user_data;
 
-	if (!authority) {
-		authority = polkit_authority_get_sync (NULL, &error);
-		if (authority == NULL) {
-			g_warning ("failure to get polkit authority: %s", error->message);
-			g_error_free (error);
-			return FALSE;
-		}
+	if (polkit_authority == NULL)
+		polkit_authority_get_async (NULL, on_polkit_authority, closure);
+	else
+		check_authorization (closure);
 
-		G_LOCK (polkit_authority);
+	return FALSE;
+}
 
-		if (polkit_authority == NULL) {
-			polkit_authority = g_object_ref (authority);
+gboolean
+realm_daemon_authorize_method (GDBusInterfaceSkeleton *iface,
+                               GDBusMethodInvocation *invocation,
+                               const gchar *action_id)
+{
+	AuthorizeClosure *closure;
+	const gchar *sender;
+	GHashTable *decisions;
+	gpointer decision = NULL;
 
-		} else {
-			g_object_unref (authority);
-			authority = g_object_ref (polkit_authority);
-		}
+	g_return_val_if_fail (G_IS_DBUS_INTERFACE_SKELETON (iface), FALSE);
+	g_return_val_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation), FALSE);
+	g_return_val_if_fail (action_id != NULL, FALSE);
 
-		G_UNLOCK (polkit_authority);
-	}
+	sender = g_dbus_method_invocation_get_sender (invocation);
+	g_return_val_if_fail (sender != NULL, FALSE);
 
-	/* do authorization async */
-	subject = polkit_system_bus_name_new (sender);
-	result = polkit_authority_check_authorization_sync (authority, subject, action_id, NULL,
-			POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION, NULL, &error);
+	G_LOCK (authorized_cache);
+	decisions = authorized_cache ? g_hash_table_lookup (authorized_cache, sender) : NULL;
+	if (decisions)
+		decision = g_hash_table_lookup (decisions, action_id);
+	G_UNLOCK (authorized_cache);
 
-	g_object_unref (authority);
-	g_object_unref (subject);
+	realm_metrics_increment (decision ? REALM_METRIC_CACHE_HIT : REALM_METRIC_CACHE_MISS,
+	                         "authorization");
 
-	/* failed */
-	if (result == NULL) {
-		g_warning ("couldn't check polkit authorization%s%s",
-		           error ? ": " : "", error ? error->message : "");
-		g_error_free (error);
+	if (decision != NULL) {
+		if (GPOINTER_TO_INT (decision) > 0)
+			return TRUE;
+		reject_method (invocation);
 		return FALSE;
 	}
 
-	ret = polkit_authorization_result_get_is_authorized (result);
-	g_object_unref (result);
+	/*
+	 * We're called from a dbus thread. Ask polkit from the main loop
+	 * without blocking, and dispatch the method from there later.
+	 */
+	closure = g_slice_new0 (AuthorizeClosure);
+	closure->iface = g_object_ref (iface);
+	closure->invocation = g_object_ref (invocation);
+	closure->action_id = g_strdup (action_id);
+	g_main_context_invoke (NULL, on_idle_check_authorization, closure);
+
+	return FALSE;
+}
+
+static gboolean
+have_clients (void)
+{
+	gboolean ret;
+
+	G_LOCK (service_clients);
+	ret = g_hash_table_size (service_clients) > 0;
+	G_UNLOCK (service_clients);
 
 	return ret;
 }
 
+static gboolean
+remove_client (const gchar *name)
+{
+	gboolean ret;
+
+	G_LOCK (service_clients);
+	ret = g_hash_table_remove (service_clients, name);
+	G_UNLOCK (service_clients);
+
+	if (ret)
+		realm_daemon_poke ();
+	return ret;
+}
+
 static void
-on_client_vanished (GDBusConnection *connection,
-                    const gchar *name,
-                    gpointer user_data)
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar *sender_name,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *signal_name,
+                       GVariant *parameters,
+                       gpointer user_data)
 {
-	g_hash_table_remove (service_clients, name);
+	const gchar *name;
+	const gchar *old_owner;
+	const gchar *new_owner;
+	gboolean ours;
+
+	if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+		return;
+
+	g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+	/* We only track clients by their unique names */
+	if (new_owner[0] != '\0' || !g_dbus_is_unique_name (name))
+		return;
+
+	/*
+	 * Most names that leave the bus never talked to us. Each of these is
+	 * a single lookup, and tells us whether the name was one of ours.
+	 * Nobody is left to read the results of anything the client started.
+	 */
+	ours = remove_client (name);
+	if (ours)
+		g_debug ("client vanished: %s", name);
+	ours = realm_invocation_cancel_for_sender (name) || ours;
+	ours = realm_trace_forget_sender (name) || ours;
+	ours = authorized_cache_flush (name) || ours;
+	if (!ours)
+		return;
+
+	realm_kerberos_forget_sender (name);
 }
 
 static RealmClient *
@@ -192,14 +381,13 @@ lookup_or_register_client (const gchar *sender)
 {
 	RealmClient *client;
 
+	G_LOCK (service_clients);
 	client = g_hash_table_lookup (service_clients, sender);
 	if (!client) {
 		client = g_slice_new0 (RealmClient);
-		client->watch = g_bus_watch_name (G_BUS_TYPE_SYSTEM, sender,
-		                                  G_BUS_NAME_WATCHER_FLAGS_NONE,
-		                                  NULL, on_client_vanished, NULL, NULL);
 		g_hash_table_insert (service_clients, g_strdup (sender), client);
 	}
+	G_UNLOCK (service_clients);
 
 	return client;
 }
@@ -216,9 +404,11 @@ realm_daemon_hold (const gchar *hold)
 	g_assert (!g_dbus_is_unique_name (hold));
 
 
+	G_LOCK (service_clients);
 	if (g_hash_table_lookup (service_clients, hold))
 		g_critical ("realm_daemon_hold: already have hold: %s", hold);
 	g_hash_table_insert (service_clients, g_strdup (hold), g_slice_new0 (RealmClient));
+	G_UNLOCK (service_clients);
 }
 
 void
@@ -227,7 +417,7 @@ realm_daemon_release (const gchar *hold)
 	g_assert (hold != NULL);
 	g_assert (!g_dbus_is_unique_name (hold));
 
-	if (!g_hash_table_remove (service_clients, hold))
+	if (!remove_client (hold))
 		g_critical ("realm_daemon_release: don't have hold: %s", hold);
 }
 
@@ -239,7 +429,7 @@ on_service_timeout (gpointer data)
 
 	service_timeout_id = 0;
 
-	if (g_hash_table_size (service_clients) > 0)
+	if (have_clients ())
 		return FALSE;
 
 	now = g_get_monotonic_time ();
@@ -260,7 +450,7 @@ realm_daemon_poke (void)
 {
 	if (service_persist)
 		return;
-	if (g_hash_table_size (service_clients) > 0)
+	if (have_clients ())
 		return;
 	service_quit_at = g_get_monotonic_time () + (TIMEOUT * G_TIME_SPAN_SECOND);
 	if (service_timeout_id == 0)
@@ -268,26 +458,13 @@ realm_daemon_poke (void)
 }
 
 static void
-realm_client_unwatch_and_free (gpointer data)
+realm_client_free (gpointer data)
 {
 	RealmClient *client = data;
 
 	g_assert (data != NULL);
-	if (client->watch)
-		g_bus_unwatch_name (client->watch);
 	g_free (client->locale);
 	g_slice_free (RealmClient, client);
-
-	realm_daemon_poke ();
-}
-
-static gboolean
-on_idle_hold_for_message (gpointer user_data)
-{
-	GDBusMessage *message = user_data;
-	const gchar *sender = g_dbus_message_get_sender (message);
-	lookup_or_register_client (sender);
-	return FALSE; /* don't call again */
 }
 
 static GDBusMessage *
@@ -297,22 +474,27 @@ on_connection_filter (GDBusConnection *connection,
                       gpointer user_data)
 {
 	const gchar *own_name = user_data;
+	const gchar *sender;
 	GDBusMessageType type;
 
 	/* Each time we see an incoming function call, keep the service alive */
 	if (incoming) {
 		type = g_dbus_message_get_message_type (message);
 		if (type == G_DBUS_MESSAGE_TYPE_METHOD_CALL) {
-
-			/* All methods besides 'Release' on the Service interface cause us to watch client */
-			if (g_str_equal (own_name , g_dbus_message_get_sender (message)) &&
-			    (!g_str_equal (g_dbus_message_get_path (message), REALM_DBUS_SERVICE_PATH) ||
-			     !g_str_equal (g_dbus_message_get_member (message), "Release") ||
-			     !g_str_equal (g_dbus_message_get_interface (message), REALM_DBUS_SERVICE_INTERFACE))) {
-				g_idle_add_full (G_PRIORITY_DEFAULT,
-				                 on_idle_hold_for_message,
-				                 g_object_ref (message),
-				                 g_object_unref);
+			sender = g_dbus_message_get_sender (message);
+
+			/*
+			 * All methods besides 'Release' on the Service interface, and those
+			 * on the Metrics interface, cause us to track the client. We do this
+			 * right here, rather than in an idle, so the client is registered
+			 * before we could see its NameOwnerChanged.
+			 */
+			if (sender != NULL && !g_str_equal (own_name, sender) &&
+			    g_strcmp0 (g_dbus_message_get_interface (message), REALM_DBUS_METRICS_INTERFACE) != 0 &&
+			    (g_strcmp0 (g_dbus_message_get_path (message), REALM_DBUS_SERVICE_PATH) != 0 ||
+			     g_strcmp0 (g_dbus_message_get_member (message), "Release") != 0 ||
+			     g_strcmp0 (g_dbus_message_get_interface (message), REALM_DBUS_SERVICE_INTERFACE) != 0)) {
+				lookup_or_register_client (sender);
 			}
 		}
 	}
@@ -327,7 +509,8 @@ on_service_release (RealmDbusService *object,
 	const char *sender;
 
 	sender = g_dbus_method_invocation_get_sender (invocation);
-	g_hash_table_remove (service_clients, sender);
+	authorized_cache_flush (sender);
+	remove_client (sender);
 
 	return TRUE;
 }
@@ -360,6 +543,117 @@ on_service_set_locale (RealmDbusService *object,
 	return TRUE;
 }
 
+static void
+update_worker_metrics (void)
+{
+	RealmWorkerStats stats;
+
+	realm_worker_get_stats (&stats);
+	realm_metrics_set (REALM_METRIC_WORKER, "threads", stats.threads);
+	realm_metrics_set (REALM_METRIC_WORKER, "running", stats.running);
+	realm_metrics_set (REALM_METRIC_WORKER, "queued", stats.queued);
+	realm_metrics_set (REALM_METRIC_WORKER, "peak-queued", stats.peak_queued);
+}
+
+static gboolean
+on_metrics_get_metrics (RealmDbusMetrics *object,
+                        GDBusMethodInvocation *invocation)
+{
+	update_worker_metrics ();
+	realm_dbus_metrics_complete_get_metrics (object, invocation,
+	                                         realm_metrics_to_variant ());
+	return TRUE;
+}
+
+static gboolean
+on_metrics_get_prometheus_text (RealmDbusMetrics *object,
+                                GDBusMethodInvocation *invocation)
+{
+	gchar *text;
+
+	update_worker_metrics ();
+	text = realm_metrics_to_prometheus ();
+	realm_dbus_metrics_complete_get_prometheus_text (object, invocation, text);
+	g_free (text);
+
+	return TRUE;
+}
+
+static gboolean
+on_metrics_get_trace (RealmDbusMetrics *object,
+                      GDBusMethodInvocation *invocation,
+                      const gchar *operation)
+{
+	gchar *json;
+
+	json = realm_trace_to_json (g_dbus_method_invocation_get_sender (invocation), operation);
+	realm_dbus_metrics_complete_get_trace (object, invocation, json);
+	g_free (json);
+
+	return TRUE;
+}
+
+static gboolean
+on_metrics_get_diagnostics (RealmDbusMetrics *object,
+                            GDBusMethodInvocation *invocation,
+                            const gchar *operation)
+{
+	gchar **lines;
+
+	lines = realm_diagnostics_get_history (operation);
+	realm_dbus_metrics_complete_get_diagnostics (object, invocation,
+	                                             (const gchar * const *)lines);
+	g_strfreev (lines);
+
+	return TRUE;
+}
+
+static gboolean
+on_metrics_authorize_method (GDBusInterfaceSkeleton *iface,
+                             GDBusMethodInvocation *invocation,
+                             gpointer user_data)
+{
+	const gchar *method = g_dbus_method_invocation_get_method_name (invocation);
+
+	/* Diagnostics contain user and host names, unlike the metrics */
+	if (g_str_equal (method, "GetDiagnostics"))
+		return realm_daemon_authorize_method (iface, invocation,
+		                                      "org.freedesktop.realmd.configure-realm");
+
+	return TRUE;
+}
+
+static void
+export_metrics (GDBusConnection *connection)
+{
+	const gdouble *buckets;
+	GError *error = NULL;
+	guint n_buckets;
+
+	service_metrics = realm_dbus_metrics_skeleton_new ();
+	buckets = realm_metrics_get_buckets (&n_buckets);
+	realm_dbus_metrics_set_histogram_buckets (service_metrics,
+	                                          g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, buckets,
+	                                                                     n_buckets, sizeof (gdouble)));
+	g_signal_connect (service_metrics, "handle-get-metrics",
+	                  G_CALLBACK (on_metrics_get_metrics), NULL);
+	g_signal_connect (service_metrics, "handle-get-prometheus-text",
+	                  G_CALLBACK (on_metrics_get_prometheus_text), NULL);
+	g_signal_connect (service_metrics, "handle-get-trace",
+	                  G_CALLBACK (on_metrics_get_trace), NULL);
+	g_signal_connect (service_metrics, "handle-get-diagnostics",
+	                  G_CALLBACK (on_metrics_get_diagnostics), NULL);
+	g_signal_connect (service_metrics, "g-authorize-method",
+	                  G_CALLBACK (on_metrics_authorize_method), NULL);
+
+	g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (service_metrics),
+	                                  connection, REALM_DBUS_SERVICE_PATH, &error);
+	if (error != NULL) {
+		g_warning ("Couldn't export metrics DBus interface: %s", error->message);
+		g_clear_error (&error);
+	}
+}
+
 static void
 on_name_acquired (GDBusConnection *connection,
                   const gchar *name,
@@ -415,11 +709,19 @@ on_bus_get_connection (GObject *source,
 		g_dbus_connection_add_filter (connection, on_connection_filter,
 		                              (gchar *)self_name, NULL);
 
+		/* One subscription to notice when any of our clients go away */
+		g_dbus_connection_signal_subscribe (connection, "org.freedesktop.DBus",
+		                                    "org.freedesktop.DBus", "NameOwnerChanged",
+		                                    "/org/freedesktop/DBus", NULL,
+		                                    G_DBUS_SIGNAL_FLAGS_NONE,
+		                                    on_name_owner_changed, NULL, NULL);
+
 		realm_diagnostics_initialize (connection);
 
 		object_server = g_dbus_object_manager_server_new (REALM_DBUS_SERVICE_PATH);
 
 		all_provider = realm_all_provider_new_and_export (connection);
+		export_metrics (connection);
 
 		provider = realm_sssd_ad_provider_new ();
 		g_dbus_object_manager_server_export (object_server, G_DBUS_OBJECT_SKELETON (provider));
@@ -526,7 +828,7 @@ main (int argc,
 
 	realm_error = realm_error_quark ();
 	service_clients = g_hash_table_new_full (g_str_hash, g_str_equal,
-	                                         g_free, realm_client_unwatch_and_free);
+	                                         g_free, realm_client_free);
 	realm_daemon_hold ("main");
 
 	/* Load the platform specific data */
@@ -551,11 +853,13 @@ main (int argc,
 		g_object_unref (object_server);
 	}
 
-	G_LOCK (polkit_authority);
 	g_clear_object (&polkit_authority);
-	G_UNLOCK (polkit_authority);
+	g_clear_object (&service_metrics);
+	if (authorized_cache)
+		g_hash_table_destroy (authorized_cache);
 
 	g_debug ("stopping service");
+	realm_log_flush ();
 	realm_settings_uninit ();
 	g_main_loop_unref (main_loop);
 	g_option_context_free (context);
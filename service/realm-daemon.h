@@ -21,10 +21,6 @@
 
 G_BEGIN_DECLS
 
-gboolean             realm_daemon_lock_for_action            (GDBusMethodInvocation *invocation);
-
-void                 realm_daemon_unlock_for_action          (GDBusMethodInvocation *invocation);
-
 void                 realm_daemon_set_locale_until_loop      (GDBusMethodInvocation *invocation);
 
 void                 realm_daemon_hold                       (const gchar *identifier);
@@ -39,7 +35,8 @@ gboolean             realm_daemon_has_debug_flag             (void);
 
 void                 realm_daemon_poke                       (void);
 
-gboolean             realm_daemon_check_dbus_action          (const gchar *sender,
+gboolean             realm_daemon_authorize_method           (GDBusInterfaceSkeleton *iface,
+                                                              GDBusMethodInvocation *invocation,
                                                               const gchar *action_id);
 
 void                 realm_daemon_export_object              (GDBusObjectSkeleton *object);
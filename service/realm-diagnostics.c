@@ -16,13 +16,53 @@
 
 #include "realm-dbus-constants.h"
 #include "realm-diagnostics.h"
+#include "realm-log.h"
 
 #include <string.h>
 #include <syslog.h>
 
 static GDBusConnection *the_connection = NULL;
-static GString *line_buffer = NULL;
 static GQuark operation_id_quark = 0;
+static GQuark realm_name_quark = 0;
+static GQuark line_buffer_quark = 0;
+
+/*
+ * A partial line, along with the fields to log it with. These are copied,
+ * as the invocation's own may be gone by the time the buffer is freed.
+ */
+typedef struct {
+	GString *line;
+	int log_level;
+	gchar *operation_id;
+	gchar *realm_name;
+	gchar *command;
+} LineBuffer;
+
+/* Partial lines logged outside of any invocation */
+G_LOCK_DEFINE_STATIC (line_buffer);
+static LineBuffer *line_buffer = NULL;
+
+/*
+ * The most recent diagnostics of operations that were given an operation
+ * id are kept, so that they can be retrieved after the fact. Only the
+ * last lines of each operation are kept, and the least recently used
+ * operation is forgotten first.
+ */
+
+#define HISTORY_LINES       256  /* per operation */
+#define HISTORY_OPERATIONS  16
+
+typedef struct {
+	gchar *operation_id;
+	gchar *lines[HISTORY_LINES];
+	guint next;
+	guint count;
+	guint dropped;
+} HistoryRing;
+
+/* Most recently used first */
+G_LOCK_DEFINE_STATIC (history);
+static GQueue history = G_QUEUE_INIT;
 
 void
 realm_diagnostics_initialize (GDBusConnection *connection)
@@ -37,6 +77,8 @@ realm_diagnostics_initialize (GDBusConnection *connection)
 	g_object_add_weak_pointer (G_OBJECT (the_connection), (gpointer *)&the_connection);
 
 	operation_id_quark = g_quark_from_static_string ("realm-diagnostics-operation-id");
+	realm_name_quark = g_quark_from_static_string ("realm-diagnostics-realm-name");
+	line_buffer_quark = g_quark_from_static_string ("realm-diagnostics-line-buffer");
 }
 
 const gchar *
@@ -54,30 +96,106 @@ realm_diagnostics_setup_options (GDBusMethodInvocation *invocation,
 	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
 	g_return_if_fail (options != NULL);
 
-	if (g_variant_lookup (options, REALM_DBUS_OPTION_OPERATION, "(s)", &operation_id)) {
+	if (g_variant_lookup (options, REALM_DBUS_OPTION_OPERATION, "s", &operation_id)) {
 		g_object_set_qdata_full (G_OBJECT (invocation), operation_id_quark,
 		                         operation_id, g_free);
 	}
 }
 
+void
+realm_diagnostics_set_realm (GDBusMethodInvocation *invocation,
+                             const gchar *realm_name)
+{
+	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
+
+	g_object_set_qdata_full (G_OBJECT (invocation), realm_name_quark,
+	                         g_strdup (realm_name), g_free);
+}
+
+static LineBuffer *
+line_buffer_new (void)
+{
+	LineBuffer *buffer = g_slice_new0 (LineBuffer);
+	buffer->line = g_string_new ("");
+	return buffer;
+}
+
+static void
+line_buffer_keep (LineBuffer *buffer,
+                  int log_level,
+                  const gchar *operation_id,
+                  const gchar *realm_name,
+                  const gchar *command,
+                  const gchar *data,
+                  gsize length)
+{
+	g_string_append_len (buffer->line, data, length);
+	buffer->log_level = log_level;
+	g_free (buffer->operation_id);
+	buffer->operation_id = g_strdup (operation_id);
+	g_free (buffer->realm_name);
+	buffer->realm_name = g_strdup (realm_name);
+	g_free (buffer->command);
+	buffer->command = g_strdup (command);
+}
+
 static void
-log_syslog_and_debug (int log_level,
-                      gchar *string,
-                      gsize length)
+line_buffer_free (gpointer data)
 {
+	LineBuffer *buffer = data;
+	if (buffer->line->len > 0) {
+		realm_log_write (buffer->log_level, buffer->operation_id, buffer->realm_name,
+		                 buffer->command, buffer->line->str);
+	}
+	g_string_free (buffer->line, TRUE);
+	g_free (buffer->operation_id);
+	g_free (buffer->realm_name);
+	g_free (buffer->command);
+	g_slice_free (LineBuffer, buffer);
+}
+
+/*
+ * Partial lines are kept per invocation, so that output from operations
+ * running at the same time isn't joined together.
+ */
+static void
+log_lines (GDBusMethodInvocation *invocation,
+           int log_level,
+           const gchar *command,
+           gchar *string,
+           gsize length)
+{
+	const gchar *operation_id = NULL;
+	const gchar *realm_name = NULL;
+	LineBuffer *buffer;
 	gchar *at = string;
 	gchar *ptr;
 
+	if (invocation) {
+		operation_id = g_object_get_qdata (G_OBJECT (invocation), operation_id_quark);
+		realm_name = g_object_get_qdata (G_OBJECT (invocation), realm_name_quark);
+		buffer = g_object_get_qdata (G_OBJECT (invocation), line_buffer_quark);
+		if (buffer == NULL) {
+			buffer = line_buffer_new ();
+			g_object_set_qdata_full (G_OBJECT (invocation), line_buffer_quark,
+			                         buffer, line_buffer_free);
+		}
+	} else {
+		G_LOCK (line_buffer);
+		if (line_buffer == NULL)
+			line_buffer = line_buffer_new ();
+		buffer = line_buffer;
+	}
+
 	/* Print all stderr lines as messages */
 	while ((ptr = memchr (at, '\n', length)) != NULL) {
 		*ptr = '\0';
-		if (line_buffer && line_buffer->len > 0) {
-			syslog (log_level, "%s%s", line_buffer->str, at);
-			g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s%s", line_buffer->str, at);
-			g_string_set_size (line_buffer, 0);
+		if (buffer->line->len > 0) {
+			g_string_append (buffer->line, at);
+			realm_log_write (log_level, operation_id, realm_name, command, buffer->line->str);
+			g_string_set_size (buffer->line, 0);
 		} else {
-			syslog (log_level, "%s", at);
-			g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s", at);
+			realm_log_write (log_level, operation_id, realm_name, command, at);
 		}
 
 		*ptr = '\n';
@@ -86,27 +204,130 @@ log_syslog_and_debug (int log_level,
 		at = ptr;
 	}
 
-	if (length != 0) {
-		if (line_buffer == NULL)
-			line_buffer = g_string_new_len (at, length);
-		else
-			g_string_append_len (line_buffer, at, length);
+	if (length != 0)
+		line_buffer_keep (buffer, log_level, operation_id, realm_name, command, at, length);
+
+	if (invocation == NULL)
+		G_UNLOCK (line_buffer);
+}
+
+static void
+history_ring_free (HistoryRing *ring)
+{
+	guint i;
+
+	for (i = 0; i < HISTORY_LINES; i++)
+		g_free (ring->lines[i]);
+	g_free (ring->operation_id);
+	g_slice_free (HistoryRing, ring);
+}
+
+static gint
+compare_history_operation (gconstpointer a,
+                           gconstpointer b)
+{
+	const HistoryRing *ring = a;
+	return strcmp (ring->operation_id, b);
+}
+
+/* Called with the lock held */
+static HistoryRing *
+history_lookup (const gchar *operation_id,
+                gboolean create)
+{
+	HistoryRing *ring;
+	GList *link;
+
+	link = g_queue_find_custom (&history, operation_id, compare_history_operation);
+	if (link != NULL) {
+		g_queue_unlink (&history, link);
+		g_queue_push_head_link (&history, link);
+		return link->data;
 	}
+
+	if (!create)
+		return NULL;
+
+	if (g_queue_get_length (&history) >= HISTORY_OPERATIONS)
+		history_ring_free (g_queue_pop_tail (&history));
+
+	ring = g_slice_new0 (HistoryRing);
+	ring->operation_id = g_strdup (operation_id);
+	g_queue_push_head (&history, ring);
+	return ring;
 }
 
 static void
-log_take_diagnostic (GDBusMethodInvocation *invocation,
-                     int log_level,
-                     gchar *string)
+history_add (GDBusMethodInvocation *invocation,
+             const gchar *string)
+{
+	const gchar *operation_id;
+	HistoryRing *ring;
+
+	if (invocation == NULL)
+		return;
+
+	operation_id = g_object_get_qdata (G_OBJECT (invocation), operation_id_quark);
+	if (operation_id == NULL || operation_id[0] == '\0')
+		return;
+
+	G_LOCK (history);
+
+	ring = history_lookup (operation_id, TRUE);
+	if (ring->count == HISTORY_LINES)
+		ring->dropped++;
+	else
+		ring->count++;
+	g_free (ring->lines[ring->next]);
+	ring->lines[ring->next] = g_strdup (string);
+	ring->next = (ring->next + 1) % HISTORY_LINES;
+
+	G_UNLOCK (history);
+}
+
+/*
+ * Returns the kept diagnostics for @operation_id, oldest first, or
+ * an empty array if there are none.
+ */
+gchar **
+realm_diagnostics_get_history (const gchar *operation_id)
 {
-	static gboolean syslog_initialized = FALSE;
+	HistoryRing *ring;
+	GPtrArray *lines;
+	guint i;
+
+	g_return_val_if_fail (operation_id != NULL, NULL);
+
+	lines = g_ptr_array_new ();
 
-	if (!syslog_initialized) {
-		openlog ("realmd", 0, LOG_AUTH);
-		syslog_initialized = TRUE;
+	G_LOCK (history);
+
+	ring = history_lookup (operation_id, FALSE);
+	if (ring != NULL) {
+		if (ring->dropped > 0) {
+			g_ptr_array_add (lines, g_strdup_printf (" ! %u earlier lines were not kept\n",
+			                                         ring->dropped));
+		}
+		for (i = 0; i < ring->count; i++) {
+			g_ptr_array_add (lines, g_strdup (ring->lines[(ring->next + HISTORY_LINES -
+			                                               ring->count + i) % HISTORY_LINES]));
+		}
 	}
 
-	log_syslog_and_debug (log_level, string, strlen (string));
+	G_UNLOCK (history);
+
+	g_ptr_array_add (lines, NULL);
+	return (gchar **)g_ptr_array_free (lines, FALSE);
+}
+
+static void
+log_take_diagnostic (GDBusMethodInvocation *invocation,
+                     int log_level,
+                     const gchar *command,
+                     gchar *string)
+{
+	log_lines (invocation, log_level, command, string, strlen (string));
+	history_add (invocation, string);
 
 	realm_diagnostics_signal (invocation, string);
 	g_free (string);
@@ -131,7 +352,7 @@ realm_diagnostics_info (GDBusMethodInvocation *invocation,
 	if (!g_str_has_suffix (message->str, "\n"))
 		g_string_append_c (message, '\n');
 
-	log_take_diagnostic (invocation, LOG_INFO, g_string_free (message, FALSE));
+	log_take_diagnostic (invocation, LOG_INFO, NULL, g_string_free (message, FALSE));
 }
 
 void
@@ -160,13 +381,23 @@ realm_diagnostics_error (GDBusMethodInvocation *invocation,
 
 	g_string_append_c (message, '\n');
 
-	log_take_diagnostic (invocation, LOG_INFO, g_string_free (message, FALSE));
+	log_take_diagnostic (invocation, LOG_INFO, NULL, g_string_free (message, FALSE));
 }
 
 void
 realm_diagnostics_info_data (GDBusMethodInvocation *invocation,
                              const gchar *data,
                              gssize n_data)
+{
+	realm_diagnostics_info_command (invocation, NULL, data, n_data);
+}
+
+/* Output from @command, which is logged along with its name */
+void
+realm_diagnostics_info_command (GDBusMethodInvocation *invocation,
+                                const gchar *command,
+                                const gchar *data,
+                                gssize n_data)
 {
 	gchar *info;
 	gsize length;
@@ -185,7 +416,7 @@ realm_diagnostics_info_data (GDBusMethodInvocation *invocation,
 		                                "\xef\xbf\xbd", NULL, &length, NULL);
 	}
 
-	log_take_diagnostic (invocation, LOG_INFO, info);
+	log_take_diagnostic (invocation, LOG_INFO, command, info);
 }
 
 void
@@ -32,10 +32,18 @@ void          realm_diagnostics_info                  (GDBusMethodInvocation *in
                                                        const gchar *format,
                                                        ...) G_GNUC_PRINTF (2, 3);
 
+void          realm_diagnostics_set_realm             (GDBusMethodInvocation *invocation,
+                                                       const gchar *realm_name);
+
 void          realm_diagnostics_info_data             (GDBusMethodInvocation *invocation,
                                                        const gchar *data,
                                                        gssize n_data);
 
+void          realm_diagnostics_info_command          (GDBusMethodInvocation *invocation,
+                                                       const gchar *command,
+                                                       const gchar *data,
+                                                       gssize n_data);
+
 void          realm_diagnostics_error                 (GDBusMethodInvocation *invocation,
                                                        GError *error,
                                                        const gchar *format,
@@ -44,6 +52,8 @@ void          realm_diagnostics_error                 (GDBusMethodInvocation *in
 void          realm_diagnostics_signal                (GDBusMethodInvocation *invocation,
                                                        const gchar *data);
 
+gchar **      realm_diagnostics_get_history           (const gchar *operation_id);
+
 G_END_DECLS
 
 #endif /* __REALM_DIAGNOSTICS_H__ */
@@ -16,23 +16,61 @@
 
 #include "realm-settings.h"
 #include "realm-ini-config.h"
+#include "realm-metrics.h"
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define REALM_INI_CONFIG_CLASS(klass)       (G_TYPE_CHECK_CLASS_CAST ((klass), REALM_TYPE_INI_CONFIG, RealmIniConfigClass))
 #define REALM_IS_INI_CONFIG_CLASS(klass)    (G_TYPE_CHECK_CLASS_TYPE ((klass), REALM_TYPE_INI_CONFIG))
 #define REALM_INI_CONFIG_GET_CLASS(obj)     (G_TYPE_INSTANCE_GET_CLASS ((obj), REALM_TYPE_INI_CONFIG, RealmIniConfigClass))
 
+typedef struct _ConfigArena ConfigArena;
+
+/*
+ * A parameter whose value is being changed as a list. The line data
+ * is only regenerated from the items when it's next needed.
+ */
+typedef struct {
+	gchar *delimiters;              /* the value was split with these */
+	gchar *name;                    /* written in the line */
+	GQueue items;                   /* gchar *, stripped and non-empty */
+	GHashTable *index;              /* item -> GSList of GList links */
+	gboolean dirty;
+} ConfigList;
+
 typedef struct _ConfigLine {
-	gchar *name;
-	GBytes *bytes;
+	const gchar *name;              /* in arena, or owned if by itself */
+	gint type;
+	const gchar *data;
+	gsize length;
+	gchar *owned;                   /* data, if not pointing into arena */
+	ConfigArena *arena;             /* or NULL if allocated by itself */
+	ConfigList *list;               /* or NULL unless changed as a list */
 	struct _ConfigLine *prev;
 	struct _ConfigLine *next;
 } ConfigLine;
 
+/*
+ * All the lines parsed from one buffer are allocated together, and
+ * point into that buffer. Freed when the last of its lines is freed.
+ */
+struct _ConfigArena {
+	guint lines_alive;
+	GBytes *bytes;
+	GStringChunk *names;            /* section and parameter names */
+	ConfigLine lines[1];
+};
+
 typedef struct {
 	GHashTable *parameters;
 	ConfigLine *head;
@@ -47,10 +85,26 @@ struct _RealmIniConfig {
 	ConfigLine *tail;
 	gboolean changing;
 
+	/* Changes not yet signalled */
+	gboolean changed;
+	GHashTable *changed_sections;
+	GHashTable *changed_keys;
+
 	gchar *filename;
 	GFileMonitor *monitor;
 	gulong monitor_sig;
 	guint reload_scheduled;
+
+	/* What we last wrote to the file, see file_is_as_written() */
+	gchar *written_checksum;
+	dev_t written_dev;
+	ino_t written_ino;
+	off_t written_size;
+	struct timespec written_mtime;
+	struct timespec written_ctime;
+
+	/* Key in shared_configs, if shared */
+	gchar *shared_path;
 };
 
 typedef struct {
@@ -64,12 +118,25 @@ enum {
 
 enum {
 	CHANGED,
+	SECTION_CHANGED,
+	KEY_CHANGED,
 	NUM_SIGNALS
 };
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/* Canonical path -> RealmIniConfig, which are not owned here */
+static GHashTable *shared_configs = NULL;
+
 G_DEFINE_TYPE (RealmIniConfig, realm_ini_config, G_TYPE_OBJECT);
 
+enum {
+	NONE,
+	COMMENT,
+	SECTION,
+	PARAMETER,
+	INVALID
+};
+
 static guint
 conf_str_hash (gconstpointer v)
 {
@@ -102,13 +169,159 @@ config_section_free (gpointer data)
 	g_slice_free (ConfigSection, sect);
 }
 
+static void
+config_arena_free (ConfigArena *arena)
+{
+	g_bytes_unref (arena->bytes);
+	g_string_chunk_free (arena->names);
+	g_free (arena);
+}
+
+static void
+config_list_free (ConfigList *list)
+{
+	if (list == NULL)
+		return;
+	g_hash_table_destroy (list->index);
+	g_queue_foreach (&list->items, (GFunc)g_free, NULL);
+	g_queue_clear (&list->items);
+	g_free (list->delimiters);
+	g_free (list->name);
+	g_slice_free (ConfigList, list);
+}
+
 static void
 config_line_free (gpointer data)
 {
 	ConfigLine *line = data;
-	g_free (line->name);
-	g_bytes_unref (line->bytes);
-	g_slice_free (ConfigLine, line);
+	ConfigArena *arena = line->arena;
+
+	config_list_free (line->list);
+	g_free (line->owned);
+	if (arena == NULL) {
+		g_free ((gchar *)line->name);
+		g_slice_free (ConfigLine, line);
+	} else if (--arena->lines_alive == 0) {
+		config_arena_free (arena);
+	}
+}
+
+static void
+config_line_take_data (ConfigLine *line,
+                       gchar *data)
+{
+	g_free (line->owned);
+	line->owned = data;
+	line->data = data;
+	line->length = strlen (data);
+}
+
+static ConfigLine *
+config_line_new_take (gint type,
+                      const gchar *name,
+                      gchar *data)
+{
+	ConfigLine *line;
+
+	line = g_slice_new0 (ConfigLine);
+	line->type = type;
+	line->name = g_strdup (name);
+	config_line_take_data (line, data);
+	return line;
+}
+
+static void
+config_list_index_item (ConfigList *list,
+                        GList *link)
+{
+	GSList *links;
+
+	/* Duplicates are kept, so all of them have to be indexed */
+	links = g_hash_table_lookup (list->index, link->data);
+	if (links == NULL)
+		g_hash_table_insert (list->index, link->data, g_slist_prepend (NULL, link));
+	else
+		links->next = g_slist_prepend (links->next, link);
+}
+
+static void
+config_list_append (ConfigList *list,
+                    const gchar *item)
+{
+	g_queue_push_tail (&list->items, g_strdup (item));
+	config_list_index_item (list, list->items.tail);
+}
+
+static void
+config_list_remove (ConfigList *list,
+                    const gchar *item)
+{
+	GSList *links, *l;
+	GList *link;
+
+	links = g_hash_table_lookup (list->index, item);
+	if (links == NULL)
+		return;
+
+	/* Steal first, since the key is one of the items being freed */
+	g_hash_table_steal (list->index, item);
+	for (l = links; l != NULL; l = l->next) {
+		link = l->data;
+		g_free (link->data);
+		g_queue_delete_link (&list->items, link);
+	}
+	g_slist_free (links);
+}
+
+static ConfigList *
+config_list_new (const gchar *value,
+                 const gchar *delimiters)
+{
+	ConfigList *list;
+	gchar **values;
+	gint i;
+
+	list = g_slice_new0 (ConfigList);
+	list->delimiters = g_strdup (delimiters);
+	list->index = g_hash_table_new_full (conf_str_hash, conf_str_equal, NULL,
+	                                     (GDestroyNotify)g_slist_free);
+	g_queue_init (&list->items);
+
+	values = g_strsplit_set (value, delimiters, -1);
+	for (i = 0; values[i] != NULL; i++) {
+		g_strstrip (values[i]);
+		if (!g_str_equal (values[i], ""))
+			config_list_append (list, values[i]);
+	}
+	g_strfreev (values);
+
+	return list;
+}
+
+/* Write out the list into the line, in the same form as set_list() */
+static void
+config_line_sync_list (ConfigLine *line)
+{
+	ConfigList *list = line->list;
+	GString *data;
+	GList *l;
+
+	if (list == NULL || !list->dirty)
+		return;
+
+	data = g_string_new (list->name);
+	g_string_append (data, " = ");
+	for (l = list->items.head; l != NULL; l = l->next) {
+		if (l != list->items.head) {
+			g_string_append_c (data, list->delimiters[0]);
+			g_string_append_c (data, ' ');
+		}
+		g_string_append (data, l->data);
+	}
+	g_string_append_c (data, '\n');
+
+	config_line_take_data (line, g_string_free (data, FALSE));
+	list->dirty = FALSE;
 }
 
 static void
@@ -116,6 +329,94 @@ realm_ini_config_init (RealmIniConfig *self)
 {
 	self->sections = g_hash_table_new_full (conf_str_hash, conf_str_equal,
 	                                        NULL, config_section_free);
+	self->changed_sections = g_hash_table_new_full (conf_str_hash, conf_str_equal,
+	                                                g_free, NULL);
+	self->changed_keys = g_hash_table_new_full (conf_str_hash, conf_str_equal,
+	                                            g_free, (GDestroyNotify)g_hash_table_unref);
+}
+
+static void
+note_section_changed (RealmIniConfig *self,
+                      const gchar *section)
+{
+	self->changed = TRUE;
+	if (section != NULL)
+		g_hash_table_replace (self->changed_sections, g_strdup (section), NULL);
+}
+
+static void
+note_key_changed (RealmIniConfig *self,
+                  const gchar *section,
+                  const gchar *name)
+{
+	GHashTable *keys;
+
+	self->changed = TRUE;
+	if (section == NULL || name == NULL)
+		return;
+
+	keys = g_hash_table_lookup (self->changed_keys, section);
+	if (keys == NULL) {
+		keys = g_hash_table_new_full (conf_str_hash, conf_str_equal, g_free, NULL);
+		g_hash_table_replace (self->changed_keys, g_strdup (section), keys);
+	}
+
+	g_hash_table_replace (keys, g_strdup (name), NULL);
+}
+
+static void
+note_all_sections_changed (RealmIniConfig *self)
+{
+	GHashTableIter iter;
+	const gchar *section;
+
+	self->changed = TRUE;
+	g_hash_table_iter_init (&iter, self->sections);
+	while (g_hash_table_iter_next (&iter, (gpointer *)&section, NULL))
+		note_section_changed (self, section);
+}
+
+static void
+emit_changes (RealmIniConfig *self)
+{
+	GHashTable *changed_sections;
+	GHashTable *changed_keys;
+	GHashTableIter iter;
+	GHashTableIter keys;
+	const gchar *section;
+	const gchar *name;
+	GHashTable *names;
+
+	if (self->changing || !self->changed)
+		return;
+
+	/* Handlers may cause further changes, so steal these first */
+	changed_sections = self->changed_sections;
+	changed_keys = self->changed_keys;
+	self->changed_sections = g_hash_table_new_full (conf_str_hash, conf_str_equal,
+	                                                g_free, NULL);
+	self->changed_keys = g_hash_table_new_full (conf_str_hash, conf_str_equal,
+	                                            g_free, (GDestroyNotify)g_hash_table_unref);
+	self->changed = FALSE;
+
+	g_hash_table_iter_init (&iter, changed_sections);
+	while (g_hash_table_iter_next (&iter, (gpointer *)&section, NULL))
+		g_signal_emit (self, signals[SECTION_CHANGED], 0, section);
+
+	/* A changed section implies all its keys changed */
+	g_hash_table_iter_init (&iter, changed_keys);
+	while (g_hash_table_iter_next (&iter, (gpointer *)&section, (gpointer *)&names)) {
+		if (g_hash_table_lookup_extended (changed_sections, section, NULL, NULL))
+			continue;
+		g_hash_table_iter_init (&keys, names);
+		while (g_hash_table_iter_next (&keys, (gpointer *)&name, NULL))
+			g_signal_emit (self, signals[KEY_CHANGED], 0, section, name);
+	}
+
+	g_hash_table_unref (changed_sections);
+	g_hash_table_unref (changed_keys);
+
+	g_signal_emit (self, signals[CHANGED], 0);
 }
 
 static void
@@ -136,11 +437,105 @@ realm_ini_config_set_property (GObject *obj,
 	}
 }
 
+static void
+forget_written_file (RealmIniConfig *self)
+{
+	g_free (self->written_checksum);
+	self->written_checksum = NULL;
+}
+
+static void
+remember_written_stat (RealmIniConfig *self,
+                       struct stat *sb)
+{
+	self->written_dev = sb->st_dev;
+	self->written_ino = sb->st_ino;
+	self->written_size = sb->st_size;
+	self->written_mtime = sb->st_mtim;
+	self->written_ctime = sb->st_ctim;
+}
+
+static void
+remember_written_file (RealmIniConfig *self,
+                       const gchar *contents,
+                       gsize length)
+{
+	struct stat sb;
+
+	forget_written_file (self);
+
+	if (stat (self->filename, &sb) < 0)
+		return;
+
+	remember_written_stat (self, &sb);
+	self->written_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+	                                                      (const guchar *)contents,
+	                                                      length);
+}
+
+static gboolean
+timespec_equal (const struct timespec *one,
+                const struct timespec *two)
+{
+	return one->tv_sec == two->tv_sec && one->tv_nsec == two->tv_nsec;
+}
+
+/*
+ * Whether the file on disk is still exactly what we last wrote to it.
+ * Our own writes trigger the directory monitor, and there's no point
+ * in reparsing what we already have in memory.
+ */
+static gboolean
+file_is_as_written (RealmIniConfig *self)
+{
+	gchar *contents;
+	gchar *checksum;
+	gsize length;
+	struct stat sb;
+	gboolean ret;
+
+	if (self->written_checksum == NULL)
+		return FALSE;
+
+	if (stat (self->filename, &sb) < 0)
+		return FALSE;
+
+	/* Same file, untouched since we wrote it */
+	if (sb.st_dev == self->written_dev &&
+	    sb.st_ino == self->written_ino &&
+	    sb.st_size == self->written_size &&
+	    timespec_equal (&sb.st_mtim, &self->written_mtime) &&
+	    timespec_equal (&sb.st_ctim, &self->written_ctime))
+		return TRUE;
+
+	if (sb.st_size != self->written_size)
+		return FALSE;
+
+	/* Touched or replaced, but perhaps with the same contents */
+	if (!g_file_get_contents (self->filename, &contents, &length, NULL))
+		return FALSE;
+
+	checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+	                                        (const guchar *)contents, length);
+	ret = g_str_equal (checksum, self->written_checksum);
+	if (ret)
+		remember_written_stat (self, &sb);
+
+	g_free (checksum);
+	g_free (contents);
+	return ret;
+}
+
 static gboolean
 on_changes_reload_file (gpointer user_data)
 {
 	RealmIniConfig *self = REALM_INI_CONFIG (user_data);
-	realm_ini_config_reload (self);
+
+	if (file_is_as_written (self))
+		self->reload_scheduled = 0;
+	else
+		realm_ini_config_reload (self);
+
 	return FALSE; /* don't call this timeout again */
 }
 
@@ -211,6 +606,7 @@ realm_ini_config_set_filename (RealmIniConfig *self,
 
 	g_free (self->filename);
 	self->filename = NULL;
+	forget_written_file (self);
 
 	if (!filename)
 		return;
@@ -258,11 +654,23 @@ realm_ini_config_finalize (GObject *obj)
 {
 	RealmIniConfig *self = REALM_INI_CONFIG (obj);
 
+	if (self->shared_path) {
+		if (g_hash_table_lookup (shared_configs, self->shared_path) == self)
+			g_hash_table_remove (shared_configs, self->shared_path);
+		if (g_hash_table_size (shared_configs) == 0) {
+			g_hash_table_destroy (shared_configs);
+			shared_configs = NULL;
+		}
+		g_free (self->shared_path);
+	}
+
 	/* Should free filename and clear up monitors */
 	realm_ini_config_set_filename (self, NULL);
 	reset_config_data (self);
 
 	g_hash_table_destroy (self->sections);
+	g_hash_table_destroy (self->changed_sections);
+	g_hash_table_destroy (self->changed_keys);
 
 	G_OBJECT_CLASS (realm_ini_config_parent_class)->finalize (obj);
 }
@@ -281,28 +689,31 @@ realm_ini_config_class_init (RealmIniConfigClass *klass)
 
 	signals[CHANGED] = g_signal_new ("changed", REALM_TYPE_INI_CONFIG, G_SIGNAL_RUN_FIRST,
 	                                 0, NULL, NULL, g_cclosure_marshal_generic, G_TYPE_NONE, 0);
-}
 
-enum {
-	NONE,
-	COMMENT,
-	SECTION,
-	PARAMETER,
-	INVALID
-};
+	/*
+	 * These are emitted before 'changed' and describe what changed. A
+	 * 'section-changed' means anything in that section may have changed,
+	 * and isn't followed by 'key-changed' for keys in that section.
+	 */
+	signals[SECTION_CHANGED] = g_signal_new ("section-changed", REALM_TYPE_INI_CONFIG, G_SIGNAL_RUN_FIRST,
+	                                         0, NULL, NULL, g_cclosure_marshal_generic, G_TYPE_NONE,
+	                                         1, G_TYPE_STRING);
+
+	signals[KEY_CHANGED] = g_signal_new ("key-changed", REALM_TYPE_INI_CONFIG, G_SIGNAL_RUN_FIRST,
+	                                     0, NULL, NULL, g_cclosure_marshal_generic, G_TYPE_NONE,
+	                                     2, G_TYPE_STRING, G_TYPE_STRING);
+}
 
 static gint
-parse_config_line_type_and_name (GBytes *bytes,
-                                 gchar **name)
+parse_config_line_type_and_name (const gchar *at,
+                                 gsize len,
+                                 GStringChunk *names,
+                                 const gchar **name)
 {
 	const gchar *from;
 	const gchar *end;
-	const gchar *at;
-	gsize len;
 
 	*name = NULL;
-
-	at = g_bytes_get_data (bytes, &len);
 	end = at + len;
 
 	/* Skip initial spaces */
@@ -324,7 +735,7 @@ parse_config_line_type_and_name (GBytes *bytes,
 		while (at < end && *at != ']' && *at != '\n')
 			at++;
 		if (at < end && *at == ']' && at > from) {
-			*name = g_strndup (from, at - from);
+			*name = g_string_chunk_insert_len (names, from, at - from);
 			return SECTION;
 		}
 
@@ -338,7 +749,7 @@ parse_config_line_type_and_name (GBytes *bytes,
 		while (at - 1 > from && g_ascii_isspace (*(at - 1)))
 			at--;
 		if (at > from) {
-			*name = g_strndup (from, at - from);
+			*name = g_string_chunk_insert_len (names, from, at - from);
 			return PARAMETER;
 		}
 	}
@@ -346,46 +757,20 @@ parse_config_line_type_and_name (GBytes *bytes,
 	return INVALID;
 }
 
-static void
-remove_new_lines (RealmIniConfig *self,
-                  GString *value)
-{
-	gsize offset = 0;
-
-	/* Remove all \r charaters from DOS style endings */
-	for (;;) {
-		gchar *at = strchr (value->str + offset, '\r');
-		if (at == NULL)
-			break;
-		g_string_erase (value, at - value->str, 1);
-	}
-
-	offset = 0;
-
-	/* Remove all \n characters, including escaped newlines */
-	for (;;) {
-		gchar *at = strchr (value->str + offset, '\n');
-		if (at == NULL)
-			break;
-		if ((self->flags & REALM_INI_LINE_CONTINUATIONS) &&
-		    (at > value->str && *(at - 1) == '\\'))
-			g_string_erase (value, (at - 1) - value->str, 2);
-		else
-			g_string_erase (value, at - value->str, 1);
-	}
-}
-
+/* Values are only decoded when asked for */
 static gchar *
 parse_config_line_value (RealmIniConfig *self,
-                         GBytes *bytes)
+                         ConfigLine *line)
 {
-	GString *value;
 	const gchar *end;
 	const gchar *at;
-	gsize len;
+	gchar *value;
+	gchar *out;
 
-	at = g_bytes_get_data (bytes, &len);
-	end = at + len;
+	config_line_sync_list (line);
+
+	at = line->data;
+	end = at + line->length;
 
 	/* Should always have an = when parsed */
 	at = memchr (at, '=', end - at);
@@ -397,12 +782,22 @@ parse_config_line_value (RealmIniConfig *self,
 	while (at < end && g_ascii_isspace (*at))
 		at++;
 
-	value = g_string_new_len (at, end - at);
-
-	/* Remove any continuations and line endings */
-	remove_new_lines (self, value);
+	/* Copy while removing line endings, and escaped newlines */
+	value = out = g_malloc (end - at + 1);
+	for (; at < end; at++) {
+		if (*at == '\r')
+			continue;
+		if (*at == '\n') {
+			if ((self->flags & REALM_INI_LINE_CONTINUATIONS) &&
+			    out > value && *(out - 1) == '\\')
+				out--;
+			continue;
+		}
+		*(out++) = *at;
+	}
 
-	return g_strstrip (g_string_free (value, FALSE));
+	*out = '\0';
+	return g_strstrip (value);
 }
 
 static void
@@ -450,30 +845,24 @@ remove_config_line (RealmIniConfig *self,
 	if (line->next)
 		line->next->prev = line->prev;
 	line->prev->next = line->next;
+	if (self->tail == line)
+		self->tail = line->prev;
 }
 
 static void
-parse_config_line (RealmIniConfig *self,
-                   GBytes *bytes,
+index_config_line (RealmIniConfig *self,
+                   ConfigLine *line,
                    ConfigSection **current)
 {
 	ConfigSection *sect;
-	ConfigLine *line;
-	gchar *name = NULL;
-	gint type;
 
-	line = g_slice_new0 (ConfigLine);
-	line->bytes = g_bytes_ref (bytes);
-
-	/* What kind of line is this? */
-	type = parse_config_line_type_and_name (bytes, &name);
-	switch (type) {
+	switch (line->type) {
 	case SECTION:
-		sect = g_hash_table_lookup (self->sections, name);
+		sect = g_hash_table_lookup (self->sections, line->name);
 		if (sect == NULL) {
 			sect = g_slice_new0 (ConfigSection);
 			sect->parameters = g_hash_table_new (conf_str_hash, conf_str_equal);
-			g_hash_table_replace (self->sections, name, sect);
+			g_hash_table_replace (self->sections, (gpointer)line->name, sect);
 			sect->head = line;
 			sect->tail = line;
 		}
@@ -481,47 +870,66 @@ parse_config_line (RealmIniConfig *self,
 		break;
 	case PARAMETER:
 		if (*current != NULL)
-			g_hash_table_insert ((*current)->parameters, name, line);
+			g_hash_table_insert ((*current)->parameters, (gpointer)line->name, line);
 		break;
 	}
 
-	line->name = name;
-	append_config_line (self, line);
-
 	/* Add this line as the end of the current section */
-	if (type != NONE && type != COMMENT && *current != NULL)
+	if (line->type != NONE && line->type != COMMENT && *current != NULL)
 		(*current)->tail = line;
 }
 
 static void
-parse_config_bytes (RealmIniConfig *self,
+reindex_config_lines (RealmIniConfig *self)
+{
+	ConfigSection *current = NULL;
+	ConfigLine *line;
+
+	g_hash_table_remove_all (self->sections);
+	for (line = self->head; line != NULL; line = line->next)
+		index_config_line (self, line, &current);
+}
+
+static void
+parse_config_line (ConfigLine *line)
+{
+	/* What kind of line is this? */
+	line->type = parse_config_line_type_and_name (line->data, line->length,
+	                                              line->arena->names, &line->name);
+}
+
+static ConfigArena *
+split_config_bytes (RealmIniConfig *self,
                     GBytes *bytes)
 {
-	ConfigSection *current;
-	GBytes *line;
-	const gchar *beg;
+	ConfigArena *arena;
+	ConfigLine *line;
 	const gchar *end;
 	const gchar *at;
 	const gchar *from;
+	guint max_lines;
 	gsize len;
 
-	/* Clear the current data */
-	reset_config_data (self);
+	from = at = g_bytes_get_data (bytes, &len);
+	end = at + len;
 
-	current = NULL;
+	/* Continuations may mean fewer lines than this */
+	max_lines = 1;
+	while (at < end && (at = memchr (at, '\n', end - at)) != NULL) {
+		max_lines++;
+		at++;
+	}
 
-	beg = from = at = g_bytes_get_data (bytes, &len);
-	end = at + len;
+	arena = g_malloc0 (G_STRUCT_OFFSET (ConfigArena, lines) +
+	                   max_lines * sizeof (ConfigLine));
+	arena->bytes = g_bytes_ref (bytes);
+	arena->names = g_string_chunk_new (1024);
 
+	at = from;
 	for (;;) {
 		const gchar *search = at;
 		at = memchr (search, '\n', end - search);
-		if (at == NULL) {
-			line = g_bytes_new_from_bytes (bytes,
-			                               from - beg,
-			                               end - from);
-
-		} else {
+		if (at != NULL) {
 			const gchar *last = at > search ? at - 1 : NULL;
 			at++;
 
@@ -529,22 +937,189 @@ parse_config_bytes (RealmIniConfig *self,
 			if ((self->flags & REALM_INI_LINE_CONTINUATIONS) &&
 			    (last != NULL && *last == '\\'))
 				continue;
-
-			line = g_bytes_new_from_bytes (bytes,
-			                               from - beg,
-			                               at - from);
 		}
 
-		parse_config_line (self, line, &current);
-		g_bytes_unref (line);
+		g_assert (arena->lines_alive < max_lines);
+		line = &arena->lines[arena->lines_alive++];
+		line->arena = arena;
+		line->data = from;
+		line->length = (at ? at : end) - from;
 
 		if (at == NULL)
 			break;
 		from = at;
 	}
 
-	if (!self->changing)
-		g_signal_emit (self, signals[CHANGED], 0);
+	return arena;
+}
+
+static gboolean
+config_line_matches (ConfigLine *line,
+                     ConfigLine *other)
+{
+	config_line_sync_list (line);
+	return line->length == other->length &&
+	       memcmp (line->data, other->data, line->length) == 0;
+}
+
+static gboolean
+section_names_equal (const gchar *one,
+                     const gchar *two)
+{
+	if (one == NULL || two == NULL)
+		return one == two;
+	return conf_str_equal (one, two);
+}
+
+static const gchar *
+note_config_line_changed (RealmIniConfig *self,
+                          ConfigLine *line,
+                          const gchar *section)
+{
+	switch (line->type) {
+	case SECTION:
+		note_section_changed (self, line->name);
+		return line->name;
+	case PARAMETER:
+		note_key_changed (self, section, line->name);
+		return section;
+	default:
+		self->changed = TRUE;
+		return section;
+	}
+}
+
+static void
+parse_config_full (RealmIniConfig *self,
+                   ConfigArena *arena)
+{
+	ConfigSection *current = NULL;
+	ConfigLine *line;
+	guint i;
+
+	/* Clear the current data */
+	note_all_sections_changed (self);
+	reset_config_data (self);
+
+	for (i = 0; i < arena->lines_alive; i++) {
+		line = &arena->lines[i];
+		parse_config_line (line);
+		append_config_line (self, line);
+		index_config_line (self, line, &current);
+	}
+
+	note_all_sections_changed (self);
+}
+
+static void
+parse_config_incremental (RealmIniConfig *self,
+                          ConfigArena *arena)
+{
+	ConfigLine *first, *last, *before, *after;
+	ConfigLine *line, *fresh;
+	gchar *old_section;
+	const gchar *new_section;
+	const gchar *section;
+	guint n_lines;
+	guint i, j, k;
+
+	n_lines = arena->lines_alive;
+
+	/* Skip over lines at the beginning which haven't changed */
+	for (i = 0, line = self->head; line != NULL && i < n_lines; i++, line = line->next) {
+		if (!config_line_matches (line, &arena->lines[i]))
+			break;
+	}
+
+	first = line;
+	before = first ? first->prev : self->tail;
+
+	/* And lines at the end, without overlapping the beginning */
+	for (j = n_lines, line = self->tail; line != before && j > i; j--, line = line->prev) {
+		if (!config_line_matches (line, &arena->lines[j - 1]))
+			break;
+	}
+
+	last = line;
+	after = last ? last->next : self->head;
+
+	/* Nothing changed at all */
+	if (last == before && i == j) {
+		config_arena_free (arena);
+		return;
+	}
+
+	/* Unchanged lines keep how they were parsed, in the new arena */
+	for (k = 0, line = self->head; k < i; k++, line = line->next) {
+		arena->lines[k].type = line->type;
+		if (line->name)
+			arena->lines[k].name = g_string_chunk_insert (arena->names, line->name);
+	}
+	for (k = n_lines, line = self->tail; k > j; k--, line = line->prev) {
+		arena->lines[k - 1].type = line->type;
+		if (line->name)
+			arena->lines[k - 1].name = g_string_chunk_insert (arena->names, line->name);
+	}
+
+	/* Which section does the changed region start in? */
+	section = NULL;
+	for (k = i; k > 0; k--) {
+		if (arena->lines[k - 1].type == SECTION) {
+			section = arena->lines[k - 1].name;
+			break;
+		}
+	}
+
+	/* Note what the old lines were, their names go with the old arena */
+	new_section = section;
+	for (line = (last != before) ? first : after; line != after; line = line->next)
+		new_section = note_config_line_changed (self, line, new_section);
+	old_section = g_strdup (new_section);
+
+	/* Parse the changed lines */
+	new_section = section;
+	for (k = i; k < j; k++) {
+		fresh = &arena->lines[k];
+		parse_config_line (fresh);
+		new_section = note_config_line_changed (self, fresh, new_section);
+	}
+
+	/* Now all the lines come from the new arena */
+	reset_config_data (self);
+	for (k = 0; k < n_lines; k++)
+		append_config_line (self, &arena->lines[k]);
+
+	/* Lines after the change now belong to a different section */
+	if (!section_names_equal (old_section, new_section)) {
+		note_section_changed (self, old_section);
+		note_section_changed (self, new_section);
+	}
+
+	g_free (old_section);
+
+	/* The lines themselves weren't re-parsed, only re-indexed */
+	reindex_config_lines (self);
+}
+
+static void
+parse_config_bytes (RealmIniConfig *self,
+                    GBytes *bytes)
+{
+	ConfigArena *arena;
+
+	/* One allocation for all the lines */
+	arena = split_config_bytes (self, bytes);
+
+	/*
+	 * When we already have data, only parse the lines that have
+	 * changed, so that we can notify exactly what changed.
+	 */
+	if (self->head == NULL)
+		parse_config_full (self, arena);
+	else
+		parse_config_incremental (self, arena);
+
+	emit_changes (self);
 }
 
 void
@@ -577,8 +1152,6 @@ write_to_string (RealmIniConfig *self)
 {
 	ConfigLine *line;
 	GString *result;
-	const gchar *data;
-	gsize len;
 
 	result = g_string_sized_new (4096);
 	for (line = self->head; line != NULL; line = line->next) {
@@ -590,8 +1163,8 @@ write_to_string (RealmIniConfig *self)
 		if (result->len > 0 && result->str[result->len - 1] != '\n')
 			g_string_append_c (result, '\n');
 
-		data = g_bytes_get_data (line->bytes, &len);
-		g_string_append_len (result, data, len);
+		config_line_sync_list (line);
+		g_string_append_len (result, line->data, line->length);
 	}
 
 	return result;
@@ -697,10 +1270,12 @@ realm_ini_config_write_file (RealmIniConfig *self,
 			umask (mask);
 	}
 
-	g_bytes_unref (bytes);
-
-	if (ret)
+	if (ret) {
 		realm_ini_config_set_filename (self, filename);
+		remember_written_file (self, contents, length);
+	}
+
+	g_bytes_unref (bytes);
 	return ret;
 }
 
@@ -728,23 +1303,20 @@ config_set_value (RealmIniConfig *self,
 			return;
 
 		/* A blank line */
-		line = g_slice_new0 (ConfigLine);
-		line->bytes = g_bytes_new ("\n", 1);
-		line->name = NULL;
+		line = config_line_new_take (NONE, NULL, g_strdup ("\n"));
 		append_config_line (self, line);
 
 		/* The actual section header */
 		data = g_strdup_printf ("[%s]\n", section);
-		line = g_slice_new0 (ConfigLine);
-		line->bytes = g_bytes_new_take (data, strlen (data));
-		line->name = g_strdup (section);
+		line = config_line_new_take (SECTION, section, data);
 		append_config_line (self, line);
+		note_section_changed (self, section);
 
 		/* Register it */
 		sect = g_slice_new0 (ConfigSection);
 		sect->parameters = g_hash_table_new (conf_str_hash, conf_str_equal);
 		sect->head = sect->tail = line;
-		g_hash_table_replace (self->sections, line->name, sect);
+		g_hash_table_replace (self->sections, (gpointer)line->name, sect);
 	}
 
 	line = g_hash_table_lookup (sect->parameters, name);
@@ -762,6 +1334,7 @@ config_set_value (RealmIniConfig *self,
 			if (!g_hash_table_remove (sect->parameters, line->name))
 				g_assert_not_reached ();
 			config_line_free (line);
+			note_key_changed (self, section, name);
 		}
 		return;
 	}
@@ -770,16 +1343,17 @@ config_set_value (RealmIniConfig *self,
 
 	/* Don't have this line, add to section */
 	if (line == NULL) {
-		line = g_slice_new0 (ConfigLine);
-		line->bytes = g_bytes_new_take (data, strlen (data));
-		line->name = g_strdup (name);
+		line = config_line_new_take (PARAMETER, name, data);
 		insert_config_line (self, sect->tail, line);
 
 	/* Already have this line, replace the data */
 	} else {
-		g_bytes_unref (line->bytes);
-		line->bytes = g_bytes_new_take (data, strlen (data));
+		config_list_free (line->list);
+		line->list = NULL;
+		config_line_take_data (line, data);
 	}
+
+	note_key_changed (self, section, name);
 }
 
 void
@@ -792,8 +1366,7 @@ realm_ini_config_set (RealmIniConfig *self,
 	g_return_if_fail (section != NULL);
 
 	config_set_value (self, section, name, value);
-	if (!self->changing)
-		g_signal_emit (self, signals[CHANGED], 0);
+	emit_changes (self);
 }
 
 gchar *
@@ -816,7 +1389,7 @@ realm_ini_config_get (RealmIniConfig *self,
 	if (line == NULL)
 		return NULL;
 
-	return parse_config_line_value (self, line->bytes);
+	return parse_config_line_value (self, line);
 }
 
 GHashTable *
@@ -840,7 +1413,7 @@ realm_ini_config_get_all (RealmIniConfig *self,
 
 	g_hash_table_iter_init (&iter, sect->parameters);
 	while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&line))
-		g_hash_table_replace (result, g_strdup (name), parse_config_line_value (self, line->bytes));
+		g_hash_table_replace (result, g_strdup (name), parse_config_line_value (self, line));
 
 	return result;
 }
@@ -862,8 +1435,7 @@ realm_ini_config_set_all (RealmIniConfig *self,
 	while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&value))
 		config_set_value (self, section, name, value);
 
-	if (!self->changing)
-		g_signal_emit (self, signals[CHANGED], 0);
+	emit_changes (self);
 }
 
 gchar **
@@ -920,50 +1492,62 @@ realm_ini_config_set_list_diff (RealmIniConfig *self,
                                 const gchar **add,
                                 const gchar **remove)
 {
-	GPtrArray *changed;
+	const gchar *empty[] = { NULL };
+	ConfigSection *sect;
+	ConfigLine *line;
+	ConfigList *list;
+	GPtrArray *added;
 	gchar *value;
-	gint i, j;
-	gchar **original;
-	gchar *delim;
+	gint i;
 
 	g_return_if_fail (REALM_IS_INI_CONFIG (self));
 	g_return_if_fail (section != NULL);
 	g_return_if_fail (name != NULL);
+	g_return_if_fail (delimiter != NULL);
 
-	original = realm_ini_config_get_list (self, section, name, delimiter);
-	changed = g_ptr_array_new ();
+	sect = g_hash_table_lookup (self->sections, section);
+	line = sect ? g_hash_table_lookup (sect->parameters, name) : NULL;
 
-	/* Filter the remove values */
-	for (i = 0; original != NULL && original[i] != NULL; i++) {
-		value = g_strstrip (g_strdup (original[i]));
-		for (j = 0; remove != NULL && remove[j] != NULL; j++) {
-			if (g_ascii_strcasecmp (remove[j], value) == 0)
-				break;
-		}
-		if ((remove == NULL || remove[j] == NULL) && !g_str_equal (value, ""))
-			g_ptr_array_add (changed, value);
-		else
-			g_free (value);
+	/* No such value yet, so everything is added */
+	if (line == NULL) {
+		value = g_strdup_printf ("%c ", delimiter[0]);
+		realm_ini_config_set_list (self, section, name, value, add ? add : empty);
+		g_free (value);
+		return;
 	}
 
-	/* Add new values */
-	for (j = 0; add != NULL && add[j] != NULL; j++) {
-		for (i = 0; original != NULL && original[i] != NULL; i++) {
-			if (g_ascii_strcasecmp (add[j], original[i]) == 0)
-				break;
-		}
-		if (original == NULL || original[i] == NULL)
-			g_ptr_array_add (changed, g_strdup (add[j]));
+	/*
+	 * Keep the value split up and indexed, so that changing a few
+	 * items in a huge list doesn't have to search the whole thing.
+	 */
+	list = line->list;
+	if (list == NULL || !g_str_equal (list->delimiters, delimiter)) {
+		value = parse_config_line_value (self, line);
+		config_list_free (line->list);
+		line->list = list = config_list_new (value, delimiter);
+		g_free (value);
 	}
 
-	g_ptr_array_add (changed, NULL);
-	g_strfreev (original);
+	/* What to add depends on what was there before removing */
+	added = g_ptr_array_new ();
+	for (i = 0; add != NULL && add[i] != NULL; i++) {
+		if (!g_hash_table_lookup (list->index, add[i]))
+			g_ptr_array_add (added, (gpointer)add[i]);
+	}
+
+	for (i = 0; remove != NULL && remove[i] != NULL; i++)
+		config_list_remove (list, remove[i]);
+	for (i = 0; i < added->len; i++)
+		config_list_append (list, added->pdata[i]);
+
+	g_ptr_array_free (added, TRUE);
+
+	g_free (list->name);
+	list->name = g_strdup (name);
+	list->dirty = TRUE;
 
-	delim = g_strdup_printf ("%c ", delimiter[0]);
-	realm_ini_config_set_list (self, section, name, delim,
-	                           (const gchar **)changed->pdata);
-	g_ptr_array_free (changed, TRUE);
-	g_free (delim);
+	note_key_changed (self, section, name);
+	emit_changes (self);
 }
 
 gboolean
@@ -995,6 +1579,7 @@ realm_ini_config_remove_section (RealmIniConfig *self,
 	head = sect->head;
 	tail = sect->tail;
 
+	note_section_changed (self, section);
 	g_hash_table_remove (self->sections, section);
 
 	/* Remove this section from the config file */
@@ -1088,19 +1673,22 @@ realm_ini_config_reset (RealmIniConfig *self)
 {
 	g_return_if_fail (REALM_IS_INI_CONFIG (self));
 
+	note_all_sections_changed (self);
 	reset_config_data (self);
-	if (!self->changing)
-		g_signal_emit (self, signals[CHANGED], 0);
+	emit_changes (self);
 }
 
 void
 realm_ini_config_reload (RealmIniConfig *self)
 {
 	GError *error = NULL;
+	gint64 started;
+	gchar *name;
 
 	g_return_if_fail (self->filename != NULL);
 
 	self->reload_scheduled = 0;
+	started = g_get_monotonic_time ();
 
 	realm_ini_config_read_file (self, NULL, &error);
 	if (error != NULL) {
@@ -1108,6 +1696,11 @@ realm_ini_config_reload (RealmIniConfig *self)
 		           self->filename, error->message);
 		g_clear_error (&error);
 	}
+
+	name = g_path_get_basename (self->filename);
+	realm_metrics_observe (REALM_METRIC_CONFIG_RELOAD, name,
+	                       g_get_monotonic_time () - started);
+	g_free (name);
 }
 
 RealmIniConfig *
@@ -1118,6 +1711,84 @@ realm_ini_config_new (RealmIniFlags flags)
 	                     NULL);
 }
 
+static gchar *
+canonicalize_config_path (const gchar *filename)
+{
+	gchar *directory;
+	gchar *resolved;
+	gchar *basename;
+	gchar *path;
+
+	resolved = realpath (filename, NULL);
+	if (resolved != NULL) {
+		path = g_strdup (resolved);
+		free (resolved);
+		return path;
+	}
+
+	/* The file may not exist yet, but its directory might */
+	directory = g_path_get_dirname (filename);
+	resolved = realpath (directory, NULL);
+	g_free (directory);
+
+	if (resolved == NULL)
+		return g_strdup (filename);
+
+	basename = g_path_get_basename (filename);
+	path = g_build_filename (resolved, basename, NULL);
+	g_free (basename);
+	free (resolved);
+	return path;
+}
+
+/*
+ * Returns a config for the given file which is shared with everyone
+ * else in this process who asks for the same file with the same flags.
+ * This means only one copy of the parsed data, and one file monitor.
+ * The returned object must not be pointed at a different file.
+ */
+RealmIniConfig *
+realm_ini_config_new_shared (const gchar *filename,
+                             RealmIniFlags flags,
+                             GError **error)
+{
+	RealmIniConfig *self;
+	gchar *path;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	path = canonicalize_config_path (filename);
+
+	if (shared_configs != NULL) {
+		self = g_hash_table_lookup (shared_configs, path);
+		if (self != NULL && self->flags == flags) {
+			g_free (path);
+			return g_object_ref (self);
+		}
+	}
+
+	self = realm_ini_config_new (flags);
+	if (!realm_ini_config_read_file (self, filename, error)) {
+		g_object_unref (self);
+		g_free (path);
+		return NULL;
+	}
+
+	/* Someone else already has this file with different flags */
+	if (shared_configs != NULL &&
+	    g_hash_table_lookup (shared_configs, path) != NULL) {
+		g_free (path);
+		return self;
+	}
+
+	if (shared_configs == NULL)
+		shared_configs = g_hash_table_new (g_str_hash, g_str_equal);
+	self->shared_path = path;
+	g_hash_table_insert (shared_configs, self->shared_path, self);
+	return self;
+}
+
 gboolean
 realm_ini_config_begin_change (RealmIniConfig *self,
                                GError **error)
@@ -1135,6 +1806,19 @@ realm_ini_config_begin_change (RealmIniConfig *self,
 	return TRUE;
 }
 
+typedef struct {
+	RealmIniConfig *config;
+	GBytes *bytes;
+	gchar *staged;
+	gchar *backup;                  /* link to the original, until committed */
+	gboolean replaced;
+	gint fd;
+} StagedFile;
+
+struct _RealmIniTransaction {
+	GPtrArray *changes;
+};
+
 void
 realm_ini_config_abort_change (RealmIniConfig *self)
 {
@@ -1145,13 +1829,19 @@ realm_ini_config_abort_change (RealmIniConfig *self)
 	}
 
 	self->changing = FALSE;
-	g_signal_emit (self, signals[CHANGED], 0);
+
+	/* Go back to what's on disk, which emits what was undone */
+	if (self->filename == NULL || !realm_ini_config_read_file (self, NULL, NULL)) {
+		self->changed = TRUE;
+		emit_changes (self);
+	}
 }
 
 gboolean
 realm_ini_config_finish_change (RealmIniConfig *self,
                                 GError **error)
 {
+	RealmIniTransaction *trans;
 	gboolean ret;
 
 	g_return_val_if_fail (REALM_IS_INI_CONFIG (self), FALSE);
@@ -1162,10 +1852,321 @@ realm_ini_config_finish_change (RealmIniConfig *self,
 		return FALSE;
 	}
 
-	self->changing = FALSE;
-	ret = realm_ini_config_write_file (self, NULL, error);
+	/* A transaction of one, which this change already began */
+	trans = realm_ini_transaction_new ();
+	g_ptr_array_add (trans->changes, g_object_ref (self));
+	ret = realm_ini_transaction_commit (trans, error);
+	realm_ini_transaction_free (trans);
 
-	g_signal_emit (self, signals[CHANGED], 0);
+	return ret;
+}
+
+/*
+ * A transaction changes several config files together. Each config has
+ * realm_ini_config_begin_change() called when added, and then changes
+ * are made as usual. On commit all the files are written out to temp
+ * files next to the originals, synced to disk together and then renamed
+ * into place. The originals are kept until all the renames are done, and
+ * put back if one fails. Aborting just re-reads the untouched files.
+ */
+RealmIniTransaction *
+realm_ini_transaction_new (void)
+{
+	RealmIniTransaction *trans;
+
+	trans = g_slice_new0 (RealmIniTransaction);
+	trans->changes = g_ptr_array_new_with_free_func (g_object_unref);
+	return trans;
+}
+
+gboolean
+realm_ini_transaction_add (RealmIniTransaction *trans,
+                           RealmIniConfig *config,
+                           GError **error)
+{
+	guint i;
+
+	g_return_val_if_fail (trans != NULL, FALSE);
+	g_return_val_if_fail (REALM_IS_INI_CONFIG (config), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	for (i = 0; i < trans->changes->len; i++) {
+		if (trans->changes->pdata[i] == config)
+			return TRUE;
+	}
+
+	if (!realm_ini_config_begin_change (config, error))
+		return FALSE;
+
+	g_ptr_array_add (trans->changes, g_object_ref (config));
+	return TRUE;
+}
+
+static void
+staged_file_clear (StagedFile *staged)
+{
+	if (staged->fd >= 0)
+		close (staged->fd);
+	if (staged->staged) {
+		g_unlink (staged->staged);
+		g_free (staged->staged);
+	}
+	if (staged->backup) {
+		g_unlink (staged->backup);
+		g_free (staged->backup);
+	}
+	if (staged->bytes)
+		g_bytes_unref (staged->bytes);
+}
+
+static gboolean
+stage_config_file (StagedFile *staged,
+                   GError **error)
+{
+	RealmIniConfig *config = staged->config;
+	const gchar *data;
+	gsize length;
+	gssize res;
+	int errn;
+
+	g_return_val_if_fail (config->filename != NULL, FALSE);
+
+	staged->bytes = realm_ini_config_write_bytes (config);
+	data = g_bytes_get_data (staged->bytes, &length);
+
+	/* If not writing any data, and no file is present, don't write an empty file */
+	if (length == 0 && !g_file_test (config->filename, G_FILE_TEST_EXISTS))
+		return TRUE;
+
+	staged->staged = g_strdup_printf ("%s.XXXXXX", config->filename);
+	staged->fd = g_mkstemp_full (staged->staged, O_RDWR | O_CLOEXEC,
+	                             (config->flags & REALM_INI_PRIVATE) ? 0600 : 0644);
+	if (staged->fd < 0) {
+		errn = errno;
+		g_free (staged->staged);
+		staged->staged = NULL;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+		             _("Couldn't create temporary file for: %s: %s"),
+		             config->filename, g_strerror (errn));
+		return FALSE;
+	}
+
+	while (length > 0) {
+		res = write (staged->fd, data, length);
+		if (res < 0) {
+			errn = errno;
+			if (errn == EINTR || errn == EAGAIN)
+				continue;
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+			             _("Couldn't write out file: %s: %s"),
+			             config->filename, g_strerror (errn));
+			return FALSE;
+		}
+		data += res;
+		length -= res;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Keep the original file by a hard link, so it can be put back if a
+ * later file in the same transaction can't be renamed into place.
+ */
+static gboolean
+backup_config_file (StagedFile *staged,
+                    GError **error)
+{
+	const gchar *filename = staged->config->filename;
+	struct stat sb;
+	int errn;
+
+	/* Nothing to keep if there was no file */
+	if (lstat (filename, &sb) < 0 || S_ISDIR (sb.st_mode))
+		return TRUE;
+
+	staged->backup = g_strdup_printf ("%s.realmd-bak", filename);
+
+	/* Left over from a crash during a commit */
+	g_unlink (staged->backup);
+
+	if (link (filename, staged->backup) < 0) {
+		errn = errno;
+		g_free (staged->backup);
+		staged->backup = NULL;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+		             _("Couldn't back up file: %s: %s"),
+		             filename, g_strerror (errn));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+restore_config_file (StagedFile *staged)
+{
+	const gchar *filename = staged->config->filename;
+
+	if (staged->backup == NULL) {
+		g_unlink (filename);
+	} else if (g_rename (staged->backup, filename) < 0) {
+		g_warning ("Couldn't restore file: %s: %s", filename, g_strerror (errno));
+	} else {
+		g_free (staged->backup);
+		staged->backup = NULL;
+	}
+}
+
+static void
+sync_directory (const gchar *directory)
+{
+	int fd;
+
+	fd = open (directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync (fd);
+		close (fd);
+	}
+}
+
+static void
+transaction_finish (RealmIniTransaction *trans,
+                    StagedFile *staged,
+                    guint committed)
+{
+	RealmIniConfig *config;
+	const gchar *data;
+	gsize length;
+	guint i;
+
+	for (i = 0; i < trans->changes->len; i++) {
+		config = trans->changes->pdata[i];
+
+		if (i < committed) {
+			config->changing = FALSE;
+			data = g_bytes_get_data (staged[i].bytes, &length);
+			remember_written_file (config, data, length);
+			config->changed = TRUE;
+			emit_changes (config);
+		} else {
+			realm_ini_config_abort_change (config);
+		}
+	}
+
+	g_ptr_array_set_size (trans->changes, 0);
+}
+
+gboolean
+realm_ini_transaction_commit (RealmIniTransaction *trans,
+                              GError **error)
+{
+	GHashTable *directories;
+	GHashTableIter iter;
+	const gchar *filename;
+	gchar *directory;
+	StagedFile *staged;
+	gboolean ret = TRUE;
+	guint committed = 0;
+	guint n_staged;
+	int errn;
+	guint i;
+
+	g_return_val_if_fail (trans != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	n_staged = trans->changes->len;
+	staged = g_new0 (StagedFile, n_staged);
+	for (i = 0; i < n_staged; i++) {
+		staged[i].config = trans->changes->pdata[i];
+		staged[i].fd = -1;
+	}
+
+	/* Write everything out first, and then sync it all together */
+	for (i = 0; ret && i < n_staged; i++)
+		ret = stage_config_file (staged + i, error);
+
+	for (i = 0; ret && i < n_staged; i++) {
+		if (staged[i].fd < 0)
+			continue;
+		if (fsync (staged[i].fd) < 0) {
+			errn = errno;
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+			             _("Couldn't write out file: %s: %s"),
+			             staged[i].config->filename, g_strerror (errn));
+			ret = FALSE;
+		}
+		close (staged[i].fd);
+		staged[i].fd = -1;
+	}
+
+	for (i = 0; ret && i < n_staged; i++) {
+		if (staged[i].staged != NULL)
+			ret = backup_config_file (staged + i, error);
+	}
+
+	/* Now move them all into place */
+	directories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (i = 0; ret && i < n_staged; i++) {
+		filename = staged[i].config->filename;
+		if (staged[i].staged != NULL) {
+			if (g_rename (staged[i].staged, filename) < 0) {
+				errn = errno;
+				g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+				             _("Couldn't replace file: %s: %s"),
+				             filename, g_strerror (errn));
+				ret = FALSE;
+				break;
+			}
+			g_free (staged[i].staged);
+			staged[i].staged = NULL;
+			staged[i].replaced = TRUE;
+			g_hash_table_add (directories, g_path_get_dirname (filename));
+		}
+		committed++;
+	}
+
+	/* Either all the files are committed, or none of them */
+	if (!ret) {
+		for (i = 0; i < committed; i++) {
+			if (staged[i].replaced)
+				restore_config_file (staged + i);
+		}
+		committed = 0;
+	}
+
+	/* And make the renames durable */
+	g_hash_table_iter_init (&iter, directories);
+	while (g_hash_table_iter_next (&iter, (gpointer *)&directory, NULL))
+		sync_directory (directory);
+	g_hash_table_destroy (directories);
+
+	/* Committed files are no longer aborted, and the backups go */
+	transaction_finish (trans, staged, committed);
+
+	for (i = 0; i < n_staged; i++)
+		staged_file_clear (staged + i);
+	g_free (staged);
 
 	return ret;
 }
+
+void
+realm_ini_transaction_abort (RealmIniTransaction *trans)
+{
+	g_return_if_fail (trans != NULL);
+	transaction_finish (trans, NULL, 0);
+}
+
+void
+realm_ini_transaction_free (RealmIniTransaction *trans)
+{
+	if (trans == NULL)
+		return;
+
+	/* Not committed, so abort */
+	realm_ini_transaction_abort (trans);
+
+	g_ptr_array_free (trans->changes, TRUE);
+	g_slice_free (RealmIniTransaction, trans);
+}
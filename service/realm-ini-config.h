@@ -36,6 +36,10 @@ GType               realm_ini_config_get_type                 (void) G_GNUC_CONS
 
 RealmIniConfig *    realm_ini_config_new                      (RealmIniFlags flags);
 
+RealmIniConfig *    realm_ini_config_new_shared               (const gchar *filename,
+                                                               RealmIniFlags flags,
+                                                               GError **error);
+
 void                realm_ini_config_reset                    (RealmIniConfig *self);
 
 gboolean            realm_ini_config_begin_change             (RealmIniConfig *self,
@@ -129,6 +133,21 @@ gboolean            realm_ini_config_change_list              (RealmIniConfig *s
                                                                const gchar **remove,
                                                                GError **error);
 
+typedef struct _RealmIniTransaction RealmIniTransaction;
+
+RealmIniTransaction * realm_ini_transaction_new               (void);
+
+gboolean            realm_ini_transaction_add                 (RealmIniTransaction *trans,
+                                                               RealmIniConfig *config,
+                                                               GError **error);
+
+gboolean            realm_ini_transaction_commit              (RealmIniTransaction *trans,
+                                                               GError **error);
+
+void                realm_ini_transaction_abort               (RealmIniTransaction *trans);
+
+void                realm_ini_transaction_free                (RealmIniTransaction *trans);
+
 G_END_DECLS
 
 #endif /* __REALM_INI_CONFIG_H__ */
@@ -0,0 +1,122 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-invocation.h"
+
+/*
+ * Each invocation gets a cancellable the first time one is asked for.
+ * These are tracked by the sender of the invocation, so that all of a
+ * client's work can be cancelled when it goes away.
+ */
+
+typedef struct {
+	gchar *sender;
+	GCancellable *cancellable;
+} InvocationCancel;
+
+/* Sender -> GList of InvocationCancel, may be touched from any thread */
+G_LOCK_DEFINE_STATIC (invocation_cancels);
+static GHashTable *invocation_cancels = NULL;
+static GQuark invocation_cancel_quark = 0;
+static gsize invocation_cancels_initialized = 0;
+
+static void
+invocation_cancel_free (gpointer data)
+{
+	InvocationCancel *cancel = data;
+	GList *list;
+
+	G_LOCK (invocation_cancels);
+	list = g_hash_table_lookup (invocation_cancels, cancel->sender);
+	list = g_list_remove (list, cancel);
+	if (list == NULL)
+		g_hash_table_remove (invocation_cancels, cancel->sender);
+	else
+		g_hash_table_insert (invocation_cancels, g_strdup (cancel->sender), list);
+	G_UNLOCK (invocation_cancels);
+
+	g_object_unref (cancel->cancellable);
+	g_free (cancel->sender);
+	g_slice_free (InvocationCancel, cancel);
+}
+
+GCancellable *
+realm_invocation_get_cancellable (GDBusMethodInvocation *invocation)
+{
+	InvocationCancel *cancel;
+	const gchar *sender;
+	GList *list;
+
+	g_return_val_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation), NULL);
+
+	if (g_once_init_enter (&invocation_cancels_initialized)) {
+		invocation_cancels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		invocation_cancel_quark = g_quark_from_static_string ("realm-invocation-cancel");
+		g_once_init_leave (&invocation_cancels_initialized, 1);
+	}
+
+	cancel = g_object_get_qdata (G_OBJECT (invocation), invocation_cancel_quark);
+	if (cancel != NULL)
+		return cancel->cancellable;
+
+	sender = g_dbus_method_invocation_get_sender (invocation);
+
+	cancel = g_slice_new0 (InvocationCancel);
+	cancel->sender = g_strdup (sender ? sender : "");
+	cancel->cancellable = g_cancellable_new ();
+
+	G_LOCK (invocation_cancels);
+	list = g_hash_table_lookup (invocation_cancels, cancel->sender);
+	list = g_list_prepend (list, cancel);
+	g_hash_table_insert (invocation_cancels, g_strdup (cancel->sender), list);
+	G_UNLOCK (invocation_cancels);
+
+	/* Forgotten when the invocation goes away */
+	g_object_set_qdata_full (G_OBJECT (invocation), invocation_cancel_quark,
+	                         cancel, invocation_cancel_free);
+	return cancel->cancellable;
+}
+
+gboolean
+realm_invocation_cancel_for_sender (const gchar *sender)
+{
+	InvocationCancel *cancel;
+	GList *cancellables = NULL;
+	gboolean ret;
+	GList *l;
+
+	g_return_val_if_fail (sender != NULL, FALSE);
+
+	G_LOCK (invocation_cancels);
+	for (l = invocation_cancels ? g_hash_table_lookup (invocation_cancels, sender) : NULL;
+	     l != NULL; l = g_list_next (l)) {
+		cancel = l->data;
+		cancellables = g_list_prepend (cancellables, g_object_ref (cancel->cancellable));
+	}
+	G_UNLOCK (invocation_cancels);
+
+	ret = cancellables != NULL;
+	if (ret)
+		g_debug ("cancelling %u operations for vanished client: %s",
+		         g_list_length (cancellables), sender);
+
+	/* Outside the lock, since cancelling may complete and free invocations */
+	for (l = cancellables; l != NULL; l = g_list_next (l))
+		g_cancellable_cancel (l->data);
+	g_list_free_full (cancellables, g_object_unref);
+
+	return ret;
+}
@@ -0,0 +1,30 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_INVOCATION_H__
+#define __REALM_INVOCATION_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+GCancellable *       realm_invocation_get_cancellable        (GDBusMethodInvocation *invocation);
+
+gboolean             realm_invocation_cancel_for_sender      (const gchar *sender);
+
+G_END_DECLS
+
+#endif /* __REALM_INVOCATION_H__ */
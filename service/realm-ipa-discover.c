@@ -20,13 +20,18 @@
 #include "realm-diagnostics.h"
 #include "realm-discovery.h"
 #include "realm-errors.h"
+#include "realm-invocation.h"
+#include "realm-metrics.h"
 #include "realm-network.h"
+#include "realm-trace.h"
 
 #include <glib/gi18n.h>
 
 typedef struct {
 	GObject parent;
 	GDBusMethodInvocation *invocation;
+	GCancellable *cancellable;
+	RealmTraceSpan *span;
 	gboolean completed;
 	gboolean found_ipa;
 	GError *error;
@@ -68,6 +73,7 @@ realm_ipa_discover_finalize (GObject *obj)
 	RealmIpaDiscover *self = REALM_IPA_DISCOVER (obj);
 
 	g_object_unref (self->invocation);
+	g_object_unref (self->cancellable);
 	g_clear_error (&self->error);
 	g_srv_target_free (self->kdc);
 
@@ -122,6 +128,7 @@ typedef struct {
   guchar *buf;
   gsize count;
   gsize nread;
+  GCancellable *cancellable;
 } ReadAllClosure;
 
 static void
@@ -129,6 +136,8 @@ read_all_closure_free (gpointer data)
 {
   ReadAllClosure *closure = data;
   g_free (closure->buf);
+  if (closure->cancellable)
+    g_object_unref (closure->cancellable);
   g_slice_free (ReadAllClosure, closure);
 }
 
@@ -161,7 +170,7 @@ read_all_callback (GObject      *stream,
           g_input_stream_read_async (G_INPUT_STREAM (stream),
                                      closure->buf + closure->nread,
                                      closure->count - closure->nread,
-                                     G_PRIORITY_DEFAULT, NULL,
+                                     G_PRIORITY_DEFAULT, closure->cancellable,
                                      read_all_callback, g_object_ref (simple));
         }
       else
@@ -176,6 +185,7 @@ read_all_callback (GObject      *stream,
 static void
 read_all_bytes_async (GInputStream *stream,
                       gsize count,
+                      GCancellable *cancellable,
                       GAsyncReadyCallback callback,
                       gpointer user_data)
 {
@@ -188,10 +198,11 @@ read_all_bytes_async (GInputStream *stream,
   closure = g_slice_new0 (ReadAllClosure);
   closure->buf = g_malloc (count);
   closure->count = count;
+  closure->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
   g_simple_async_result_set_op_res_gpointer (simple, closure, read_all_closure_free);
 
   g_input_stream_read_async (stream, closure->buf, count,
-                             G_PRIORITY_DEFAULT, NULL,
+                             G_PRIORITY_DEFAULT, cancellable,
                              read_all_callback, simple);
 }
 
@@ -220,6 +231,7 @@ read_all_bytes_finish (GInputStream *stream,
 typedef struct {
   GBytes *bytes;
   gsize written;
+  GCancellable *cancellable;
 } WriteAllClosure;
 
 static void
@@ -227,6 +239,8 @@ write_all_closure_free (gpointer data)
 {
   WriteAllClosure *closure = data;
   g_bytes_unref (closure->bytes);
+  if (closure->cancellable)
+    g_object_unref (closure->cancellable);
   g_slice_free (WriteAllClosure, closure);
 }
 
@@ -258,7 +272,7 @@ write_all_callback (GObject      *stream,
                                        data + closure->written,
                                        size - closure->written,
                                        G_PRIORITY_DEFAULT,
-                                       NULL,
+                                       closure->cancellable,
                                        write_all_callback,
                                        g_object_ref (simple));
         }
@@ -274,6 +288,7 @@ write_all_callback (GObject      *stream,
 static void
 write_all_bytes_async (GOutputStream *stream,
                                        GBytes *bytes,
+                                       GCancellable *cancellable,
                                        GAsyncReadyCallback callback,
                                        gpointer user_data)
 {
@@ -288,12 +303,13 @@ write_all_bytes_async (GOutputStream *stream,
                                       write_all_bytes_async);
   closure = g_slice_new0 (WriteAllClosure);
   closure->bytes = g_bytes_ref (bytes);
+  closure->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
   g_simple_async_result_set_op_res_gpointer (simple, closure, write_all_closure_free);
 
   g_output_stream_write_async (stream,
                                data, size,
                                G_PRIORITY_DEFAULT,
-                               NULL,
+                               cancellable,
                                write_all_callback,
                                simple);
 }
@@ -316,6 +332,11 @@ ipa_discover_complete (RealmIpaDiscover *self)
 
 	g_assert (!self->completed);
 	self->completed = TRUE;
+	realm_metrics_increment (REALM_METRIC_IPA_PROBE,
+	                         self->error ? "error" : (self->found_ipa ? "ipa" : "not-ipa"));
+	realm_trace_end (self->span);
+	self->span = NULL;
+
 	call = self->callback;
 	user_data = self->user_data;
 	self->callback = NULL;
@@ -447,7 +468,7 @@ on_write_http_request (GObject *source,
 	write_all_bytes_finish (G_OUTPUT_STREAM (source), result, &error);
 	if (error == NULL) {
 		input = g_io_stream_get_input_stream (G_IO_STREAM (self->current_connection));
-		read_all_bytes_async (input, 100 * 1024,
+		read_all_bytes_async (input, 100 * 1024, self->cancellable,
 		                      on_read_http_response, g_object_ref (self));
 	} else {
 		ipa_discover_take_error (self, "Couldn't send HTTP request for certificate", error);
@@ -480,7 +501,7 @@ on_connect_to_host (GObject *source,
 	if (error == NULL) {
 		self->current_connection = G_IO_STREAM (connection);
 		output = g_io_stream_get_output_stream (self->current_connection);
-		write_all_bytes_async (output, self->http_request,
+		write_all_bytes_async (output, self->http_request, self->cancellable,
 		                       on_write_http_request, g_object_ref (self));
 
 	/* Errors that mean no domain discovered */
@@ -541,6 +562,7 @@ realm_ipa_discover_async (GSrvTarget *kdc,
 
 	self = g_object_new (REALM_TYPE_IPA_DISCOVER, NULL);
 	self->invocation = g_object_ref (invocation);
+	self->cancellable = g_object_ref (realm_invocation_get_cancellable (invocation));
 	self->callback = callback;
 	self->user_data = user_data;
 	self->kdc = g_srv_target_copy (kdc);
@@ -572,9 +594,10 @@ realm_ipa_discover_async (GSrvTarget *kdc,
 	                       G_CONNECT_AFTER);
 
 	realm_diagnostics_info (self->invocation, "Trying to retrieve IPA certificate from %s", hostname);
+	self->span = realm_trace_begin (self->invocation, "ipa-probe", "%s", hostname);
 
 	g_socket_client_connect_to_host_async (client, hostname, 443,
-	                                       NULL, on_connect_to_host, g_object_ref (self));
+	                                       self->cancellable, on_connect_to_host, g_object_ref (self));
 
 	g_object_unref (client);
 
@@ -19,9 +19,12 @@
 #include "realm-diagnostics.h"
 #include "realm-discovery.h"
 #include "realm-errors.h"
+#include "realm-invocation.h"
 #include "realm-ipa-discover.h"
 #include "realm-kerberos-discover.h"
+#include "realm-metrics.h"
 #include "realm-network.h"
+#include "realm-trace.h"
 
 #include <glib/gi18n.h>
 
@@ -43,8 +46,10 @@ typedef struct {
 	GList *servers;
 	gboolean found_kerberos;
 	gint outstanding_kerberos;
+	RealmTraceSpan *span_kerberos;
 	gboolean found_msdcs;
 	gint outstanding_msdcs;
+	RealmTraceSpan *span_msdcs;
 	gboolean started_ipa;
 	gboolean found_ipa;
 	gint outstanding_ipa;
@@ -224,6 +229,19 @@ maybe_complete_discover (RealmKerberosDiscover *self)
 	kerberos_discover_complete (self);
 }
 
+static void
+note_srv_outcome (const gchar *records,
+                  gboolean found,
+                  GError *error)
+{
+	gchar *outcome;
+
+	outcome = g_strdup_printf ("%s-%s", records,
+	                           error ? "error" : (found ? "found" : "not-found"));
+	realm_metrics_increment (REALM_METRIC_SRV_LOOKUP, outcome);
+	g_free (outcome);
+}
+
 static void
 on_resolve_kerberos (GObject *source,
                      GAsyncResult *result,
@@ -236,6 +254,8 @@ on_resolve_kerberos (GObject *source,
 	GList *l;
 
 	self->outstanding_kerberos = 0;
+	realm_trace_end (self->span_kerberos);
+	self->span_kerberos = NULL;
 
 	if (self->completed) {
 		g_object_unref (self);
@@ -249,6 +269,8 @@ on_resolve_kerberos (GObject *source,
 	    g_error_matches (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE))
 		g_clear_error (&error);
 
+	note_srv_outcome ("kerberos", self->servers != NULL, error);
+
 	if (error == NULL) {
 		info = g_string_new ("");
 
@@ -285,6 +307,8 @@ on_resolve_msdcs (GObject *source,
 	GList *records;
 
 	self->outstanding_msdcs = 0;
+	realm_trace_end (self->span_msdcs);
+	self->span_msdcs = NULL;
 
 	if (self->completed) {
 		g_object_unref (self);
@@ -298,6 +322,8 @@ on_resolve_msdcs (GObject *source,
 	    g_error_matches (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE))
 		g_clear_error (&error);
 
+	note_srv_outcome ("msdcs", records != NULL, error);
+
 	if (error == NULL) {
 		self->found_msdcs = (records != NULL);
 		g_list_free_full (records, (GDestroyNotify)g_srv_target_free);
@@ -316,17 +342,22 @@ static void
 kerberos_discover_domain_begin (RealmKerberosDiscover *self)
 {
 	GDBusMethodInvocation *invocation = self->key.invocation;
+	GCancellable *cancellable;
 	GResolver *resolver;
 	gchar *msdcs;
 
 	g_assert (self->domain != NULL);
 
+	/* Stops the lookups if the client goes away */
+	cancellable = realm_invocation_get_cancellable (invocation);
+
 	realm_diagnostics_info (invocation,
 	                        "Searching for kerberos SRV records for domain: _kerberos._udp.%s",
 	                        self->domain);
 
 	resolver = g_resolver_get_default ();
-	g_resolver_lookup_service_async (resolver, "kerberos", "udp", self->domain, NULL,
+	self->span_kerberos = realm_trace_begin (invocation, "dns", "_kerberos._udp.%s", self->domain);
+	g_resolver_lookup_service_async (resolver, "kerberos", "udp", self->domain, cancellable,
 	                                 on_resolve_kerberos, g_object_ref (self));
 	self->outstanding_kerberos = 1;
 
@@ -337,7 +368,8 @@ kerberos_discover_domain_begin (RealmKerberosDiscover *self)
 	                        "Searching for MSDCS SRV records on domain: _kerberos._tcp.%s",
 	                        msdcs);
 
-	g_resolver_lookup_service_async (resolver, "kerberos", "tcp", msdcs, NULL,
+	self->span_msdcs = realm_trace_begin (invocation, "dns", "_kerberos._tcp.%s", msdcs);
+	g_resolver_lookup_service_async (resolver, "kerberos", "tcp", msdcs, cancellable,
 	                                 on_resolve_msdcs, g_object_ref (self));
 	self->outstanding_msdcs = 1;
 
@@ -451,6 +483,7 @@ realm_kerberos_discover_async (const gchar *string,
 	}
 
 	self = g_hash_table_lookup (discover_cache, &key);
+	realm_metrics_increment (self ? REALM_METRIC_CACHE_HIT : REALM_METRIC_CACHE_MISS, "discover");
 
 	if (self == NULL) {
 		self = g_object_new (REALM_TYPE_KERBEROS_DISCOVER, NULL);
@@ -21,28 +21,39 @@
 #include "realm-diagnostics.h"
 #include "realm-discovery.h"
 #include "realm-errors.h"
+#include "realm-invocation.h"
 #include "realm-kerberos.h"
 #include "realm-kerberos-membership.h"
+#include "realm-lock.h"
 #include "realm-login-name.h"
+#include "realm-metrics.h"
 #include "realm-provider.h"
 #include "realm-settings.h"
+#include "realm-trace.h"
+#include "realm-worker.h"
 
 #include <krb5/krb5.h>
 
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
 
+#include <gio/gunixfdlist.h>
+#include <gio/gunixinputstream.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 struct _RealmKerberosPrivate {
 	GHashTable *discovery;
 	RealmDbusRealm *realm_iface;
 	RealmDbusKerberos *kerberos_iface;
 	RealmDbusKerberosMembership *membership_iface;
+	RealmLoginMatcher *login_matcher;
 };
 
 enum {
@@ -77,25 +88,129 @@ method_closure_free (MethodClosure *closure)
 	g_slice_free (MethodClosure, closure);
 }
 
+/*
+ * Join and leave are traced as a whole. When the client asks for it, the
+ * spans of the operation are totalled per category as they end, and the
+ * time spent in each phase is sent as the last diagnostics record.
+ */
+typedef struct {
+	RealmTraceSpan *span;
+	RealmTraceTotals *totals;
+	gint64 started;
+} OperationTiming;
+
+static const struct {
+	const gchar *phase;
+	const gchar *categories[3];
+} timing_phases[] = {
+	{ "discovery", { "dns", "ipa-probe", NULL } },
+	{ "kinit", { "kinit", NULL } },
+	{ "packages", { "packages", NULL } },
+	{ "enrollment", { "command", NULL } },
+	{ "configuration", { "config", NULL } },
+	{ "services", { "service", NULL } },
+	{ "cache-flush", { "cache-flush", NULL } },
+};
+
+static GQuark
+operation_timing_quark (void)
+{
+	static GQuark quark = 0;
+	if (quark == 0)
+		quark = g_quark_from_static_string ("realm-operation-timing");
+	return quark;
+}
+
+static void
+operation_timing_free (gpointer data)
+{
+	OperationTiming *timing = data;
+	realm_trace_end (timing->span);
+	if (timing->totals)
+		realm_trace_totals_unref (timing->totals);
+	g_slice_free (OperationTiming, timing);
+}
+
+static void
+operation_timing_begin (GDBusMethodInvocation *invocation,
+                        GVariant *options,
+                        gboolean enroll)
+{
+	OperationTiming *timing;
+	gboolean report;
+
+	timing = g_slice_new0 (OperationTiming);
+	timing->started = g_get_monotonic_time ();
+	if (g_variant_lookup (options, REALM_DBUS_OPTION_TIMING_REPORT, "b", &report) && report)
+		timing->totals = realm_trace_totals_new (invocation);
+	timing->span = realm_trace_begin (invocation, "operation", enroll ? "join" : "leave");
+
+	g_object_set_qdata_full (G_OBJECT (invocation), operation_timing_quark (),
+	                         timing, operation_timing_free);
+}
+
+static void
+operation_timing_report (GDBusMethodInvocation *invocation)
+{
+	OperationTiming *timing;
+	GString *report;
+	gint64 total;
+	guint count;
+	guint n;
+	guint i, j;
+
+	timing = g_object_get_qdata (G_OBJECT (invocation), operation_timing_quark ());
+	if (timing == NULL || timing->totals == NULL)
+		return;
+
+	/* Tab separated, so that it can be collected from many machines */
+	report = g_string_new ("Phase timings:\n");
+	for (i = 0; i < G_N_ELEMENTS (timing_phases); i++) {
+		total = 0;
+		n = 0;
+		for (j = 0; timing_phases[i].categories[j] != NULL; j++) {
+			total += realm_trace_totals_get (timing->totals, timing_phases[i].categories[j],
+			                                 &count);
+			n += count;
+		}
+
+		/* No lookups means the realm was already discovered */
+		if (n == 0 && g_str_equal (timing_phases[i].phase, "discovery"))
+			g_string_append_printf (report, "\t%s\treused\n", timing_phases[i].phase);
+		else
+			g_string_append_printf (report, "\t%s\t%.3f\t%u\n", timing_phases[i].phase,
+			                        (gdouble)total / G_USEC_PER_SEC, n);
+	}
+
+	g_string_append_printf (report, "\ttotal\t%.3f\n",
+	                        (gdouble)(g_get_monotonic_time () - timing->started) / G_USEC_PER_SEC);
+
+	realm_diagnostics_info (invocation, "%s", report->str);
+	g_string_free (report, TRUE);
+}
+
 static void
 enroll_method_reply (GDBusMethodInvocation *invocation,
                      GError *error)
 {
 	if (error == NULL) {
 		realm_diagnostics_info (invocation, "Successfully enrolled machine in realm");
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 
 	} else if (error->domain == REALM_ERROR || error->domain == G_DBUS_ERROR) {
 		realm_diagnostics_error (invocation, error, NULL);
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_gerror (invocation, error);
 
 	} else {
 		realm_diagnostics_error (invocation, error, "Failed to enroll machine in realm");
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_FAILED,
 		                                       _("Failed to enroll machine in realm. See diagnostics."));
 	}
 
-	realm_daemon_unlock_for_action (invocation);
+	realm_lock_release (invocation);
 }
 
 static void
@@ -149,19 +264,22 @@ unenroll_method_reply (GDBusMethodInvocation *invocation,
 {
 	if (error == NULL) {
 		realm_diagnostics_info (invocation, "Successfully unenrolled machine from realm");
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 
 	} else if (error->domain == REALM_ERROR || error->domain == G_DBUS_ERROR) {
 		realm_diagnostics_error (invocation, error, NULL);
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_gerror (invocation, error);
 
 	} else {
 		realm_diagnostics_error (invocation, error, "Failed to unenroll machine from realm");
+		operation_timing_report (invocation);
 		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_FAILED,
 		                                       _("Failed to unenroll machine from domain. See diagnostics."));
 	}
 
-	realm_daemon_unlock_for_action (invocation);
+	realm_lock_release (invocation);
 }
 
 static void
@@ -183,7 +301,7 @@ on_unenroll_complete (GObject *source,
 	method_closure_free (closure);
 }
 
-static void
+static gboolean
 enroll_or_unenroll_with_ccache (RealmKerberos *self,
                                 RealmKerberosFlags flags,
                                 GVariant *options,
@@ -202,13 +320,7 @@ enroll_or_unenroll_with_ccache (RealmKerberos *self,
 		                                       enroll ?
 		                                            _("Enrolling this realm using a credential cache is not supported") :
 		                                            _("Unenrolling this realm using a credential cache is not supported"));
-		return;
-	}
-
-	if (!realm_daemon_lock_for_action (invocation)) {
-		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_BUSY,
-		                                       _("Already running another action"));
-		return;
+		return FALSE;
 	}
 
 	data = g_variant_get_fixed_array (ccache, &length, 1);
@@ -217,19 +329,20 @@ enroll_or_unenroll_with_ccache (RealmKerberos *self,
 	                                    g_variant_ref (ccache));
 
 	if (enroll) {
-		g_return_if_fail (iface->enroll_finish != NULL);
+		g_return_val_if_fail (iface->enroll_finish != NULL, FALSE);
 		(iface->enroll_ccache_async) (REALM_KERBEROS_MEMBERSHIP (self), bytes, flags, options, invocation,
 		                              on_enroll_complete, method_closure_new (self, invocation));
 	} else {
-		g_return_if_fail (iface->unenroll_finish != NULL);
+		g_return_val_if_fail (iface->unenroll_finish != NULL, FALSE);
 		(iface->unenroll_ccache_async) (REALM_KERBEROS_MEMBERSHIP (self), bytes, flags, options, invocation,
 		                                on_unenroll_complete, method_closure_new (self, invocation));
 	}
 
 	g_bytes_unref (bytes);
+	return TRUE;
 }
 
-static void
+static gboolean
 enroll_or_unenroll_with_secret (RealmKerberos *self,
                                 RealmKerberosFlags flags,
                                 GVariant *options,
@@ -248,13 +361,7 @@ enroll_or_unenroll_with_secret (RealmKerberos *self,
 		                                       enroll ?
 		                                            _("Enrolling this realm using a secret is not supported") :
 		                                            _("Unenrolling this realm using a secret is not supported"));
-		return;
-	}
-
-	if (!realm_daemon_lock_for_action (invocation)) {
-		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_BUSY,
-		                                       _("Already running another action"));
-		return;
+		return FALSE;
 	}
 
 	data = g_variant_get_fixed_array (secret, &length, 1);
@@ -263,19 +370,20 @@ enroll_or_unenroll_with_secret (RealmKerberos *self,
 	                                    g_variant_ref (secret));
 
 	if (enroll) {
-		g_return_if_fail (iface->enroll_finish != NULL);
+		g_return_val_if_fail (iface->enroll_finish != NULL, FALSE);
 		(iface->enroll_secret_async) (REALM_KERBEROS_MEMBERSHIP (self), bytes, flags, options, invocation,
 		                              on_enroll_complete, method_closure_new (self, invocation));
 	} else {
-		g_return_if_fail (iface->unenroll_finish != NULL);
+		g_return_val_if_fail (iface->unenroll_finish != NULL, FALSE);
 		(iface->unenroll_secret_async) (REALM_KERBEROS_MEMBERSHIP (self), bytes, flags, options, invocation,
 		                                on_unenroll_complete, method_closure_new (self, invocation));
 	}
 
 	g_bytes_unref (bytes);
+	return TRUE;
 }
 
-static void
+static gboolean
 enroll_or_unenroll_with_password (RealmKerberos *self,
                                   RealmKerberosFlags flags,
                                   GVariant *options,
@@ -294,13 +402,7 @@ enroll_or_unenroll_with_password (RealmKerberos *self,
 		                                       enroll ?
 		                                           _("Enrolling this realm using a password is not supported") :
 		                                           _("Unenrolling this realm using a password is not supported"));
-		return;
-	}
-
-	if (!realm_daemon_lock_for_action (invocation)) {
-		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_BUSY,
-		                                       _("Already running another action"));
-		return;
+		return FALSE;
 	}
 
 	g_variant_get (creds, "(&s&s)", &name, &password);
@@ -309,20 +411,21 @@ enroll_or_unenroll_with_password (RealmKerberos *self,
 	                                    g_variant_ref (creds));
 
 	if (enroll) {
-		g_return_if_fail (iface->enroll_finish != NULL);
+		g_return_val_if_fail (iface->enroll_finish != NULL, FALSE);
 		(iface->enroll_password_async) (REALM_KERBEROS_MEMBERSHIP (self), name, bytes, flags, options, invocation,
 		                                on_enroll_complete, method_closure_new (self, invocation));
 
 	} else {
-		g_return_if_fail (iface->unenroll_finish != NULL);
+		g_return_val_if_fail (iface->unenroll_finish != NULL, FALSE);
 		(iface->unenroll_password_async) (REALM_KERBEROS_MEMBERSHIP (self), name, bytes, flags, options, invocation,
 		                                  on_unenroll_complete, method_closure_new (self, invocation));
 	}
 
 	g_bytes_unref (bytes);
+	return TRUE;
 }
 
-static void
+static gboolean
 enroll_or_unenroll_with_automatic (RealmKerberos *self,
                                    RealmKerberosFlags flags,
                                    GVariant *options,
@@ -337,24 +440,20 @@ enroll_or_unenroll_with_automatic (RealmKerberos *self,
 		                                       enroll ?
 		                                            _("Enrolling this realm without credentials is not supported") :
 		                                            _("Unenrolling this realm without credentials is not supported"));
-		return;
-	}
-
-	if (!realm_daemon_lock_for_action (invocation)) {
-		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_BUSY,
-		                                       _("Already running another action"));
-		return;
+		return FALSE;
 	}
 
 	if (enroll) {
-		g_return_if_fail (iface->enroll_finish != NULL);
+		g_return_val_if_fail (iface->enroll_finish != NULL, FALSE);
 		(iface->enroll_automatic_async) (REALM_KERBEROS_MEMBERSHIP (self), flags, options, invocation,
 		                                 on_enroll_complete, method_closure_new (self, invocation));
 	} else {
-		g_return_if_fail (iface->enroll_finish != NULL);
+		g_return_val_if_fail (iface->enroll_finish != NULL, FALSE);
 		(iface->unenroll_automatic_async) (REALM_KERBEROS_MEMBERSHIP (self), flags, options, invocation,
 		                                   on_unenroll_complete, method_closure_new (self, invocation));
 	}
+
+	return TRUE;
 }
 
 static gboolean
@@ -435,6 +534,109 @@ validate_and_parse_credentials (GDBusMethodInvocation *invocation,
 	return FALSE;
 }
 
+typedef struct {
+	RealmKerberos *self;
+	GDBusMethodInvocation *invocation;
+	RealmKerberosFlags flags;
+	RealmKerberosCredential cred_type;
+	GVariant *creds;
+	GVariant *options;
+	gboolean enroll;
+} EnrollClosure;
+
+static void
+enroll_closure_free (EnrollClosure *closure)
+{
+	g_object_unref (closure->self);
+	g_object_unref (closure->invocation);
+	if (closure->creds)
+		g_variant_unref (closure->creds);
+	g_variant_unref (closure->options);
+	g_slice_free (EnrollClosure, closure);
+}
+
+static gchar *
+lock_resource_for_realm (RealmKerberos *self)
+{
+	return g_strdup_printf ("realm:%s", realm_kerberos_get_name (self));
+}
+
+static void
+on_enroll_locked (GObject *source,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+	EnrollClosure *closure = user_data;
+	GError *error = NULL;
+	gboolean started = FALSE;
+
+	if (!realm_lock_acquire_finish (result, &error)) {
+		g_dbus_method_invocation_return_gerror (closure->invocation, error);
+		g_error_free (error);
+		enroll_closure_free (closure);
+		return;
+	}
+
+	switch (closure->cred_type) {
+	case REALM_KERBEROS_CREDENTIAL_CCACHE:
+		started = enroll_or_unenroll_with_ccache (closure->self, closure->flags, closure->options,
+		                                          closure->invocation, closure->creds, closure->enroll);
+		break;
+	case REALM_KERBEROS_CREDENTIAL_PASSWORD:
+		started = enroll_or_unenroll_with_password (closure->self, closure->flags, closure->options,
+		                                            closure->invocation, closure->creds, closure->enroll);
+		break;
+	case REALM_KERBEROS_CREDENTIAL_SECRET:
+		started = enroll_or_unenroll_with_secret (closure->self, closure->flags, closure->options,
+		                                          closure->invocation, closure->creds, closure->enroll);
+		break;
+	case REALM_KERBEROS_CREDENTIAL_AUTOMATIC:
+		started = enroll_or_unenroll_with_automatic (closure->self, closure->flags, closure->options,
+		                                             closure->invocation, closure->enroll);
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	if (!started)
+		realm_lock_release (closure->invocation);
+
+	enroll_closure_free (closure);
+}
+
+static void
+enroll_or_unenroll (RealmKerberos *self,
+                    RealmKerberosFlags flags,
+                    GVariant *options,
+                    GDBusMethodInvocation *invocation,
+                    RealmKerberosCredential cred_type,
+                    GVariant *creds,
+                    gboolean enroll)
+{
+	EnrollClosure *closure;
+	gchar *resource;
+
+	closure = g_slice_new0 (EnrollClosure);
+	closure->self = g_object_ref (self);
+	closure->invocation = g_object_ref (invocation);
+	closure->flags = flags;
+	closure->cred_type = cred_type;
+	closure->creds = creds ? g_variant_ref (creds) : NULL;
+	closure->options = g_variant_ref (options);
+	closure->enroll = enroll;
+
+	realm_diagnostics_set_realm (invocation, realm_kerberos_get_name (self));
+	operation_timing_begin (invocation, options, enroll);
+
+	/* Joining and leaving change machine wide state, such as the keytab */
+	resource = lock_resource_for_realm (self);
+	realm_lock_acquire_async (invocation, options, on_enroll_locked, closure,
+	                          resource, REALM_LOCK_EXCLUSIVE,
+	                          REALM_LOCK_SYSTEM, REALM_LOCK_EXCLUSIVE,
+	                          NULL);
+	g_free (resource);
+}
+
 static gboolean
 handle_join (RealmDbusKerberosMembership *membership,
              GDBusMethodInvocation *invocation,
@@ -453,22 +655,7 @@ handle_join (RealmDbusKerberosMembership *membership,
 	if (!validate_and_parse_credentials (invocation, credentials, &flags, &cred_type, &creds))
 		return TRUE;
 
-	switch (cred_type) {
-	case REALM_KERBEROS_CREDENTIAL_CCACHE:
-		enroll_or_unenroll_with_ccache (self, flags, options, invocation, creds, TRUE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_PASSWORD:
-		enroll_or_unenroll_with_password (self, flags, options, invocation, creds, TRUE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_SECRET:
-		enroll_or_unenroll_with_secret (self, flags, options, invocation, creds, TRUE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_AUTOMATIC:
-		enroll_or_unenroll_with_automatic (self, flags, options, invocation, TRUE);
-		break;
-	default:
-		g_assert_not_reached ();
-	}
+	enroll_or_unenroll (self, flags, options, invocation, cred_type, creds, TRUE);
 
 	g_variant_unref (creds);
 	return TRUE;
@@ -492,22 +679,7 @@ handle_leave (RealmDbusKerberosMembership *membership,
 	if (!validate_and_parse_credentials (invocation, credentials, &flags, &cred_type, &creds))
 		return TRUE;
 
-	switch (cred_type) {
-	case REALM_KERBEROS_CREDENTIAL_CCACHE:
-		enroll_or_unenroll_with_ccache (self, flags, options, invocation, creds, FALSE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_PASSWORD:
-		enroll_or_unenroll_with_password (self, flags, options, invocation, creds, FALSE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_SECRET:
-		enroll_or_unenroll_with_secret (self, flags, options, invocation, creds, FALSE);
-		break;
-	case REALM_KERBEROS_CREDENTIAL_AUTOMATIC:
-		enroll_or_unenroll_with_automatic (self, flags, options, invocation, FALSE);
-		break;
-	default:
-		g_assert_not_reached ();
-	}
+	enroll_or_unenroll (self, flags, options, invocation, cred_type, creds, FALSE);
 
 	g_variant_unref (creds);
 	return TRUE;
@@ -524,8 +696,8 @@ handle_deconfigure (RealmDbusRealm *realm,
 	/* Make note of the current operation id, for diagnostics */
 	realm_diagnostics_setup_options (invocation, options);
 
-	enroll_or_unenroll_with_automatic (self, REALM_KERBEROS_OWNER_COMPUTER,
-	                                   options, invocation, FALSE);
+	enroll_or_unenroll (self, REALM_KERBEROS_OWNER_COMPUTER, options, invocation,
+	                    REALM_KERBEROS_CREDENTIAL_AUTOMATIC, NULL, FALSE);
 	return TRUE;
 }
 
@@ -559,46 +731,38 @@ on_logins_complete (GObject *source,
 		g_error_free (error);
 	}
 
-	realm_daemon_unlock_for_action (closure->invocation);
+	realm_lock_release (closure->invocation);
 	method_closure_free (closure);
 }
 
 static gboolean
-handle_change_login_policy (RealmDbusRealm *realm,
-                            GDBusMethodInvocation *invocation,
-                            const gchar *login_policy,
-                            const gchar *const *add,
-                            const gchar *const *remove,
-                            GVariant *options,
-                            gpointer user_data)
+parse_login_policy (GDBusMethodInvocation *invocation,
+                    const gchar *login_policy,
+                    RealmKerberosLoginPolicy *policy)
 {
-	RealmKerberosLoginPolicy policy = REALM_KERBEROS_POLICY_NOT_SET;
-	RealmKerberos *self = REALM_KERBEROS (user_data);
-	RealmKerberosClass *klass;
 	gchar **policies;
 	gint policies_set = 0;
 	gint i;
 
-	/* Make note of the current operation id, for diagnostics */
-	realm_diagnostics_setup_options (invocation, options);
+	*policy = REALM_KERBEROS_POLICY_NOT_SET;
 
 	policies = g_strsplit_set (login_policy, ", \t", -1);
 	for (i = 0; policies[i] != NULL; i++) {
 		if (g_str_equal (policies[i], REALM_DBUS_LOGIN_POLICY_ANY)) {
-			policy = REALM_KERBEROS_ALLOW_ANY_LOGIN;
+			*policy = REALM_KERBEROS_ALLOW_ANY_LOGIN;
 			policies_set++;
 		} else if (g_str_equal (policies[i], REALM_DBUS_LOGIN_POLICY_PERMITTED)) {
-			policy = REALM_KERBEROS_ALLOW_PERMITTED_LOGINS;
+			*policy = REALM_KERBEROS_ALLOW_PERMITTED_LOGINS;
 			policies_set++;
 		} else if (g_str_equal (policies[i], REALM_DBUS_LOGIN_POLICY_DENY)) {
-			policy = REALM_KERBEROS_DENY_ANY_LOGIN;
+			*policy = REALM_KERBEROS_DENY_ANY_LOGIN;
 			policies_set++;
 		} else {
 			g_strfreev (policies);
 			g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
 			                                       G_DBUS_ERROR_INVALID_ARGS,
 			                                       "Invalid or unknown login_policy argument");
-			return TRUE;
+			return FALSE;
 		}
 	}
 
@@ -608,21 +772,304 @@ handle_change_login_policy (RealmDbusRealm *realm,
 		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
 		                                       G_DBUS_ERROR_INVALID_ARGS,
 		                                       "Conflicting flags in login_policy argument");
-		return TRUE;
+		return FALSE;
 	}
 
-	if (!realm_daemon_lock_for_action (invocation)) {
-		g_dbus_method_invocation_return_error (invocation, REALM_ERROR, REALM_ERROR_BUSY,
-		                                       _("Already running another action"));
-		return TRUE;
+	return TRUE;
+}
+
+typedef struct {
+	RealmKerberos *self;
+	GDBusMethodInvocation *invocation;
+	RealmKerberosLoginPolicy policy;
+	gchar **add;
+	gchar **remove;
+} LoginsClosure;
+
+static void
+logins_closure_free (LoginsClosure *closure)
+{
+	g_object_unref (closure->self);
+	g_object_unref (closure->invocation);
+	g_strfreev (closure->add);
+	g_strfreev (closure->remove);
+	g_slice_free (LoginsClosure, closure);
+}
+
+static void
+on_logins_locked (GObject *source,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+	LoginsClosure *closure = user_data;
+	RealmKerberosClass *klass;
+	GError *error = NULL;
+
+	if (!realm_lock_acquire_finish (result, &error)) {
+		g_dbus_method_invocation_return_gerror (closure->invocation, error);
+		g_error_free (error);
+
+	} else {
+		klass = REALM_KERBEROS_GET_CLASS (closure->self);
+		g_assert (klass->logins_async != NULL);
+
+		(klass->logins_async) (closure->self, closure->invocation, closure->policy,
+		                       (const gchar **)closure->add, (const gchar **)closure->remove,
+		                       on_logins_complete,
+		                       method_closure_new (closure->self, closure->invocation));
 	}
 
+	logins_closure_free (closure);
+}
+
+static void
+change_logins (RealmKerberos *self,
+               GDBusMethodInvocation *invocation,
+               RealmKerberosLoginPolicy policy,
+               const gchar *const *add,
+               const gchar *const *remove,
+               GVariant *options)
+{
+	RealmKerberosClass *klass;
+	LoginsClosure *closure;
+	gchar *resource;
+
+	closure = g_slice_new0 (LoginsClosure);
+	closure->self = g_object_ref (self);
+	closure->invocation = g_object_ref (invocation);
+	closure->policy = policy;
+	closure->add = g_strdupv ((gchar **)add);
+	closure->remove = g_strdupv ((gchar **)remove);
+
+	/*
+	 * Policy changes to different realms can run alongside each other,
+	 * unless they change a file or restart a service that the realms
+	 * share. That lock goes last, since if there is none it ends the list.
+	 */
 	klass = REALM_KERBEROS_GET_CLASS (self);
-	g_return_val_if_fail (klass->logins_async != NULL, FALSE);
+	resource = lock_resource_for_realm (self);
+	realm_lock_acquire_async (invocation, options, on_logins_locked, closure,
+	                          resource, REALM_LOCK_EXCLUSIVE,
+	                          REALM_LOCK_SYSTEM, REALM_LOCK_SHARED,
+	                          klass->logins_lock, REALM_LOCK_EXCLUSIVE,
+	                          NULL);
+	g_free (resource);
+}
+
+static gboolean
+handle_change_login_policy (RealmDbusRealm *realm,
+                            GDBusMethodInvocation *invocation,
+                            const gchar *login_policy,
+                            const gchar *const *add,
+                            const gchar *const *remove,
+                            GVariant *options,
+                            gpointer user_data)
+{
+	RealmKerberosLoginPolicy policy;
+	RealmKerberos *self = REALM_KERBEROS (user_data);
+
+	/* Make note of the current operation id, for diagnostics */
+	realm_diagnostics_setup_options (invocation, options);
+
+	if (!parse_login_policy (invocation, login_policy, &policy))
+		return TRUE;
+
+	change_logins (self, invocation, policy, add, remove, options);
+	return TRUE;
+}
+
+/* Don't let a client make us buffer without bound */
+#define LOGINS_FD_MAX_SIZE (64 * 1024 * 1024)
+#define LOGINS_FD_CHUNK (64 * 1024)
 
-	(klass->logins_async) (self, invocation, policy, (const gchar **)add,
-	                       (const gchar **)remove, on_logins_complete,
-	                       method_closure_new (self, invocation));
+typedef struct {
+	RealmKerberos *self;
+	GDBusMethodInvocation *invocation;
+	RealmKerberosLoginPolicy policy;
+	gboolean remove;
+	GVariant *options;
+	GInputStream *stream;
+	gchar *buffer;
+	GString *partial;
+	GPtrArray *logins;
+	gsize total;
+} LoginsFdClosure;
+
+static void
+logins_fd_closure_free (gpointer data)
+{
+	LoginsFdClosure *closure = data;
+	g_object_unref (closure->self);
+	g_object_unref (closure->invocation);
+	g_variant_unref (closure->options);
+	g_object_unref (closure->stream);
+	g_free (closure->buffer);
+	g_string_free (closure->partial, TRUE);
+	g_ptr_array_free (closure->logins, TRUE);
+	g_slice_free (LoginsFdClosure, closure);
+}
+
+static gboolean
+logins_fd_add_line (LoginsFdClosure *closure,
+                    const gchar *line,
+                    gsize length,
+                    GError **error)
+{
+	if (length > 0 && line[length - 1] == '\r')
+		length--;
+	if (length == 0)
+		return TRUE;
+
+	if (!g_utf8_validate (line, length, NULL)) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+		             _("Invalid login argument: not valid UTF-8"));
+		return FALSE;
+	}
+
+	g_ptr_array_add (closure->logins, g_strndup (line, length));
+	return TRUE;
+}
+
+static gboolean
+logins_fd_add_chunk (LoginsFdClosure *closure,
+                     const gchar *data,
+                     gsize length,
+                     GError **error)
+{
+	const gchar *end = data + length;
+	const gchar *eol;
+
+	/* Only a partial line is ever kept across chunks */
+	while ((eol = memchr (data, '\n', end - data)) != NULL) {
+		if (closure->partial->len > 0) {
+			g_string_append_len (closure->partial, data, eol - data);
+			if (!logins_fd_add_line (closure, closure->partial->str,
+			                         closure->partial->len, error))
+				return FALSE;
+			g_string_truncate (closure->partial, 0);
+		} else if (!logins_fd_add_line (closure, data, eol - data, error)) {
+			return FALSE;
+		}
+		data = eol + 1;
+	}
+
+	g_string_append_len (closure->partial, data, end - data);
+	return TRUE;
+}
+
+static void
+logins_fd_complete (LoginsFdClosure *closure,
+                    GError *error)
+{
+	const gchar *none[] = { NULL };
+	const gchar **logins;
+
+	if (error == NULL)
+		logins_fd_add_line (closure, closure->partial->str, closure->partial->len, &error);
+
+	if (error != NULL) {
+		realm_diagnostics_error (closure->invocation, error, NULL);
+		g_dbus_method_invocation_return_gerror (closure->invocation, error);
+		g_error_free (error);
+		return;
+	}
+
+	realm_diagnostics_info (closure->invocation, "Read %u logins to %s",
+	                        closure->logins->len, closure->remove ? "remove" : "permit");
+
+	g_ptr_array_add (closure->logins, NULL);
+	logins = (const gchar **)closure->logins->pdata;
+
+	/* The whole list goes to the provider as one change */
+	change_logins (closure->self, closure->invocation, closure->policy,
+	               closure->remove ? none : logins,
+	               closure->remove ? logins : none,
+	               closure->options);
+}
+
+static void
+on_logins_fd_read (GObject *source,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+	LoginsFdClosure *closure = user_data;
+	GError *read_error = NULL;
+	GError *error = NULL;
+	gssize count;
+
+	count = g_input_stream_read_finish (closure->stream, result, &read_error);
+	if (count < 0) {
+		g_set_error (&error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+		             _("Couldn't read logins: %s"), read_error->message);
+		g_error_free (read_error);
+
+	} else if (count > 0) {
+		closure->total += count;
+		if (closure->total > LOGINS_FD_MAX_SIZE) {
+			g_set_error (&error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			             _("Too many logins were passed"));
+		} else if (logins_fd_add_chunk (closure, closure->buffer, count, &error)) {
+			g_input_stream_read_async (closure->stream, closure->buffer, LOGINS_FD_CHUNK,
+			                           G_PRIORITY_DEFAULT,
+			                           realm_invocation_get_cancellable (closure->invocation),
+			                           on_logins_fd_read, closure);
+			return;
+		}
+	}
+
+	logins_fd_complete (closure, error);
+	logins_fd_closure_free (closure);
+}
+
+static gboolean
+handle_change_login_policy_from_fd (RealmDbusRealm *realm,
+                                    GDBusMethodInvocation *invocation,
+                                    GUnixFDList *fd_list,
+                                    const gchar *login_policy,
+                                    gint logins,
+                                    GVariant *options,
+                                    gpointer user_data)
+{
+	RealmKerberosLoginPolicy policy;
+	RealmKerberos *self = REALM_KERBEROS (user_data);
+	LoginsFdClosure *closure;
+	gboolean remove = FALSE;
+	GError *error = NULL;
+	int fd = -1;
+
+	/* Make note of the current operation id, for diagnostics */
+	realm_diagnostics_setup_options (invocation, options);
+
+	if (!parse_login_policy (invocation, login_policy, &policy))
+		return TRUE;
+
+	g_variant_lookup (options, REALM_DBUS_OPTION_REMOVE, "b", &remove);
+
+	if (fd_list != NULL)
+		fd = g_unix_fd_list_get (fd_list, logins, &error);
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+		                                       G_DBUS_ERROR_INVALID_ARGS,
+		                                       "Invalid logins file descriptor: %s",
+		                                       error ? error->message : "missing");
+		g_clear_error (&error);
+		return TRUE;
+	}
+
+	closure = g_slice_new0 (LoginsFdClosure);
+	closure->self = g_object_ref (self);
+	closure->invocation = g_object_ref (invocation);
+	closure->policy = policy;
+	closure->remove = remove;
+	closure->options = g_variant_ref (options);
+	closure->stream = g_unix_input_stream_new (fd, TRUE);
+	closure->buffer = g_malloc (LOGINS_FD_CHUNK);
+	closure->partial = g_string_new ("");
+	closure->logins = g_ptr_array_new_with_free_func (g_free);
+
+	g_input_stream_read_async (closure->stream, closure->buffer, LOGINS_FD_CHUNK,
+	                           G_PRIORITY_DEFAULT, realm_invocation_get_cancellable (invocation),
+	                           on_logins_fd_read, closure);
 
 	return TRUE;
 }
@@ -635,7 +1082,6 @@ realm_kerberos_authorize_method (GDBusObjectSkeleton    *object,
 	const gchar *interface = g_dbus_method_invocation_get_interface_name (invocation);
 	const gchar *method = g_dbus_method_invocation_get_method_name (invocation);
 	const gchar *action_id = NULL;
-	gboolean ret = FALSE;
 
 	/* Each method has its own polkit authorization */
 	if (g_str_equal (interface, REALM_DBUS_KERBEROS_MEMBERSHIP_INTERFACE)) {
@@ -649,25 +1095,20 @@ realm_kerberos_authorize_method (GDBusObjectSkeleton    *object,
 			action_id = "org.freedesktop.realmd.deconfigure-realm";
 		else if (g_str_equal (method, "ChangeLoginPolicy"))
 			action_id = "org.freedesktop.realmd.login-policy";
+		else if (g_str_equal (method, "ChangeLoginPolicyFromFd"))
+			action_id = "org.freedesktop.realmd.login-policy";
 	}
 
 	if (action_id == NULL) {
 		g_warning ("encountered unknown method during auth checks: %s.%s",
 		           interface, method);
-		ret = FALSE;
-	} else {
-		ret = realm_daemon_check_dbus_action (g_dbus_method_invocation_get_sender (invocation),
-		                                      action_id);
-	}
-
-	if (ret == FALSE) {
-		g_debug ("rejecting access to: %s.%s method on %s",
-		         interface, method, g_dbus_method_invocation_get_object_path (invocation));
 		g_dbus_method_invocation_return_dbus_error (invocation, REALM_DBUS_ERROR_NOT_AUTHORIZED,
 		                                            _("Not authorized to perform this action"));
+		return FALSE;
 	}
 
-	return ret;
+	/* Either authorized now, or rejected or dispatched later */
+	return realm_daemon_authorize_method (iface, invocation, action_id);
 }
 
 static void
@@ -683,6 +1124,8 @@ realm_kerberos_init (RealmKerberos *self)
 	                  G_CALLBACK (handle_deconfigure), self);
 	g_signal_connect (self->pv->realm_iface, "handle-change-login-policy",
 	                  G_CALLBACK (handle_change_login_policy), self);
+	g_signal_connect (self->pv->realm_iface, "handle-change-login-policy-from-fd",
+	                  G_CALLBACK (handle_change_login_policy_from_fd), self);
 	g_dbus_object_skeleton_add_interface (skeleton, G_DBUS_INTERFACE_SKELETON (self->pv->realm_iface));
 
 	self->pv->kerberos_iface = realm_dbus_kerberos_skeleton_new ();
@@ -787,6 +1230,8 @@ realm_kerberos_finalize (GObject *obj)
 	if (self->pv->discovery)
 		g_hash_table_unref (self->pv->discovery);
 
+	realm_login_matcher_free (self->pv->login_matcher);
+
 	G_OBJECT_CLASS (realm_kerberos_parent_class)->finalize (obj);
 }
 
@@ -839,27 +1284,52 @@ realm_kerberos_get_discovery (RealmKerberos *self)
 	return self->pv->discovery;
 }
 
+static RealmLoginMatcher *
+lookup_login_matcher (RealmKerberos *self)
+{
+	const gchar *const *formats;
+	const gchar *domain;
+
+	/* Built once, and thrown away when the formats or domain change */
+	if (self->pv->login_matcher == NULL) {
+		formats = realm_dbus_realm_get_login_formats (self->pv->realm_iface);
+		if (formats == NULL)
+			return NULL;
+		domain = realm_dbus_kerberos_get_domain_name (self->pv->kerberos_iface);
+		self->pv->login_matcher = realm_login_matcher_new (formats, domain);
+	}
+
+	return self->pv->login_matcher;
+}
+
+static void
+clear_login_matcher (RealmKerberos *self)
+{
+	realm_login_matcher_free (self->pv->login_matcher);
+	self->pv->login_matcher = NULL;
+}
+
 gchar **
 realm_kerberos_parse_logins (RealmKerberos *self,
                              gboolean lower,
                              const gchar **logins,
                              GError **error)
 {
+	RealmLoginMatcher *matcher;
 	const gchar *failed = NULL;
-	const gchar *const *formats;
 	gchar **result;
 
 	g_return_val_if_fail (REALM_IS_KERBEROS (self), NULL);
 
-	formats = realm_dbus_realm_get_login_formats (self->pv->realm_iface);
-	if (formats == NULL) {
+	matcher = lookup_login_matcher (self);
+	if (matcher == NULL) {
 		g_set_error (error, REALM_ERROR,
 		             REALM_ERROR_NOT_CONFIGURED,
 		             _("The realm does not allow specifying logins"));
 		return NULL;
 	}
 
-	result = realm_login_name_parse_all (formats, lower, logins, &failed);
+	result = realm_login_matcher_parse_all (matcher, lower, logins, &failed);
 	if (result == NULL) {
 		g_set_error (error, G_DBUS_ERROR,
 		             G_DBUS_ERROR_INVALID_ARGS,
@@ -874,16 +1344,316 @@ gchar *
 realm_kerberos_format_login (RealmKerberos *self,
                              const gchar *user)
 {
-	const gchar *const *formats;
+	RealmLoginMatcher *matcher;
 
 	g_return_val_if_fail (REALM_IS_KERBEROS (self), NULL);
 	g_return_val_if_fail (user != NULL, NULL);
 
-	formats = realm_dbus_realm_get_login_formats (self->pv->realm_iface);
-	if (formats == NULL || formats[0] == NULL)
+	matcher = lookup_login_matcher (self);
+	if (matcher == NULL)
+		return NULL;
+
+	return realm_login_matcher_format (matcher, user);
+}
+
+#define MEMORY_CCACHE_PREFIX "MEMORY:"
+
+/*
+ * A few warm kerberos contexts, so that krb5.conf isn't parsed and the
+ * plugins loaded again for each operation. They're only kept for a
+ * short while, so that changes to krb5.conf are picked up.
+ */
+#define CONTEXT_POOL_SIZE 4
+#define CONTEXT_POOL_AGE (60 * G_TIME_SPAN_SECOND)
+
+typedef struct {
+	krb5_context context;
+	gint64 created;
+} PooledContext;
+
+G_LOCK_DEFINE_STATIC (context_pool);
+static GQueue context_pool = G_QUEUE_INIT;
+
+static void
+pooled_context_free (PooledContext *pooled)
+{
+	krb5_free_context (pooled->context);
+	g_slice_free (PooledContext, pooled);
+}
+
+static PooledContext *
+pooled_context_acquire (krb5_error_code *code)
+{
+	PooledContext *pooled;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+
+	for (;;) {
+		G_LOCK (context_pool);
+		pooled = g_queue_pop_head (&context_pool);
+		G_UNLOCK (context_pool);
+
+		if (pooled == NULL)
+			break;
+		if (now - pooled->created < CONTEXT_POOL_AGE) {
+			realm_metrics_increment (REALM_METRIC_CACHE_HIT, "krb5-context");
+			return pooled;
+		}
+		pooled_context_free (pooled);
+	}
+
+	realm_metrics_increment (REALM_METRIC_CACHE_MISS, "krb5-context");
+
+	pooled = g_slice_new0 (PooledContext);
+	*code = krb5_init_context (&pooled->context);
+	if (*code != 0) {
+		g_slice_free (PooledContext, pooled);
 		return NULL;
+	}
+
+	pooled->created = now;
+	return pooled;
+}
 
-	return realm_login_name_format (formats[0], user);
+static void
+pooled_context_release (PooledContext *pooled)
+{
+	gboolean keep = FALSE;
+
+	if (g_get_monotonic_time () - pooled->created < CONTEXT_POOL_AGE) {
+		G_LOCK (context_pool);
+		if (context_pool.length < CONTEXT_POOL_SIZE) {
+			g_queue_push_head (&context_pool, pooled);
+			keep = TRUE;
+		}
+		G_UNLOCK (context_pool);
+	}
+
+	if (!keep)
+		pooled_context_free (pooled);
+}
+
+static krb5_error_code
+copy_ccache (krb5_context context,
+             krb5_ccache from,
+             const gchar *to_name)
+{
+	krb5_principal principal = NULL;
+	krb5_ccache to = NULL;
+	krb5_error_code code;
+
+	code = krb5_cc_get_principal (context, from, &principal);
+	if (code == 0)
+		code = krb5_cc_resolve (context, to_name, &to);
+	if (code == 0)
+		code = krb5_cc_initialize (context, to, principal);
+	if (code == 0)
+		code = krb5_cc_copy_creds (context, from, to);
+
+	if (principal)
+		krb5_free_principal (context, principal);
+	if (to)
+		krb5_cc_close (context, to);
+	return code;
+}
+
+/*
+ * Recently obtained TGTs, so that a client doing several operations in
+ * a row with the same credentials doesn't go to the KDC each time. The
+ * key covers the client, principal, enctypes and a keyed digest of the
+ * password, so a different password never matches.
+ */
+#define TGT_CACHE_LIFETIME (5 * 60 * G_TIME_SPAN_SECOND)
+#define TGT_CACHE_MAX 16
+
+typedef struct {
+	gchar *ccache_name;
+	gint64 expires;
+} CachedTgt;
+
+G_LOCK_DEFINE_STATIC (tgt_cache);
+static GHashTable *tgt_cache = NULL;
+
+static void
+cached_tgt_destroy (krb5_context context,
+                    CachedTgt *cached)
+{
+	krb5_ccache ccache;
+
+	if (krb5_cc_resolve (context, cached->ccache_name, &ccache) == 0)
+		krb5_cc_destroy (context, ccache);
+	g_free (cached->ccache_name);
+	g_slice_free (CachedTgt, cached);
+}
+
+static gchar *
+tgt_cache_key (const gchar *sender,
+               const gchar *principal,
+               const krb5_enctype *enctypes,
+               gint n_enctypes,
+               GBytes *password)
+{
+	static gsize salted = 0;
+	static guint32 salt[4];
+	GString *key;
+	gchar *digest;
+	gint i;
+
+	if (g_once_init_enter (&salted)) {
+		for (i = 0; i < G_N_ELEMENTS (salt); i++)
+			salt[i] = g_random_int ();
+		g_once_init_leave (&salted, 1);
+	}
+
+	digest = g_compute_hmac_for_data (G_CHECKSUM_SHA256, (const guchar *)salt, sizeof (salt),
+	                                  g_bytes_get_data (password, NULL),
+	                                  g_bytes_get_size (password));
+
+	key = g_string_new (sender);
+	g_string_append_printf (key, "\n%s\n", principal);
+	for (i = 0; i < n_enctypes; i++)
+		g_string_append_printf (key, "%d,", (gint)enctypes[i]);
+	g_string_append_printf (key, "\n%s", digest);
+
+	g_free (digest);
+	return g_string_free (key, FALSE);
+}
+
+static gboolean
+tgt_cache_lookup (krb5_context context,
+                  const gchar *key,
+                  const gchar *to_name)
+{
+	krb5_ccache from;
+	CachedTgt *cached;
+	gboolean found = FALSE;
+
+	G_LOCK (tgt_cache);
+
+	cached = tgt_cache ? g_hash_table_lookup (tgt_cache, key) : NULL;
+	if (cached && cached->expires <= g_get_monotonic_time ()) {
+		g_hash_table_remove (tgt_cache, key);
+		cached_tgt_destroy (context, cached);
+		cached = NULL;
+	}
+
+	if (cached && krb5_cc_resolve (context, cached->ccache_name, &from) == 0) {
+		found = (copy_ccache (context, from, to_name) == 0);
+		krb5_cc_close (context, from);
+	}
+
+	G_UNLOCK (tgt_cache);
+
+	return found;
+}
+
+static void
+tgt_cache_store (krb5_context context,
+                 const gchar *key,
+                 krb5_ccache from,
+                 krb5_timestamp endtime)
+{
+	GHashTableIter iter;
+	CachedTgt *cached;
+	CachedTgt *oldest;
+	gpointer okey, value;
+	gpointer oldest_key;
+	gint64 lifetime;
+
+	/* Don't hand out tickets that are about to expire */
+	lifetime = ((gint64)endtime - (gint64)time (NULL) - 60) * G_TIME_SPAN_SECOND;
+	lifetime = MIN (lifetime, TGT_CACHE_LIFETIME);
+	if (lifetime <= 0)
+		return;
+
+	cached = g_slice_new0 (CachedTgt);
+	cached->ccache_name = g_strdup_printf ("%srealmd-tgt-cache.%08x%08x", MEMORY_CCACHE_PREFIX,
+	                                       g_random_int (), g_random_int ());
+	cached->expires = g_get_monotonic_time () + lifetime;
+
+	if (copy_ccache (context, from, cached->ccache_name) != 0) {
+		cached_tgt_destroy (context, cached);
+		return;
+	}
+
+	G_LOCK (tgt_cache);
+
+	if (tgt_cache == NULL)
+		tgt_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	if (g_hash_table_lookup_extended (tgt_cache, key, &okey, &value)) {
+		g_hash_table_remove (tgt_cache, key);
+		cached_tgt_destroy (context, value);
+
+	} else if (g_hash_table_size (tgt_cache) >= TGT_CACHE_MAX) {
+		oldest = NULL;
+		oldest_key = NULL;
+		g_hash_table_iter_init (&iter, tgt_cache);
+		while (g_hash_table_iter_next (&iter, &okey, &value)) {
+			if (!oldest || ((CachedTgt *)value)->expires < oldest->expires) {
+				oldest = value;
+				oldest_key = okey;
+			}
+		}
+		g_hash_table_remove (tgt_cache, oldest_key);
+		cached_tgt_destroy (context, oldest);
+	}
+
+	g_hash_table_insert (tgt_cache, g_strdup (key), cached);
+
+	G_UNLOCK (tgt_cache);
+}
+
+/* Called when a client leaves the bus, its TGTs are no use to anyone else */
+void
+realm_kerberos_forget_sender (const gchar *sender)
+{
+	PooledContext *pooled;
+	GHashTableIter iter;
+	GList *forgotten = NULL;
+	krb5_error_code code;
+	gpointer key, value;
+	gchar *prefix;
+	GList *l;
+
+	g_return_if_fail (sender != NULL);
+
+	prefix = g_strdup_printf ("%s\n", sender);
+
+	G_LOCK (tgt_cache);
+	if (tgt_cache) {
+		g_hash_table_iter_init (&iter, tgt_cache);
+		while (g_hash_table_iter_next (&iter, &key, &value)) {
+			if (g_str_has_prefix (key, prefix)) {
+				forgotten = g_list_prepend (forgotten, value);
+				g_hash_table_iter_remove (&iter);
+			}
+		}
+	}
+	G_UNLOCK (tgt_cache);
+
+	g_free (prefix);
+
+	if (forgotten == NULL)
+		return;
+
+	pooled = pooled_context_acquire (&code);
+	if (pooled == NULL)
+		g_warning ("couldn't initialize kerberos context: %s", g_strerror (code));
+
+	for (l = forgotten; l != NULL; l = g_list_next (l)) {
+		if (pooled) {
+			cached_tgt_destroy (pooled->context, l->data);
+		} else {
+			g_free (((CachedTgt *)l->data)->ccache_name);
+			g_slice_free (CachedTgt, l->data);
+		}
+	}
+
+	if (pooled)
+		pooled_context_release (pooled);
+	g_list_free (forgotten);
 }
 
 typedef struct {
@@ -893,6 +1663,9 @@ typedef struct {
 	krb5_enctype *enctypes;
 	gint n_enctypes;
 	gchar *ccache_file;
+	gchar *cache_key;
+	gboolean cached;
+	RealmTraceSpan *span;
 } KinitClosure;
 
 static void
@@ -903,7 +1676,10 @@ kinit_closure_free (gpointer data)
 	g_free (kinit->principal);
 	g_bytes_unref (kinit->password);
 	g_free (kinit->enctypes);
-	realm_keberos_ccache_delete_and_free (kinit->ccache_file);
+	g_free (kinit->cache_key);
+	if (kinit->ccache_file)
+		realm_keberos_ccache_delete_and_free (kinit->ccache_file);
+	realm_trace_end (kinit->span);
 	g_slice_free (KinitClosure, kinit);
 }
 
@@ -969,19 +1745,34 @@ kinit_ccache_thread_func (GSimpleAsyncResult *async,
 {
 	KinitClosure *kinit = g_simple_async_result_get_op_res_gpointer (async);
 	krb5_get_init_creds_opt *options = NULL;
+	PooledContext *pooled = NULL;
 	krb5_context context = NULL;
 	krb5_principal principal = NULL;
-	krb5_error_code code;
+	krb5_error_code code = 0;
 	krb5_ccache ccache = NULL;
 	krb5_creds my_creds;
-	int temp_fd;
 
-	code = krb5_init_context (&context);
-	if (code != 0) {
+	pooled = pooled_context_acquire (&code);
+	if (pooled == NULL) {
 		kinit_handle_error (async, code, NULL, "Couldn't initialize kerberos");
 		goto cleanup;
 	}
 
+	context = pooled->context;
+
+	/* The credentials stay in memory until a child process needs them */
+	kinit->ccache_file = g_strdup_printf ("%srealmd-krb5-cache.%08x%08x", MEMORY_CCACHE_PREFIX,
+	                                      g_random_int (), g_random_int ());
+
+	/* Same client and credentials as a moment ago */
+	if (tgt_cache_lookup (context, kinit->cache_key, kinit->ccache_file)) {
+		realm_metrics_increment (REALM_METRIC_CACHE_HIT, "tgt");
+		kinit->cached = TRUE;
+		goto cleanup;
+	}
+
+	realm_metrics_increment (REALM_METRIC_CACHE_MISS, "tgt");
+
 	code = krb5_parse_name (context, kinit->principal, &principal);
 	if (code != 0) {
 		kinit_handle_error (async, code, context,
@@ -996,16 +1787,6 @@ kinit_ccache_thread_func (GSimpleAsyncResult *async,
 		goto cleanup;
 	}
 
-	kinit->ccache_file = g_build_filename (g_get_tmp_dir (), "realmd-krb5-cache.XXXXXX", NULL);
-	temp_fd = g_mkstemp_full (kinit->ccache_file, O_RDWR, S_IRUSR | S_IWUSR);
-	if (temp_fd == -1) {
-		g_simple_async_result_set_error (async, G_FILE_ERROR, g_file_error_from_errno (errno),
-		                                 "Couldn't create credential cache file: %s",
-		                                 g_strerror (errno));
-		goto cleanup;
-	}
-	close (temp_fd);
-
 	code = krb5_cc_resolve (context, kinit->ccache_file, &ccache);
 	if (code != 0) {
 		kinit_handle_error (async, code, context,
@@ -1032,6 +1813,9 @@ kinit_ccache_thread_func (GSimpleAsyncResult *async,
 		goto cleanup;
 	}
 
+	tgt_cache_store (context, kinit->cache_key, ccache, my_creds.times.endtime);
+	krb5_free_cred_contents (context, &my_creds);
+
 	krb5_cc_close (context, ccache);
 	ccache = NULL;
 
@@ -1042,8 +1826,8 @@ cleanup:
 		krb5_free_principal (context, principal);
 	if (ccache)
 		krb5_cc_close (context, ccache);
-	if (context)
-		krb5_free_context (context);
+	if (pooled)
+		pooled_context_release (pooled);
 }
 
 void
@@ -1081,8 +1865,15 @@ realm_kerberos_kinit_ccache_async (RealmKerberos *self,
 		kinit->principal = g_strdup (name);
 	}
 
+	kinit->cache_key = tgt_cache_key (g_dbus_method_invocation_get_sender (invocation),
+	                                  kinit->principal, kinit->enctypes, kinit->n_enctypes,
+	                                  password);
+
+	kinit->span = realm_trace_begin (invocation, "kinit", "%s", kinit->principal);
+
 	g_simple_async_result_set_op_res_gpointer (async, kinit, kinit_closure_free);
-	g_simple_async_result_run_in_thread (async, kinit_ccache_thread_func, G_PRIORITY_DEFAULT, NULL);
+	realm_worker_run_in_thread (async, kinit_ccache_thread_func,
+	                            realm_invocation_get_cancellable (invocation));
 	g_object_unref (async);
 }
 
@@ -1103,6 +1894,9 @@ realm_kerberos_kinit_ccache_finish (RealmKerberos *self,
 	async = G_SIMPLE_ASYNC_RESULT (result);
 	kinit = g_simple_async_result_get_op_res_gpointer (async);
 
+	realm_trace_end (kinit->span);
+	kinit->span = NULL;
+
 	if (g_simple_async_result_propagate_error (async, &krb5_error)) {
 		realm_diagnostics_error (kinit->invocation, krb5_error, NULL);
 
@@ -1123,18 +1917,87 @@ realm_kerberos_kinit_ccache_finish (RealmKerberos *self,
 		return NULL;
 	}
 
+	if (kinit->cached)
+		realm_diagnostics_info (kinit->invocation, "Using recently obtained credentials for: %s",
+		                        kinit->principal);
+
 	filename = kinit->ccache_file;
 	kinit->ccache_file = NULL;
 	return filename;
 }
 
+gchar *
+realm_kerberos_ccache_materialize (const gchar *ccache_name,
+                                   GError **error)
+{
+	PooledContext *pooled;
+	krb5_ccache memory = NULL;
+	krb5_error_code code = 0;
+	gchar *filename;
+	int temp_fd;
+
+	g_return_val_if_fail (ccache_name != NULL, NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	/* Already something other processes can use */
+	if (!g_str_has_prefix (ccache_name, MEMORY_CCACHE_PREFIX))
+		return g_strdup (ccache_name);
+
+	filename = g_build_filename (g_get_tmp_dir (), "realmd-krb5-cache.XXXXXX", NULL);
+	temp_fd = g_mkstemp_full (filename, O_RDWR, S_IRUSR | S_IWUSR);
+	if (temp_fd == -1) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+		             "Couldn't create credential cache file: %s", g_strerror (errno));
+		g_free (filename);
+		return NULL;
+	}
+	close (temp_fd);
+
+	pooled = pooled_context_acquire (&code);
+	if (pooled != NULL) {
+		code = krb5_cc_resolve (pooled->context, ccache_name, &memory);
+		if (code == 0)
+			code = copy_ccache (pooled->context, memory, filename);
+	}
+
+	if (code != 0) {
+		g_set_error (error, REALM_KRB5_ERROR, code,
+		             "Couldn't write credential cache file: %s: %s", filename,
+		             pooled ? krb5_get_error_message (pooled->context, code) : g_strerror (code));
+		g_unlink (filename);
+		g_free (filename);
+		filename = NULL;
+	}
+
+	if (memory)
+		krb5_cc_close (pooled->context, memory);
+	if (pooled)
+		pooled_context_release (pooled);
+
+	return filename;
+}
+
 void
 realm_keberos_ccache_delete_and_free (gchar *ccache_file)
 {
-	if (!realm_daemon_has_debug_flag () && g_unlink (ccache_file) < 0) {
+	krb5_error_code code = 0;
+	PooledContext *pooled;
+	krb5_ccache ccache;
+
+	/* Only files are kept around for debugging */
+	if (g_str_has_prefix (ccache_file, MEMORY_CCACHE_PREFIX)) {
+		pooled = pooled_context_acquire (&code);
+		if (pooled != NULL) {
+			if (krb5_cc_resolve (pooled->context, ccache_file, &ccache) == 0)
+				krb5_cc_destroy (pooled->context, ccache);
+			pooled_context_release (pooled);
+		}
+
+	} else if (!realm_daemon_has_debug_flag () && g_unlink (ccache_file) < 0) {
 		g_warning ("couldn't remove kerberos cache file: %s: %s",
 		           ccache_file, g_strerror (errno));
 	}
+
 	g_free (ccache_file);
 }
 
@@ -1166,6 +2029,7 @@ realm_kerberos_set_domain_name (RealmKerberos *self,
 {
 	g_return_if_fail (REALM_IS_KERBEROS (self));
 	realm_dbus_kerberos_set_domain_name (self->pv->kerberos_iface, value);
+	clear_login_matcher (self);
 }
 
 void
@@ -1234,6 +2098,7 @@ realm_kerberos_set_login_formats (RealmKerberos *self,
 {
 	g_return_if_fail (REALM_IS_KERBEROS (self));
 	realm_dbus_realm_set_login_formats (self->pv->realm_iface, (const gchar * const*)value);
+	clear_login_matcher (self);
 }
 
 void
@@ -63,6 +63,9 @@ struct _RealmKerberosClass {
 	                                         GAsyncResult *result,
 	                                         GError **error);
 
+	/* Locked exclusively while changing logins, if realms share it */
+	const gchar *logins_lock;
+
 };
 
 GType               realm_kerberos_get_type              (void) G_GNUC_CONST;
@@ -92,8 +95,13 @@ gchar *             realm_kerberos_kinit_ccache_finish   (RealmKerberos *self,
                                                           GAsyncResult *result,
                                                           GError **error);
 
+gchar *             realm_kerberos_ccache_materialize    (const gchar *ccache_name,
+                                                          GError **error);
+
 void                realm_keberos_ccache_delete_and_free (gchar *ccache_file);
 
+void                realm_kerberos_forget_sender         (const gchar *sender);
+
 const gchar *       realm_kerberos_get_name                    (RealmKerberos *self);
 
 const gchar *       realm_kerberos_get_realm_name              (RealmKerberos *self);
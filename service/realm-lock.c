@@ -0,0 +1,398 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-daemon.h"
+#include "realm-dbus-constants.h"
+#include "realm-diagnostics.h"
+#include "realm-errors.h"
+#include "realm-invocation.h"
+#include "realm-lock.h"
+#include "realm-metrics.h"
+#include "realm-settings.h"
+
+#include <glib/gi18n.h>
+
+#include <string.h>
+
+/*
+ * Each action locks the resources it touches, such as a realm or a
+ * config file, either shared or exclusive. Actions that conflict with
+ * one already running wait in line, ordered by their priority and then
+ * the order they arrived. A waiting action is never overtaken by one
+ * further back in line that conflicts with it.
+ */
+
+#define DEFAULT_QUEUE_TIMEOUT 300 /* seconds */
+
+typedef struct {
+	gchar *resource;
+	RealmLockMode mode;
+} LockClaim;
+
+typedef struct {
+	GDBusMethodInvocation *invocation;
+	GArray *claims;
+	GSimpleAsyncResult *async;
+	gchar *hold;
+	gint priority;
+	guint timeout_id;
+	GSource *cancel_source;
+	guint position;
+	gint64 queued_at;
+} LockHolder;
+
+/* Invocation -> LockHolder, both waiting and granted */
+static GHashTable *lock_holders = NULL;
+static GList *lock_granted = NULL;
+static GQueue lock_waiting = G_QUEUE_INIT;
+static guint lock_serial = 0;
+
+static void
+lock_holder_free (LockHolder *holder)
+{
+	guint i;
+
+	for (i = 0; i < holder->claims->len; i++)
+		g_free (g_array_index (holder->claims, LockClaim, i).resource);
+	g_array_free (holder->claims, TRUE);
+	if (holder->async)
+		g_object_unref (holder->async);
+	if (holder->timeout_id)
+		g_source_remove (holder->timeout_id);
+	if (holder->cancel_source) {
+		g_source_destroy (holder->cancel_source);
+		g_source_unref (holder->cancel_source);
+	}
+
+	/* Matches the hold in realm_lock_acquire_async() */
+	realm_daemon_release (holder->hold);
+	g_free (holder->hold);
+
+	g_slice_free (LockHolder, holder);
+}
+
+static gboolean
+lock_holders_conflict (LockHolder *one,
+                       LockHolder *two)
+{
+	LockClaim *a, *b;
+	guint i, j;
+
+	for (i = 0; i < one->claims->len; i++) {
+		a = &g_array_index (one->claims, LockClaim, i);
+		for (j = 0; j < two->claims->len; j++) {
+			b = &g_array_index (two->claims, LockClaim, j);
+			if ((a->mode == REALM_LOCK_EXCLUSIVE || b->mode == REALM_LOCK_EXCLUSIVE) &&
+			    g_str_equal (a->resource, b->resource))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+lock_holder_can_run (LockHolder *holder,
+                     GList *waiting_before)
+{
+	GList *l;
+
+	for (l = lock_granted; l != NULL; l = g_list_next (l)) {
+		if (lock_holders_conflict (holder, l->data))
+			return FALSE;
+	}
+
+	for (l = waiting_before; l != NULL; l = g_list_previous (l)) {
+		if (lock_holders_conflict (holder, l->data))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+lock_holder_grant (LockHolder *holder)
+{
+	GSimpleAsyncResult *async;
+
+	lock_granted = g_list_prepend (lock_granted, holder);
+	realm_metrics_observe (REALM_METRIC_LOCK_WAIT, "granted",
+	                       g_get_monotonic_time () - holder->queued_at);
+
+	if (holder->timeout_id)
+		g_source_remove (holder->timeout_id);
+	holder->timeout_id = 0;
+	if (holder->cancel_source) {
+		g_source_destroy (holder->cancel_source);
+		g_source_unref (holder->cancel_source);
+		holder->cancel_source = NULL;
+	}
+
+	async = holder->async;
+	holder->async = NULL;
+	g_simple_async_result_complete_in_idle (async);
+	g_object_unref (async);
+}
+
+static void
+lock_report_positions (void)
+{
+	LockHolder *holder;
+	guint position;
+	GList *l;
+
+	for (l = lock_waiting.head, position = 1; l != NULL; l = g_list_next (l), position++) {
+		holder = l->data;
+		if (holder->position == position)
+			continue;
+		realm_diagnostics_info (holder->invocation, holder->position == 0 ?
+		                        "Waiting for another operation to complete, at position %u in the queue" :
+		                        "Now at position %u in the queue", position);
+		holder->position = position;
+	}
+}
+
+static void
+lock_process_waiting (void)
+{
+	LockHolder *holder;
+	GList *l, *next;
+
+	for (l = lock_waiting.head; l != NULL; l = next) {
+		next = g_list_next (l);
+		holder = l->data;
+		if (lock_holder_can_run (holder, g_list_previous (l))) {
+			g_queue_delete_link (&lock_waiting, l);
+			lock_holder_grant (holder);
+		}
+	}
+
+	lock_report_positions ();
+}
+
+static void
+on_invocation_gone (gpointer data,
+                    GObject *where_the_object_was)
+{
+	LockHolder *holder = data;
+
+	g_warning ("a GDBusMethodInvocation was released but the invocation was "
+	           "registered as part of a realm_lock_acquire_async()");
+
+	g_hash_table_remove (lock_holders, where_the_object_was);
+	lock_granted = g_list_remove (lock_granted, holder);
+	g_queue_remove (&lock_waiting, holder);
+	lock_holder_free (holder);
+
+	lock_process_waiting ();
+}
+
+static void
+lock_holder_fail (LockHolder *holder,
+                  const gchar *outcome,
+                  GError *error)
+{
+	GSimpleAsyncResult *async;
+
+	realm_metrics_observe (REALM_METRIC_LOCK_WAIT, outcome,
+	                       g_get_monotonic_time () - holder->queued_at);
+
+	g_object_weak_unref (G_OBJECT (holder->invocation), on_invocation_gone, holder);
+	g_hash_table_remove (lock_holders, holder->invocation);
+	g_queue_remove (&lock_waiting, holder);
+
+	async = holder->async;
+	holder->async = NULL;
+	g_simple_async_result_take_error (async, error);
+	g_simple_async_result_complete (async);
+	g_object_unref (async);
+
+	lock_holder_free (holder);
+
+	/* Those behind us may now be able to run */
+	lock_process_waiting ();
+}
+
+static gboolean
+on_queue_timeout (gpointer user_data)
+{
+	LockHolder *holder = user_data;
+
+	holder->timeout_id = 0;
+	lock_holder_fail (holder, "timeout",
+	                  g_error_new (REALM_ERROR, REALM_ERROR_BUSY,
+	                               _("Timed out waiting for another operation to complete")));
+	return FALSE;
+}
+
+static gboolean
+on_queue_cancelled (GCancellable *cancellable,
+                    gpointer user_data)
+{
+	LockHolder *holder = user_data;
+	GError *error = NULL;
+
+	g_cancellable_set_error_if_cancelled (cancellable, &error);
+	lock_holder_fail (holder, "cancelled", error);
+	return FALSE;
+}
+
+static guint
+queue_timeout_for_options (GVariant *options)
+{
+	const gchar *value;
+	guint32 timeout;
+	gchar *end = NULL;
+
+	if (options && g_variant_lookup (options, REALM_DBUS_OPTION_QUEUE_TIMEOUT, "u", &timeout))
+		return timeout;
+
+	value = realm_settings_value ("service", "queue-timeout");
+	if (value == NULL || value[0] == '\0')
+		return DEFAULT_QUEUE_TIMEOUT;
+
+	timeout = g_ascii_strtoull (value, &end, 10);
+	if (!end || end[0] != '\0') {
+		g_warning ("Invalid queue-timeout setting: %s", value);
+		return DEFAULT_QUEUE_TIMEOUT;
+	}
+
+	return timeout;
+}
+
+void
+realm_lock_acquire_async (GDBusMethodInvocation *invocation,
+                          GVariant *options,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data,
+                          const gchar *resource,
+                          RealmLockMode mode,
+                          ...)
+{
+	GSimpleAsyncResult *async;
+	LockHolder *holder;
+	LockClaim claim;
+	guint timeout;
+	va_list va;
+	GList *l;
+
+	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
+	g_return_if_fail (resource != NULL);
+
+	if (lock_holders == NULL)
+		lock_holders = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	if (g_hash_table_lookup (lock_holders, invocation)) {
+		g_critical ("realm_lock_acquire_async: invocation already holds locks");
+		async = g_simple_async_result_new (NULL, callback, user_data,
+		                                   realm_lock_acquire_async);
+		g_simple_async_result_set_error (async, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+		                                 "Already holding locks for this action");
+		g_simple_async_result_complete_in_idle (async);
+		g_object_unref (async);
+		return;
+	}
+
+	holder = g_slice_new0 (LockHolder);
+	holder->invocation = invocation;
+	holder->queued_at = g_get_monotonic_time ();
+	holder->claims = g_array_new (FALSE, FALSE, sizeof (LockClaim));
+	holder->async = g_simple_async_result_new (NULL, callback, user_data,
+	                                           realm_lock_acquire_async);
+	if (options)
+		g_variant_lookup (options, REALM_DBUS_OPTION_QUEUE_PRIORITY, "i", &holder->priority);
+
+	va_start (va, mode);
+	while (resource != NULL) {
+		claim.resource = g_strdup (resource);
+		claim.mode = mode;
+		g_array_append_val (holder->claims, claim);
+
+		resource = va_arg (va, const gchar *);
+		if (resource != NULL)
+			mode = va_arg (va, RealmLockMode);
+	}
+	va_end (va);
+
+	/* Hold the daemon up while waiting and running */
+	holder->hold = g_strdup_printf ("lock-%u", ++lock_serial);
+	realm_daemon_hold (holder->hold);
+
+	g_hash_table_insert (lock_holders, invocation, holder);
+	g_object_weak_ref (G_OBJECT (invocation), on_invocation_gone, holder);
+
+	if (lock_holder_can_run (holder, lock_waiting.tail)) {
+		lock_holder_grant (holder);
+		return;
+	}
+
+	/* Higher priority first, otherwise in order of arrival */
+	for (l = lock_waiting.head; l != NULL; l = g_list_next (l)) {
+		if (((LockHolder *)l->data)->priority < holder->priority)
+			break;
+	}
+	if (l == NULL)
+		g_queue_push_tail (&lock_waiting, holder);
+	else
+		g_queue_insert_before (&lock_waiting, l, holder);
+
+	timeout = queue_timeout_for_options (options);
+	if (timeout > 0)
+		holder->timeout_id = g_timeout_add_seconds (timeout, on_queue_timeout, holder);
+
+	/* Give up our place in line if the caller goes away */
+	holder->cancel_source = g_cancellable_source_new (realm_invocation_get_cancellable (invocation));
+	g_source_set_callback (holder->cancel_source, (GSourceFunc)on_queue_cancelled, holder, NULL);
+	g_source_attach (holder->cancel_source, NULL);
+
+	/* Ahead of others in line, this action may be able to run right away */
+	lock_process_waiting ();
+}
+
+gboolean
+realm_lock_acquire_finish (GAsyncResult *result,
+                           GError **error)
+{
+	g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+	                      realm_lock_acquire_async), FALSE);
+
+	if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error))
+		return FALSE;
+
+	return TRUE;
+}
+
+void
+realm_lock_release (GDBusMethodInvocation *invocation)
+{
+	LockHolder *holder;
+
+	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
+
+	holder = lock_holders ? g_hash_table_lookup (lock_holders, invocation) : NULL;
+	if (holder == NULL || g_list_find (lock_granted, holder) == NULL) {
+		g_warning ("trying to realm_lock_release() with an invocation "
+		           "that doesn't hold any locks.");
+		return;
+	}
+
+	g_object_weak_unref (G_OBJECT (invocation), on_invocation_gone, holder);
+	g_hash_table_remove (lock_holders, invocation);
+	lock_granted = g_list_remove (lock_granted, holder);
+	lock_holder_free (holder);
+
+	lock_process_waiting ();
+}
@@ -0,0 +1,47 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_LOCK_H__
+#define __REALM_LOCK_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	REALM_LOCK_SHARED,
+	REALM_LOCK_EXCLUSIVE,
+} RealmLockMode;
+
+/* Machine wide state such as the keytab, packages and PAM/NSS config */
+#define REALM_LOCK_SYSTEM "system"
+
+void                 realm_lock_acquire_async                (GDBusMethodInvocation *invocation,
+                                                              GVariant *options,
+                                                              GAsyncReadyCallback callback,
+                                                              gpointer user_data,
+                                                              const gchar *resource,
+                                                              RealmLockMode mode,
+                                                              ...) G_GNUC_NULL_TERMINATED;
+
+gboolean             realm_lock_acquire_finish               (GAsyncResult *result,
+                                                              GError **error);
+
+void                 realm_lock_release                      (GDBusMethodInvocation *invocation);
+
+G_END_DECLS
+
+#endif /* __REALM_LOCK_H__ */
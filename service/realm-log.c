@@ -0,0 +1,219 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-log.h"
+
+#ifdef WITH_JOURNAL
+#include <systemd/sd-journal.h>
+#include <sys/uio.h>
+#endif
+
+#include <string.h>
+#include <syslog.h>
+
+/*
+ * Diagnostic lines are written to the journal (or syslog) by a writer
+ * thread, so that the main loop never blocks on the logging socket.
+ * Callers only queue a record. Each time the writer wakes it takes up
+ * to MAX_DRAIN records off the queue, and then writes them one by one.
+ * Neither the journal nor syslog accept several entries in one write.
+ */
+
+#define MAX_DRAIN 64
+
+typedef struct {
+	int priority;
+	gchar *message;
+	gchar *operation_id;
+	gchar *realm;
+	gchar *command;
+	gboolean *flushed;  /* set when written up to here, for a flush */
+} LogRecord;
+
+static GAsyncQueue *log_queue = NULL;
+
+/* Used by realm_log_flush() to wait for the writer */
+static GMutex log_flush_mutex;
+static GCond log_flush_cond;
+
+static void
+log_record_free (LogRecord *record)
+{
+	g_free (record->message);
+	g_free (record->operation_id);
+	g_free (record->realm);
+	g_free (record->command);
+	g_slice_free (LogRecord, record);
+}
+
+#ifdef WITH_JOURNAL
+
+static void
+add_journal_field (struct iovec *iov,
+                   gint *n_iov,
+                   const gchar *field,
+                   const gchar *value)
+{
+	iov[*n_iov].iov_base = g_strdup_printf ("%s=%s", field, value);
+	iov[*n_iov].iov_len = strlen (iov[*n_iov].iov_base);
+	(*n_iov)++;
+}
+
+static gboolean
+log_record_journal (LogRecord *record)
+{
+	struct iovec iov[8];
+	gchar priority[16];
+	gchar facility[16];
+	gint n_iov = 0;
+	gint ret;
+	gint i;
+
+	g_snprintf (priority, sizeof (priority), "%d", record->priority);
+	g_snprintf (facility, sizeof (facility), "%d", LOG_FAC (LOG_AUTH));
+
+	add_journal_field (iov, &n_iov, "MESSAGE", record->message);
+	add_journal_field (iov, &n_iov, "PRIORITY", priority);
+	add_journal_field (iov, &n_iov, "SYSLOG_FACILITY", facility);
+	add_journal_field (iov, &n_iov, "SYSLOG_IDENTIFIER", "realmd");
+	/* Unlike the message, which may be a blank line, these are optional */
+	if (record->operation_id && record->operation_id[0])
+		add_journal_field (iov, &n_iov, "OPERATION_ID", record->operation_id);
+	if (record->realm && record->realm[0])
+		add_journal_field (iov, &n_iov, "REALM", record->realm);
+	if (record->command && record->command[0])
+		add_journal_field (iov, &n_iov, "COMMAND", record->command);
+
+	ret = sd_journal_sendv (iov, n_iov);
+
+	for (i = 0; i < n_iov; i++)
+		g_free (iov[i].iov_base);
+
+	return ret >= 0;
+}
+
+#endif /* WITH_JOURNAL */
+
+static void
+log_record_write (LogRecord *record)
+{
+	static gboolean syslog_initialized = FALSE;
+
+#ifdef WITH_JOURNAL
+	if (log_record_journal (record))
+		goto out;
+#endif
+
+	if (!syslog_initialized) {
+		openlog ("realmd", 0, LOG_AUTH);
+		syslog_initialized = TRUE;
+	}
+
+	syslog (record->priority, "%s", record->message);
+
+#ifdef WITH_JOURNAL
+out:
+#endif
+	g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s", record->message);
+}
+
+static gpointer
+log_thread_func (gpointer unused)
+{
+	LogRecord *batch[MAX_DRAIN];
+	guint n, i;
+
+	for (;;) {
+		batch[0] = g_async_queue_pop (log_queue);
+		for (n = 1; n < MAX_DRAIN; n++) {
+			batch[n] = g_async_queue_try_pop (log_queue);
+			if (batch[n] == NULL)
+				break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (batch[i]->flushed) {
+				/* Everything queued before the flush has been written */
+				g_mutex_lock (&log_flush_mutex);
+				*(batch[i]->flushed) = TRUE;
+				g_cond_broadcast (&log_flush_cond);
+				g_mutex_unlock (&log_flush_mutex);
+			} else {
+				log_record_write (batch[i]);
+			}
+			log_record_free (batch[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static GAsyncQueue *
+log_queue_get (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		log_queue = g_async_queue_new ();
+		g_thread_unref (g_thread_new ("realm-log", log_thread_func, NULL));
+		g_once_init_leave (&initialized, 1);
+	}
+
+	return log_queue;
+}
+
+/*
+ * Queue one line to be logged. The @message should not contain a
+ * newline. The other fields may be NULL.
+ */
+void
+realm_log_write (int priority,
+                 const gchar *operation_id,
+                 const gchar *realm,
+                 const gchar *command,
+                 const gchar *message)
+{
+	LogRecord *record;
+
+	g_return_if_fail (message != NULL);
+
+	record = g_slice_new0 (LogRecord);
+	record->priority = priority;
+	record->message = g_strdup (message);
+	record->operation_id = g_strdup (operation_id);
+	record->realm = g_strdup (realm);
+	record->command = g_strdup (command);
+
+	g_async_queue_push (log_queue_get (), record);
+}
+
+/* Blocks until everything queued so far has been written */
+void
+realm_log_flush (void)
+{
+	gboolean flushed = FALSE;
+	LogRecord *record;
+
+	/* Each flush waits for its own record, however many run at once */
+	record = g_slice_new0 (LogRecord);
+	record->flushed = &flushed;
+	g_async_queue_push (log_queue_get (), record);
+
+	g_mutex_lock (&log_flush_mutex);
+	while (!flushed)
+		g_cond_wait (&log_flush_cond, &log_flush_mutex);
+	g_mutex_unlock (&log_flush_mutex);
+}
@@ -0,0 +1,34 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_LOG_H__
+#define __REALM_LOG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void          realm_log_write                         (int priority,
+                                                       const gchar *operation_id,
+                                                       const gchar *realm,
+                                                       const gchar *command,
+                                                       const gchar *message);
+
+void          realm_log_flush                         (void);
+
+G_END_DECLS
+
+#endif /* __REALM_LOG_H__ */
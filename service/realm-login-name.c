@@ -18,6 +18,18 @@
 
 #include <string.h>
 
+typedef struct {
+	gchar *prefix;
+	gsize prefix_len;
+	gchar *suffix;
+	gsize suffix_len;
+} LoginPattern;
+
+struct _RealmLoginMatcher {
+	LoginPattern *patterns;
+	guint n_patterns;
+};
+
 static gboolean
 split_login_format (const gchar *format,
                     const gchar **prefix,
@@ -46,39 +58,106 @@ split_login_format (const gchar *format,
 	return TRUE;
 }
 
-gchar *
-realm_login_name_parse (const gchar *const *formats,
-                        gboolean lower,
-                        const gchar *login)
+static gchar *
+expand_domain (const gchar *format,
+               const gchar *domain)
 {
+	GString *string;
+	const gchar *pos;
+
+	if (strstr (format, "%D") == NULL)
+		return g_strdup (format);
+	if (domain == NULL)
+		return NULL;
+
+	string = g_string_sized_new (64);
+	while ((pos = strstr (format, "%D")) != NULL) {
+		g_string_append_len (string, format, pos - format);
+		g_string_append (string, domain);
+		format = pos + 2;
+	}
+	g_string_append (string, format);
+	return g_string_free (string, FALSE);
+}
+
+RealmLoginMatcher *
+realm_login_matcher_new (const gchar *const *formats,
+                         const gchar *domain)
+{
+	RealmLoginMatcher *matcher;
 	const gchar *prefix, *suffix;
 	gsize prefix_len, suffix_len;
-	gchar length;
-	const gchar *user;
-	gsize user_len;
-	gint i;
+	LoginPattern *pattern;
+	gchar *format;
+	guint i;
 
 	g_return_val_if_fail (formats != NULL, NULL);
-	g_return_val_if_fail (login != NULL, NULL);
 
-	for (i = 0; formats[i]; i++) {
-		if (strstr (formats[i], "%D") != NULL) {
-			g_warning ("Using a %%D as a domain in a login format is not yet implemented");
+	matcher = g_new0 (RealmLoginMatcher, 1);
+	matcher->patterns = g_new0 (LoginPattern, g_strv_length ((gchar **)formats));
+
+	for (i = 0; formats[i] != NULL; i++) {
+		format = expand_domain (formats[i], domain);
+		if (format == NULL) {
+			g_warning ("No domain is known for the %%D in login format: %s", formats[i]);
 			continue;
 		}
 
-		split_login_format (formats[i], &prefix, &prefix_len, &suffix, &suffix_len);
-		length = strlen (login);
+		if (split_login_format (format, &prefix, &prefix_len, &suffix, &suffix_len)) {
+			pattern = matcher->patterns + matcher->n_patterns++;
+			pattern->prefix = g_strndup (prefix, prefix_len);
+			pattern->prefix_len = prefix_len;
+			pattern->suffix = g_strndup (suffix, suffix_len);
+			pattern->suffix_len = suffix_len;
+		}
+
+		g_free (format);
+	}
+
+	return matcher;
+}
+
+void
+realm_login_matcher_free (RealmLoginMatcher *matcher)
+{
+	guint i;
+
+	if (matcher == NULL)
+		return;
+
+	for (i = 0; i < matcher->n_patterns; i++) {
+		g_free (matcher->patterns[i].prefix);
+		g_free (matcher->patterns[i].suffix);
+	}
+
+	g_free (matcher->patterns);
+	g_free (matcher);
+}
 
-		if (prefix_len + suffix_len >= length)
+static gchar *
+matcher_parse_len (RealmLoginMatcher *matcher,
+                   gboolean lower,
+                   const gchar *login,
+                   gsize length)
+{
+	LoginPattern *pattern;
+	const gchar *user;
+	gsize user_len;
+	guint i;
+
+	for (i = 0; i < matcher->n_patterns; i++) {
+		pattern = matcher->patterns + i;
+
+		if (pattern->prefix_len + pattern->suffix_len >= length)
 			continue;
-		if (g_ascii_strncasecmp (login, prefix, prefix_len) != 0)
+		if (g_ascii_strncasecmp (login, pattern->prefix, pattern->prefix_len) != 0)
 			continue;
-		if (g_ascii_strncasecmp (login + (length - suffix_len), suffix, suffix_len) != 0)
+		if (g_ascii_strncasecmp (login + (length - pattern->suffix_len),
+		                         pattern->suffix, pattern->suffix_len) != 0)
 			continue;
 
-		user = login + prefix_len;
-		user_len = length - (suffix_len + prefix_len);
+		user = login + pattern->prefix_len;
+		user_len = length - (pattern->suffix_len + pattern->prefix_len);
 
 		if (lower)
 			return g_utf8_strdown (user, user_len);
@@ -89,32 +168,100 @@ realm_login_name_parse (const gchar *const *formats,
 	return NULL;
 }
 
+gchar *
+realm_login_matcher_parse (RealmLoginMatcher *matcher,
+                           gboolean lower,
+                           const gchar *login)
+{
+	g_return_val_if_fail (matcher != NULL, NULL);
+	g_return_val_if_fail (login != NULL, NULL);
+
+	return matcher_parse_len (matcher, lower, login, strlen (login));
+}
+
 gchar **
-realm_login_name_parse_all (const gchar *const *formats,
-                            gboolean lower,
-                            const gchar **logins,
-                            const gchar **failed)
+realm_login_matcher_parse_all (RealmLoginMatcher *matcher,
+                               gboolean lower,
+                               const gchar **logins,
+                               const gchar **failed)
 {
-	GPtrArray *names;
-	gchar *login;
-	gint i;
+	gchar **names;
+	guint length;
+	guint i;
+
+	g_return_val_if_fail (matcher != NULL, NULL);
 
-	names = g_ptr_array_new_full (0, g_free);
+	length = logins ? g_strv_length ((gchar **)logins) : 0;
+	names = g_new0 (gchar *, length + 1);
 
-	for (i = 0; logins != NULL && logins[i] != NULL; i++) {
-		login = realm_login_name_parse (formats, lower, logins[i]);
-		if (login == NULL) {
+	for (i = 0; i < length; i++) {
+		names[i] = matcher_parse_len (matcher, lower, logins[i], strlen (logins[i]));
+		if (names[i] == NULL) {
 			if (failed)
 				*failed = logins[i];
-			g_ptr_array_free (names, TRUE);
+			g_strfreev (names);
 			return NULL;
 		}
-
-		g_ptr_array_add (names, login);
 	}
 
-	g_ptr_array_add (names, NULL);
-	return (gchar **)g_ptr_array_free (names, FALSE);
+	return names;
+}
+
+gchar *
+realm_login_matcher_format (RealmLoginMatcher *matcher,
+                            const gchar *user)
+{
+	LoginPattern *pattern;
+	GString *string;
+
+	g_return_val_if_fail (matcher != NULL, NULL);
+	g_return_val_if_fail (user != NULL, NULL);
+
+	if (matcher->n_patterns == 0)
+		return NULL;
+
+	pattern = matcher->patterns;
+	string = g_string_sized_new (pattern->prefix_len + strlen (user) + pattern->suffix_len);
+	g_string_append_len (string, pattern->prefix, pattern->prefix_len);
+	g_string_append (string, user);
+	g_string_append_len (string, pattern->suffix, pattern->suffix_len);
+	return g_string_free (string, FALSE);
+}
+
+gchar *
+realm_login_name_parse (const gchar *const *formats,
+                        gboolean lower,
+                        const gchar *login)
+{
+	RealmLoginMatcher *matcher;
+	gchar *user;
+
+	g_return_val_if_fail (formats != NULL, NULL);
+	g_return_val_if_fail (login != NULL, NULL);
+
+	matcher = realm_login_matcher_new (formats, NULL);
+	user = realm_login_matcher_parse (matcher, lower, login);
+	realm_login_matcher_free (matcher);
+
+	return user;
+}
+
+gchar **
+realm_login_name_parse_all (const gchar *const *formats,
+                            gboolean lower,
+                            const gchar **logins,
+                            const gchar **failed)
+{
+	RealmLoginMatcher *matcher;
+	gchar **names;
+
+	g_return_val_if_fail (formats != NULL, NULL);
+
+	matcher = realm_login_matcher_new (formats, NULL);
+	names = realm_login_matcher_parse_all (matcher, lower, logins, failed);
+	realm_login_matcher_free (matcher);
+
+	return names;
 }
 
 gchar *
@@ -21,6 +21,25 @@
 
 G_BEGIN_DECLS
 
+typedef struct _RealmLoginMatcher RealmLoginMatcher;
+
+RealmLoginMatcher *  realm_login_matcher_new        (const gchar *const *formats,
+                                                     const gchar *domain);
+
+void                 realm_login_matcher_free       (RealmLoginMatcher *matcher);
+
+gchar *              realm_login_matcher_parse      (RealmLoginMatcher *matcher,
+                                                     gboolean lower,
+                                                     const gchar *login);
+
+gchar **             realm_login_matcher_parse_all  (RealmLoginMatcher *matcher,
+                                                     gboolean lower,
+                                                     const gchar **logins,
+                                                     const gchar **failed);
+
+gchar *              realm_login_matcher_format     (RealmLoginMatcher *matcher,
+                                                     const gchar *user);
+
 gchar *        realm_login_name_parse     (const gchar *const *formats,
                                            gboolean lower,
                                            const gchar *login);
@@ -0,0 +1,335 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-metrics.h"
+
+#include <string.h>
+
+/*
+ * Counters, gauges and latency histograms, each split up by a single
+ * label such as the provider or command name. These are updated from
+ * the main thread as well as dbus and worker threads.
+ */
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct {
+	const gchar *name;
+	MetricType type;
+	const gchar *label;
+	const gchar *help;
+} MetricInfo;
+
+static const MetricInfo metric_info[REALM_METRIC_COUNT] = {
+	{ "realmd_discover_total", METRIC_COUNTER, "provider",
+	  "Discover calls handled by each provider" },
+	{ "realmd_srv_lookups_total", METRIC_COUNTER, "outcome",
+	  "Kerberos SRV record lookups" },
+	{ "realmd_ipa_probes_total", METRIC_COUNTER, "outcome",
+	  "Probes for an IPA certificate" },
+	{ "realmd_command_duration_seconds", METRIC_HISTOGRAM, "command",
+	  "Time taken by each subprocess" },
+	{ "realmd_lock_wait_seconds", METRIC_HISTOGRAM, "outcome",
+	  "Time operations spent waiting for their locks" },
+	{ "realmd_config_reload_seconds", METRIC_HISTOGRAM, "file",
+	  "Time taken to reload config files" },
+	{ "realmd_cache_hits_total", METRIC_COUNTER, "cache",
+	  "Lookups that were answered from a cache" },
+	{ "realmd_cache_misses_total", METRIC_COUNTER, "cache",
+	  "Lookups that were not found in a cache" },
+	{ "realmd_worker_jobs", METRIC_GAUGE, "state",
+	  "State of the pool that runs blocking work" },
+	{ "realmd_worker_jobs_total", METRIC_COUNTER, "outcome",
+	  "Jobs finished by the pool that runs blocking work" },
+};
+
+/* Upper bounds of the histogram buckets, in seconds */
+static const gdouble metric_buckets[] = {
+	0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0, 10.0, 30.0, 60.0, 300.0
+};
+
+#define N_BUCKETS G_N_ELEMENTS (metric_buckets)
+
+typedef struct {
+	guint64 value;
+	gdouble sum;
+	guint64 buckets[N_BUCKETS];
+} MetricValue;
+
+/* Label -> MetricValue for each metric */
+G_LOCK_DEFINE_STATIC (metrics);
+static GHashTable *metric_values[REALM_METRIC_COUNT] = { NULL, };
+
+static void
+metric_value_free (gpointer data)
+{
+	g_slice_free (MetricValue, data);
+}
+
+static MetricValue *
+lookup_metric_value (RealmMetric metric,
+                     const gchar *label)
+{
+	MetricValue *value;
+
+	if (label == NULL)
+		label = "";
+
+	if (metric_values[metric] == NULL) {
+		metric_values[metric] = g_hash_table_new_full (g_str_hash, g_str_equal,
+		                                               g_free, metric_value_free);
+	}
+
+	value = g_hash_table_lookup (metric_values[metric], label);
+	if (value == NULL) {
+		value = g_slice_new0 (MetricValue);
+		g_hash_table_insert (metric_values[metric], g_strdup (label), value);
+	}
+
+	return value;
+}
+
+void
+realm_metrics_increment (RealmMetric metric,
+                         const gchar *label)
+{
+	g_return_if_fail (metric < REALM_METRIC_COUNT);
+	g_return_if_fail (metric_info[metric].type == METRIC_COUNTER);
+
+	G_LOCK (metrics);
+	lookup_metric_value (metric, label)->value++;
+	G_UNLOCK (metrics);
+}
+
+void
+realm_metrics_observe (RealmMetric metric,
+                       const gchar *label,
+                       gint64 usec)
+{
+	MetricValue *value;
+	gdouble seconds;
+	guint i;
+
+	g_return_if_fail (metric < REALM_METRIC_COUNT);
+	g_return_if_fail (metric_info[metric].type == METRIC_HISTOGRAM);
+
+	seconds = (gdouble)MAX (usec, 0) / G_USEC_PER_SEC;
+
+	G_LOCK (metrics);
+	value = lookup_metric_value (metric, label);
+	value->value++;
+	value->sum += seconds;
+	for (i = 0; i < N_BUCKETS; i++) {
+		if (seconds <= metric_buckets[i]) {
+			value->buckets[i]++;
+			break;
+		}
+	}
+	G_UNLOCK (metrics);
+}
+
+void
+realm_metrics_set (RealmMetric metric,
+                   const gchar *label,
+                   guint64 value)
+{
+	g_return_if_fail (metric < REALM_METRIC_COUNT);
+	g_return_if_fail (metric_info[metric].type == METRIC_GAUGE);
+
+	G_LOCK (metrics);
+	lookup_metric_value (metric, label)->value = value;
+	G_UNLOCK (metrics);
+}
+
+const gdouble *
+realm_metrics_get_buckets (guint *n_buckets)
+{
+	g_return_val_if_fail (n_buckets != NULL, NULL);
+	*n_buckets = N_BUCKETS;
+	return metric_buckets;
+}
+
+/* Called with the lock held, so that output is in a stable order */
+static GList *
+sorted_labels (RealmMetric metric)
+{
+	if (metric_values[metric] == NULL)
+		return NULL;
+	return g_list_sort (g_hash_table_get_keys (metric_values[metric]),
+	                    (GCompareFunc)strcmp);
+}
+
+static GVariant *
+histogram_to_variant (MetricValue *value)
+{
+	GVariantBuilder buckets;
+	guint64 count = 0;
+	guint i;
+
+	g_variant_builder_init (&buckets, G_VARIANT_TYPE ("at"));
+	for (i = 0; i < N_BUCKETS; i++) {
+		count += value->buckets[i];
+		g_variant_builder_add (&buckets, "t", count);
+	}
+
+	return g_variant_new ("(tdat)", value->value, value->sum, &buckets);
+}
+
+GVariant *
+realm_metrics_to_variant (void)
+{
+	GVariantBuilder builder;
+	MetricValue *value;
+	GVariant *variant;
+	GList *labels, *l;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssv)"));
+
+	G_LOCK (metrics);
+	for (i = 0; i < REALM_METRIC_COUNT; i++) {
+		labels = sorted_labels (i);
+		for (l = labels; l != NULL; l = g_list_next (l)) {
+			value = g_hash_table_lookup (metric_values[i], l->data);
+			if (metric_info[i].type == METRIC_HISTOGRAM)
+				variant = histogram_to_variant (value);
+			else
+				variant = g_variant_new_uint64 (value->value);
+			g_variant_builder_add (&builder, "(ssv)", metric_info[i].name,
+			                       (const gchar *)l->data, variant);
+		}
+		g_list_free (labels);
+	}
+	G_UNLOCK (metrics);
+
+	return g_variant_builder_end (&builder);
+}
+
+static void
+append_label (GString *string,
+              const gchar *name,
+              const gchar *value)
+{
+	const gchar *at;
+
+	g_string_append_printf (string, "%s=\"", name);
+	for (at = value; *at != '\0'; at++) {
+		if (*at == '\\')
+			g_string_append (string, "\\\\");
+		else if (*at == '"')
+			g_string_append (string, "\\\"");
+		else if (*at == '\n')
+			g_string_append (string, "\\n");
+		else
+			g_string_append_c (string, *at);
+	}
+	g_string_append_c (string, '"');
+}
+
+static void
+append_double (GString *string,
+               gdouble value)
+{
+	gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+	g_string_append (string, g_ascii_formatd (buffer, sizeof (buffer), "%g", value));
+}
+
+static void
+append_histogram (GString *string,
+                  const MetricInfo *info,
+                  const gchar *label,
+                  MetricValue *value)
+{
+	guint64 count = 0;
+	guint i;
+
+	for (i = 0; i < N_BUCKETS; i++) {
+		count += value->buckets[i];
+		g_string_append_printf (string, "%s_bucket{", info->name);
+		append_label (string, info->label, label);
+		g_string_append (string, ",le=\"");
+		append_double (string, metric_buckets[i]);
+		g_string_append_printf (string, "\"} %" G_GUINT64_FORMAT "\n", count);
+	}
+
+	g_string_append_printf (string, "%s_bucket{", info->name);
+	append_label (string, info->label, label);
+	g_string_append_printf (string, ",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", value->value);
+
+	g_string_append_printf (string, "%s_sum{", info->name);
+	append_label (string, info->label, label);
+	g_string_append (string, "} ");
+	append_double (string, value->sum);
+	g_string_append_c (string, '\n');
+
+	g_string_append_printf (string, "%s_count{", info->name);
+	append_label (string, info->label, label);
+	g_string_append_printf (string, "} %" G_GUINT64_FORMAT "\n", value->value);
+}
+
+gchar *
+realm_metrics_to_prometheus (void)
+{
+	static const gchar *type_names[] = { "counter", "gauge", "histogram" };
+	const MetricInfo *info;
+	MetricValue *value;
+	GList *labels, *l;
+	GString *string;
+	guint i;
+
+	string = g_string_new ("");
+
+	G_LOCK (metrics);
+	for (i = 0; i < REALM_METRIC_COUNT; i++) {
+		info = metric_info + i;
+		g_string_append_printf (string, "# HELP %s %s\n", info->name, info->help);
+		g_string_append_printf (string, "# TYPE %s %s\n", info->name, type_names[info->type]);
+
+		labels = sorted_labels (i);
+		for (l = labels; l != NULL; l = g_list_next (l)) {
+			value = g_hash_table_lookup (metric_values[i], l->data);
+			if (info->type == METRIC_HISTOGRAM) {
+				append_histogram (string, info, l->data, value);
+			} else {
+				g_string_append_printf (string, "%s{", info->name);
+				append_label (string, info->label, l->data);
+				g_string_append_printf (string, "} %" G_GUINT64_FORMAT "\n", value->value);
+			}
+		}
+		g_list_free (labels);
+	}
+	G_UNLOCK (metrics);
+
+	return g_string_free (string, FALSE);
+}
+
+void
+realm_metrics_reset (void)
+{
+	guint i;
+
+	G_LOCK (metrics);
+	for (i = 0; i < REALM_METRIC_COUNT; i++) {
+		if (metric_values[i])
+			g_hash_table_destroy (metric_values[i]);
+		metric_values[i] = NULL;
+	}
+	G_UNLOCK (metrics);
+}
@@ -0,0 +1,59 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_METRICS_H__
+#define __REALM_METRICS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	REALM_METRIC_DISCOVER,        /* counter, by provider */
+	REALM_METRIC_SRV_LOOKUP,      /* counter, by outcome */
+	REALM_METRIC_IPA_PROBE,       /* counter, by outcome */
+	REALM_METRIC_COMMAND,         /* histogram, by command */
+	REALM_METRIC_LOCK_WAIT,       /* histogram, by outcome */
+	REALM_METRIC_CONFIG_RELOAD,   /* histogram, by file */
+	REALM_METRIC_CACHE_HIT,       /* counter, by cache */
+	REALM_METRIC_CACHE_MISS,      /* counter, by cache */
+	REALM_METRIC_WORKER,          /* gauge, by state */
+	REALM_METRIC_WORKER_JOBS,     /* counter, by outcome */
+	REALM_METRIC_COUNT
+} RealmMetric;
+
+void                 realm_metrics_increment                 (RealmMetric metric,
+                                                              const gchar *label);
+
+void                 realm_metrics_observe                   (RealmMetric metric,
+                                                              const gchar *label,
+                                                              gint64 usec);
+
+void                 realm_metrics_set                       (RealmMetric metric,
+                                                              const gchar *label,
+                                                              guint64 value);
+
+const gdouble *      realm_metrics_get_buckets               (guint *n_buckets);
+
+GVariant *           realm_metrics_to_variant                (void);
+
+gchar *              realm_metrics_to_prometheus             (void);
+
+void                 realm_metrics_reset                     (void);
+
+G_END_DECLS
+
+#endif /* __REALM_METRICS_H__ */
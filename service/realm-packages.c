@@ -16,8 +16,10 @@
 
 #include "realm-diagnostics.h"
 #include "realm-daemon.h"
+#include "realm-invocation.h"
 #include "realm-packages.h"
 #include "realm-settings.h"
+#include "realm-trace.h"
 
 #define I_KNOW_THE_PACKAGEKIT_GLIB2_API_IS_SUBJECT_TO_CHANGE
 #include <packagekit-glib2/packagekit.h>
@@ -25,6 +27,8 @@
 typedef struct {
 	PkTask *task;
 	GDBusMethodInvocation *invocation;
+	GCancellable *cancellable;
+	RealmTraceSpan *span;
 } InstallClosure;
 
 static void
@@ -33,6 +37,8 @@ install_closure_free (gpointer data)
 	InstallClosure *install = data;
 	g_object_ref (install->task);
 	g_clear_object (&install->invocation);
+	g_clear_object (&install->cancellable);
+	realm_trace_end (install->span);
 	g_slice_free (InstallClosure, install);
 }
 
@@ -172,7 +178,7 @@ on_install_resolved (GObject *source,
 
 		} else {
 			realm_diagnostics_info (install->invocation, "Installing: %s", desc);
-			pk_task_install_packages_async (install->task, package_ids, NULL,
+			pk_task_install_packages_async (install->task, package_ids, install->cancellable,
 			                                on_install_progress, install,
 			                                on_install_installed, g_object_ref (res));
 		}
@@ -262,6 +268,10 @@ realm_packages_install_async (const gchar **package_sets,
 	pk_task_set_interactive (install->task, FALSE);
 	pk_client_set_background (PK_CLIENT (install->task), FALSE);
 	install->invocation = invocation ? g_object_ref (invocation) : NULL;
+	install->cancellable = invocation ? g_object_ref (realm_invocation_get_cancellable (invocation)) : NULL;
+	string = g_strjoinv (", ", (gchar **)package_sets);
+	install->span = realm_trace_begin (invocation, "packages", "%s", string);
+	g_free (string);
 	g_simple_async_result_set_op_res_gpointer (res, install, install_closure_free);
 
 	if (unconditional) {
@@ -284,7 +294,7 @@ realm_packages_install_async (const gchar **package_sets,
 	} else {
 		pk_task_resolve_async (install->task,
 		                       pk_filter_bitfield_from_string ("arch"),
-		                       packages, NULL,
+		                       packages, install->cancellable,
 		                       on_install_progress, install,
 		                       on_install_resolved, g_object_ref (res));
 	}
@@ -297,10 +307,16 @@ gboolean
 realm_packages_install_finish (GAsyncResult *result,
                                GError **error)
 {
+	InstallClosure *install;
+
 	g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
 	                      realm_packages_install_async), FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
+	install = g_simple_async_result_get_op_res_gpointer (G_SIMPLE_ASYNC_RESULT (result));
+	realm_trace_end (install->span);
+	install->span = NULL;
+
 	if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error))
 		return FALSE;
 
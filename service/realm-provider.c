@@ -21,6 +21,7 @@
 #include "realm-discovery.h"
 #include "realm-errors.h"
 #include "realm-kerberos.h"
+#include "realm-metrics.h"
 #include "realm-provider.h"
 #include "realm-settings.h"
 
@@ -116,7 +117,6 @@ realm_provider_authorize_method (GDBusObjectSkeleton *skeleton,
 	const gchar *interface = g_dbus_method_invocation_get_interface_name (invocation);
 	const gchar *method = g_dbus_method_invocation_get_method_name (invocation);
 	const gchar *action_id = NULL;
-	gboolean ret = FALSE;
 
 	/* Each method has its own polkit authorization */
 	if (g_str_equal (interface, REALM_DBUS_PROVIDER_INTERFACE)) {
@@ -127,22 +127,18 @@ realm_provider_authorize_method (GDBusObjectSkeleton *skeleton,
 			           interface, method);
 			action_id = NULL;
 		}
-
-		if (action_id != NULL)
-			ret = realm_daemon_check_dbus_action (g_dbus_method_invocation_get_sender (invocation),
-			                                       action_id);
-		else
-			ret = FALSE;
 	}
 
-	if (ret == FALSE) {
+	if (action_id == NULL) {
 		g_debug ("rejecting access to: %s.%s method on %s",
 		             interface, method, g_dbus_method_invocation_get_object_path (invocation));
 		g_dbus_method_invocation_return_dbus_error (invocation, REALM_DBUS_ERROR_NOT_AUTHORIZED,
 		                                            _("Not authorized to perform this action"));
+		return FALSE;
 	}
 
-	return ret;
+	/* Either authorized now, or rejected or dispatched later */
+	return realm_daemon_authorize_method (iface, invocation, action_id);
 }
 
 static void
@@ -310,6 +306,9 @@ realm_provider_discover (RealmProvider *self,
 	klass = REALM_PROVIDER_GET_CLASS (self);
 	g_return_if_fail (klass->discover_async != NULL);
 
+	realm_metrics_increment (REALM_METRIC_DISCOVER,
+	                         realm_dbus_provider_get_name (self->pv->provider_iface));
+
 	(klass->discover_async) (self, string, options, invocation, callback, user_data);
 }
 
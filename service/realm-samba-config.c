@@ -28,24 +28,20 @@ realm_samba_config_new_with_flags (RealmIniFlags flags,
 	const gchar *filename;
 	GError *err = NULL;
 
-	config = realm_ini_config_new (REALM_INI_LINE_CONTINUATIONS | flags);
-
 	filename = realm_settings_path ("smb.conf");
-
-	realm_ini_config_read_file (config, filename, &err);
+	config = realm_ini_config_new_shared (filename, REALM_INI_LINE_CONTINUATIONS | flags, &err);
 
 	if (err != NULL) {
-		/* If the caller wants errors, then don't return an invalid samba config */
+		/* If the caller wants errors, then don't return an invalid config */
 		if (error) {
 			g_propagate_error (error, err);
-			g_object_unref (config);
-			config = NULL;
 
 		/* If the caller doesn't care, then warn but continue */
 		} else {
 			g_warning ("Couldn't load config file: %s: %s", filename,
 			           err->message);
 			g_error_free (err);
+			config = realm_ini_config_new (REALM_INI_LINE_CONTINUATIONS | flags);
 		}
 	}
 
@@ -22,6 +22,7 @@
 #include "realm-samba-winbind.h"
 #include "realm-settings.h"
 #include "realm-service.h"
+#include "realm-trace.h"
 
 #include <glib/gstdio.h>
 
@@ -76,6 +77,7 @@ realm_samba_winbind_configure_async (RealmIniConfig *config,
                                      gpointer user_data)
 {
 	GSimpleAsyncResult *res;
+	RealmTraceSpan *span;
 	GError *error = NULL;
 
 	g_return_if_fail (config != NULL);
@@ -89,6 +91,7 @@ realm_samba_winbind_configure_async (RealmIniConfig *config,
 
 	/* TODO: need to use autorid mapping */
 
+	span = realm_trace_begin (invocation, "config", "smb.conf");
 	realm_ini_config_change (config, REALM_SAMBA_CONFIG_GLOBAL, &error,
 	                         "idmap uid", "10000-20000",
 	                         "idmap gid", "10000-20000",
@@ -98,6 +101,7 @@ realm_samba_winbind_configure_async (RealmIniConfig *config,
 	                         "winbind offline logon", "yes",
 	                         "winbind refresh tickets", "yes",
 	                         NULL);
+	realm_trace_end (span);
 
 	if (error == NULL) {
 		realm_service_enable_and_restart ("winbind", invocation,
@@ -28,6 +28,7 @@
 #include "realm-samba-config.h"
 #include "realm-samba-enroll.h"
 #include "realm-samba-winbind.h"
+#include "realm-trace.h"
 
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
@@ -38,7 +39,8 @@
 struct _RealmSamba {
 	RealmKerberos parent;
 	RealmIniConfig *config;
-	gulong config_sig;
+	gulong section_sig;
+	gulong key_sig;
 };
 
 typedef struct {
@@ -189,6 +191,7 @@ on_join_do_winbind (GObject *source,
 	GHashTable *settings = NULL;
 	GError *error = NULL;
 	const gchar *workgroup = NULL;
+	RealmTraceSpan *span;
 
 	realm_samba_enroll_join_finish (result, &settings, &error);
 	if (error == NULL) {
@@ -200,11 +203,13 @@ on_join_do_winbind (GObject *source,
 	}
 
 	if (error == NULL) {
+		span = realm_trace_begin (enroll->invocation, "config", "smb.conf");
 		realm_ini_config_change (self->config, REALM_SAMBA_CONFIG_GLOBAL, &error,
 		                         "security", "ads",
 		                         "realm", enroll->realm_name,
 		                         "workgroup", workgroup,
 		                         NULL);
+		realm_trace_end (span);
 	}
 
 	if (error == NULL) {
@@ -352,15 +357,18 @@ on_leave_do_winbind (GObject *source,
 	UnenrollClosure *unenroll = g_simple_async_result_get_op_res_gpointer (res);
 	RealmSamba *self = REALM_SAMBA (g_async_result_get_source_object (user_data));
 	GError *error = NULL;
+	RealmTraceSpan *span;
 
 	/* We don't care if we can leave or not, just continue with other steps */
 	realm_samba_enroll_leave_finish (result, NULL);
 
+	span = realm_trace_begin (unenroll->invocation, "config", "smb.conf");
 	realm_ini_config_change (self->config, REALM_SAMBA_CONFIG_GLOBAL, &error,
 	                         "workgroup", NULL,
 	                         "realm", NULL,
 	                         "security", "user",
 	                         NULL);
+	realm_trace_end (span);
 
 	if (error == NULL) {
 		realm_samba_winbind_deconfigure_async (self->config,
@@ -543,10 +551,27 @@ update_properties (RealmSamba *self)
 }
 
 static void
-on_config_changed (RealmIniConfig *config,
-                   gpointer user_data)
+on_config_section_changed (RealmIniConfig *config,
+                           const gchar *section,
+                           gpointer user_data)
 {
-	update_properties (REALM_SAMBA (user_data));
+	if (g_ascii_strcasecmp (section, REALM_SAMBA_CONFIG_GLOBAL) == 0)
+		update_properties (REALM_SAMBA (user_data));
+}
+
+static void
+on_config_key_changed (RealmIniConfig *config,
+                       const gchar *section,
+                       const gchar *name,
+                       gpointer user_data)
+{
+	/* Only these settings are reflected in our properties */
+	if (g_ascii_strcasecmp (section, REALM_SAMBA_CONFIG_GLOBAL) == 0 &&
+	    (g_ascii_strcasecmp (name, "security") == 0 ||
+	     g_ascii_strcasecmp (name, "realm") == 0 ||
+	     g_ascii_strcasecmp (name, "workgroup") == 0 ||
+	     g_ascii_strcasecmp (name, "winbind separator") == 0))
+		update_properties (REALM_SAMBA (user_data));
 }
 
 static gboolean
@@ -586,9 +611,12 @@ realm_samba_set_property (GObject *obj,
 	case PROP_PROVIDER:
 		provider = g_value_get_object (value);
 		g_object_get (provider, "samba-config", &self->config, NULL);
-		self->config_sig = g_signal_connect (self->config, "changed",
-		                                     G_CALLBACK (on_config_changed),
-		                                     self);
+		self->section_sig = g_signal_connect (self->config, "section-changed",
+		                                      G_CALLBACK (on_config_section_changed),
+		                                      self);
+		self->key_sig = g_signal_connect (self->config, "key-changed",
+		                                  G_CALLBACK (on_config_key_changed),
+		                                  self);
 		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
@@ -612,8 +640,11 @@ realm_samba_finalize (GObject *obj)
 {
 	RealmSamba  *self = REALM_SAMBA (obj);
 
-	if (self->config)
+	if (self->config) {
+		g_signal_handler_disconnect (self->config, self->section_sig);
+		g_signal_handler_disconnect (self->config, self->key_sig);
 		g_object_unref (self->config);
+	}
 
 	G_OBJECT_CLASS (realm_samba_parent_class)->finalize (obj);
 }
@@ -26,6 +26,7 @@
 #include "realm-sssd.h"
 #include "realm-sssd-ad.h"
 #include "realm-sssd-config.h"
+#include "realm-trace.h"
 
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
@@ -236,10 +237,10 @@ on_join_do_sssd (GObject *source,
 	JoinClosure *join = g_simple_async_result_get_op_res_gpointer (async);
 	RealmSssd *sssd = REALM_SSSD (g_async_result_get_source_object (user_data));
 	GHashTable *settings = NULL;
+	RealmTraceSpan *span;
 	GError *error = NULL;
 	gchar *workgroup = NULL;
 
-
 	if (join->use_adcli) {
 		if (!realm_adcli_enroll_join_finish (result, &workgroup, &error)) {
 			workgroup = NULL;
@@ -263,8 +264,10 @@ on_join_do_sssd (GObject *source,
 	}
 
 	if (error == NULL) {
+		span = realm_trace_begin (join->invocation, "config", "sssd.conf");
 		configure_sssd_for_domain (realm_sssd_get_config (sssd),
 		                           join->realm_name, workgroup, &error);
+		realm_trace_end (span);
 	}
 
 	if (error == NULL) {
@@ -289,8 +292,19 @@ on_install_do_join (GObject *source,
 	GSimpleAsyncResult *async = G_SIMPLE_ASYNC_RESULT (user_data);
 	JoinClosure *join = g_simple_async_result_get_op_res_gpointer (async);
 	GError *error = NULL;
+	gchar *ccache_file;
 
 	realm_packages_install_finish (result, &error);
+
+	/* adcli is a separate process, and needs the credentials in a file */
+	if (error == NULL && join->use_adcli && join->ccache_file) {
+		ccache_file = realm_kerberos_ccache_materialize (join->ccache_file, &error);
+		if (ccache_file != NULL) {
+			realm_keberos_ccache_delete_and_free (join->ccache_file);
+			join->ccache_file = ccache_file;
+		}
+	}
+
 	if (error == NULL) {
 		if (join->use_adcli && join->one_time_password) {
 			realm_adcli_enroll_join_otp_async (join->realm_name,
@@ -622,13 +636,16 @@ on_leave_do_sssd (GObject *source,
 	RealmSssd *sssd = REALM_SSSD (g_async_result_get_source_object (user_data));
 	GError *error = NULL;
 	RealmIniConfig *config;
+	RealmTraceSpan *span;
 	gchar **domains;
 
 	realm_samba_enroll_leave_finish (result, NULL);
 
 	/* We don't care if we can leave or not, just continue with other steps */
 	config = realm_sssd_get_config (sssd);
+	span = realm_trace_begin (unenroll->invocation, "config", "sssd.conf");
 	realm_sssd_config_remove_domain (config, realm_sssd_get_config_domain (sssd), &error);
+	realm_trace_end (span);
 
 	if (error != NULL) {
 		g_simple_async_result_take_error (res, error);
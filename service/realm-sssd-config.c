@@ -20,7 +20,9 @@
 #include "realm-settings.h"
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
+#include <errno.h>
 #include <string.h>
 
 RealmIniConfig *
@@ -31,23 +33,20 @@ realm_sssd_config_new_with_flags (RealmIniFlags flags,
 	const gchar *filename;
 	GError *err = NULL;
 
-	config = realm_ini_config_new (flags | REALM_INI_PRIVATE);
-
 	filename = realm_settings_path ("sssd.conf");
-	realm_ini_config_read_file (config, filename, &err);
+	config = realm_ini_config_new_shared (filename, flags | REALM_INI_PRIVATE, &err);
 
 	if (err != NULL) {
-		/* If the caller wants errors, then don't return an invalid samba config */
+		/* If the caller wants errors, then don't return an invalid config */
 		if (error) {
 			g_propagate_error (error, err);
-			g_object_unref (config);
-			config = NULL;
 
 		/* If the caller doesn't care, then warn but continue */
 		} else {
 			g_warning ("Couldn't load config file: %s: %s", filename,
 			           err->message);
 			g_error_free (err);
+			config = realm_ini_config_new (flags | REALM_INI_PRIVATE);
 		}
 	}
 
@@ -74,6 +73,126 @@ realm_sssd_config_domain_to_section (const gchar *domain)
 	return g_strdup_printf ("domain/%s", domain);
 }
 
+/*
+ * When a conf.d directory is configured, then each domain's settings go
+ * into a realmd-<domain>.conf snippet there, rather than sssd.conf. Only
+ * the list of domains stays in sssd.conf. This way changing the settings
+ * of a domain only rewrites a small file.
+ */
+static gchar *
+snippet_path_for_domain (const gchar *domain)
+{
+	const gchar *directory;
+	gchar *filename;
+	gchar *path;
+
+	directory = realm_settings_value ("paths", "sssd.conf.d");
+	if (directory == NULL || directory[0] == '\0')
+		return NULL;
+
+	filename = g_strdup_printf ("realmd-%s.conf", domain);
+	g_strdelimit (filename, G_DIR_SEPARATOR_S, '_');
+	path = g_build_filename (directory, filename, NULL);
+	g_free (filename);
+
+	return path;
+}
+
+/*
+ * Loaded snippets are kept until their domain is removed, so that each
+ * lookup doesn't read the file and set up a new file monitor again.
+ * Path -> RealmIniConfig
+ */
+static GHashTable *snippets = NULL;
+
+RealmIniConfig *
+realm_sssd_config_new_snippet (const gchar *domain,
+                               GError **error)
+{
+	RealmIniConfig *snippet;
+	gchar *path;
+
+	g_return_val_if_fail (domain != NULL, NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	path = snippet_path_for_domain (domain);
+	if (path == NULL)
+		return NULL;
+
+	snippet = snippets ? g_hash_table_lookup (snippets, path) : NULL;
+	if (snippet != NULL) {
+		g_free (path);
+		return g_object_ref (snippet);
+	}
+
+	snippet = realm_ini_config_new_shared (path, REALM_INI_PRIVATE, error);
+	if (snippet == NULL) {
+		g_free (path);
+		return NULL;
+	}
+
+	if (snippets == NULL) {
+		snippets = g_hash_table_new_full (g_str_hash, g_str_equal,
+		                                  g_free, g_object_unref);
+	}
+
+	g_hash_table_insert (snippets, path, g_object_ref (snippet));
+	return snippet;
+}
+
+gchar *
+realm_sssd_config_get (RealmIniConfig *config,
+                       const gchar *domain,
+                       const gchar *name)
+{
+	RealmIniConfig *snippet;
+	gchar *section;
+	gchar *value = NULL;
+
+	g_return_val_if_fail (REALM_IS_INI_CONFIG (config), NULL);
+	g_return_val_if_fail (domain != NULL, NULL);
+	g_return_val_if_fail (name != NULL, NULL);
+
+	section = realm_sssd_config_domain_to_section (domain);
+
+	/* Like sssd, values in the snippet override those in sssd.conf */
+	snippet = realm_sssd_config_new_snippet (domain, NULL);
+	if (snippet != NULL) {
+		value = realm_ini_config_get (snippet, section, name);
+		g_object_unref (snippet);
+	}
+
+	if (value == NULL)
+		value = realm_ini_config_get (config, section, name);
+
+	g_free (section);
+	return value;
+}
+
+gchar **
+realm_sssd_config_get_list (RealmIniConfig *config,
+                            const gchar *domain,
+                            const gchar *name,
+                            const gchar *delimiters)
+{
+	gchar **values;
+	gchar *value;
+	gint i;
+
+	g_return_val_if_fail (delimiters != NULL, NULL);
+
+	value = realm_sssd_config_get (config, domain, name);
+	if (value == NULL)
+		return NULL;
+
+	values = g_strsplit_set (value, delimiters, -1);
+	for (i = 0; values[i] != NULL; i++)
+		values[i] = g_strstrip (values[i]);
+	g_free (value);
+
+	return values;
+}
+
 gboolean
 realm_sssd_config_have_domain (RealmIniConfig *config,
                                const gchar *domain)
@@ -103,10 +222,14 @@ realm_sssd_config_add_domain (RealmIniConfig *config,
                               GError **error,
                               ...)
 {
+	RealmIniTransaction *trans;
+	RealmIniConfig *snippet;
 	GHashTable *parameters;
 	const gchar *name;
 	const gchar *value;
 	const gchar *domains[2];
+	GError *err = NULL;
+	gboolean ret;
 	gchar *section;
 	va_list va;
 
@@ -114,18 +237,37 @@ realm_sssd_config_add_domain (RealmIniConfig *config,
 	g_return_val_if_fail (domain != NULL, FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-	if (!realm_ini_config_begin_change (config, error))
+	snippet = realm_sssd_config_new_snippet (domain, &err);
+	if (err != NULL) {
+		g_propagate_error (error, err);
 		return FALSE;
+	}
+
+	/* Both files are written together, or not at all */
+	trans = realm_ini_transaction_new ();
+	if (!realm_ini_transaction_add (trans, config, error) ||
+	    (snippet && !realm_ini_transaction_add (trans, snippet, error))) {
+		realm_ini_transaction_free (trans);
+		g_clear_object (&snippet);
+		return FALSE;
+	}
 
 	section = realm_sssd_config_domain_to_section (domain);
-	if (realm_ini_config_have_section (config, section)) {
-		realm_ini_config_abort_change (config);
+	if (realm_ini_config_have_section (config, section) ||
+	    (snippet && realm_sssd_config_have_domain (config, domain) &&
+	     realm_ini_config_have_section (snippet, section))) {
+		realm_ini_transaction_free (trans);
+		g_clear_object (&snippet);
 		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_EXIST,
 		             _("Already have domain %s in sssd.conf config file"), domain);
 		g_free (section);
 		return FALSE;
 	}
 
+	/* A snippet left behind for a domain sssd.conf doesn't list */
+	if (snippet)
+		realm_ini_config_remove_section (snippet, section);
+
 	/* Setup a default sssd section */
 	if (!realm_ini_config_have_section (config, "sssd")) {
 		realm_ini_config_set (config, "sssd", "services", "nss, pam");
@@ -144,11 +286,15 @@ realm_sssd_config_add_domain (RealmIniConfig *config,
 	}
 	va_end (va);
 
-	realm_ini_config_set_all (config, section, parameters);
+	realm_ini_config_set_all (snippet ? snippet : config, section, parameters);
 	g_hash_table_unref (parameters);
 	g_free (section);
 
-	return realm_ini_config_finish_change (config, error);
+	ret = realm_ini_transaction_commit (trans, error);
+	realm_ini_transaction_free (trans);
+	g_clear_object (&snippet);
+
+	return ret;
 }
 
 gboolean
@@ -156,15 +302,32 @@ realm_sssd_config_remove_domain (RealmIniConfig *config,
                                  const gchar *domain,
                                  GError **error)
 {
+	RealmIniTransaction *trans;
+	RealmIniConfig *snippet;
 	const gchar *domains[2];
+	GError *err = NULL;
+	gboolean ret;
 	gchar *section;
+	gchar *path;
 
 	g_return_val_if_fail (REALM_IS_INI_CONFIG (config), FALSE);
 	g_return_val_if_fail (domain != NULL, FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-	if (!realm_ini_config_begin_change (config, error))
+	snippet = realm_sssd_config_new_snippet (domain, &err);
+	if (err != NULL) {
+		g_propagate_error (error, err);
 		return FALSE;
+	}
+
+	/* The domain leaves both files together, or not at all */
+	trans = realm_ini_transaction_new ();
+	if (!realm_ini_transaction_add (trans, config, error) ||
+	    (snippet && !realm_ini_transaction_add (trans, snippet, error))) {
+		realm_ini_transaction_free (trans);
+		g_clear_object (&snippet);
+		return FALSE;
+	}
 
 	section = realm_sssd_config_domain_to_section (domain);
 
@@ -172,7 +335,77 @@ realm_sssd_config_remove_domain (RealmIniConfig *config,
 	domains[1] = NULL;
 	realm_ini_config_set_list_diff (config, "sssd", "domains", ", ", NULL, domains);
 	realm_ini_config_remove_section (config, section);
+	if (snippet)
+		realm_ini_config_remove_section (snippet, section);
 	g_free (section);
 
-	return realm_ini_config_finish_change (config, error);
+	ret = realm_ini_transaction_commit (trans, error);
+	realm_ini_transaction_free (trans);
+	g_clear_object (&snippet);
+
+	if (!ret)
+		return FALSE;
+
+	/* The snippet is all ours and now empty, so just remove it */
+	path = snippet_path_for_domain (domain);
+	if (path != NULL) {
+		if (snippets)
+			g_hash_table_remove (snippets, path);
+		if (g_unlink (path) < 0 && errno != ENOENT) {
+			g_warning ("Couldn't remove sssd config snippet: %s: %s",
+			           path, g_strerror (errno));
+		}
+	}
+	g_free (path);
+
+	return TRUE;
+}
+
+gboolean
+realm_sssd_config_change_login_policy (RealmIniConfig *config,
+                                       const gchar *domain,
+                                       const gchar *access_provider,
+                                       const gchar **add_names,
+                                       const gchar **remove_names,
+                                       GError **error)
+{
+	RealmIniConfig *snippet;
+	RealmIniConfig *target;
+	GError *err = NULL;
+	gboolean ret;
+	gchar *section;
+
+	g_return_val_if_fail (REALM_IS_INI_CONFIG (config), FALSE);
+	g_return_val_if_fail (domain != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	snippet = realm_sssd_config_new_snippet (domain, &err);
+	if (err != NULL) {
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+
+	/*
+	 * Only domains added while conf.d was configured live in a snippet.
+	 * The others stay in sssd.conf, where their allowed logins already
+	 * are, and a snippet section would hide those from sssd.
+	 */
+	section = realm_sssd_config_domain_to_section (domain);
+	if (snippet && realm_ini_config_have_section (snippet, section))
+		target = snippet;
+	else
+		target = config;
+
+	ret = realm_ini_config_begin_change (target, error);
+	if (ret) {
+		if (access_provider)
+			realm_ini_config_set (target, section, "access_provider", access_provider);
+		realm_ini_config_set_list_diff (target, section, "simple_allow_users", ",",
+		                                add_names, remove_names);
+		ret = realm_ini_config_finish_change (target, error);
+	}
+
+	g_clear_object (&snippet);
+	g_free (section);
+	return ret;
 }
@@ -30,6 +30,18 @@ gchar **            realm_sssd_config_get_domains              (RealmIniConfig *
 
 gchar *             realm_sssd_config_domain_to_section        (const gchar *domain);
 
+RealmIniConfig *    realm_sssd_config_new_snippet              (const gchar *domain,
+                                                                GError **error);
+
+gchar *             realm_sssd_config_get                      (RealmIniConfig *config,
+                                                                const gchar *domain,
+                                                                const gchar *name);
+
+gchar **            realm_sssd_config_get_list                 (RealmIniConfig *config,
+                                                                const gchar *domain,
+                                                                const gchar *name,
+                                                                const gchar *delimiters);
+
 gboolean            realm_sssd_config_have_domain              (RealmIniConfig *config,
                                                                 const gchar *domain);
 
@@ -42,6 +54,13 @@ gboolean            realm_sssd_config_remove_domain            (RealmIniConfig *
                                                                 const gchar *domain,
                                                                 GError **error);
 
+gboolean            realm_sssd_config_change_login_policy      (RealmIniConfig *config,
+                                                                const gchar *domain,
+                                                                const gchar *access_provider,
+                                                                const gchar **add_names,
+                                                                const gchar **remove_names,
+                                                                GError **error);
+
 G_END_DECLS
 
 #endif /* __REALM_SSSD_CONFIG_H__ */
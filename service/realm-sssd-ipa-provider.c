@@ -60,7 +60,6 @@ realm_sssd_ipa_provider_constructed (GObject *obj)
 {
 	RealmSssdIpaProvider *self;
 	gchar **domains;
-	gchar *section;
 	gchar *realm;
 	gchar *type;
 	gint i;
@@ -73,10 +72,8 @@ realm_sssd_ipa_provider_constructed (GObject *obj)
 
 	domains = realm_sssd_config_get_domains (self->config);
 	for (i = 0; domains && domains[i] != 0; i++) {
-		section = realm_sssd_config_domain_to_section (domains[i]);
-		type = realm_ini_config_get (self->config, section, "id_provider");
-		realm = realm_ini_config_get (self->config, section, "krb5_realm");
-		g_free (section);
+		type = realm_sssd_config_get (self->config, domains[i], "id_provider");
+		realm = realm_sssd_config_get (self->config, domains[i], "krb5_realm");
 
 		if (g_strcmp0 (type, "ipa") == 0) {
 			realm_provider_lookup_or_register_realm (REALM_PROVIDER (self),
@@ -32,7 +32,11 @@ struct _RealmSssdPrivate {
 	gchar *domain;
 	gchar *section;
 	RealmIniConfig *config;
-	gulong config_sig;
+	gulong section_sig;
+	gulong key_sig;
+	RealmIniConfig *snippet;
+	gulong snippet_section_sig;
+	gulong snippet_key_sig;
 };
 
 enum {
@@ -42,6 +46,8 @@ enum {
 
 G_DEFINE_TYPE (RealmSssd, realm_sssd, REALM_TYPE_KERBEROS);
 
+static void update_snippet (RealmSssd *self, const gchar *domain);
+
 static void
 realm_sssd_init (RealmSssd *self)
 {
@@ -64,24 +70,6 @@ on_logins_restarted (GObject *source,
 	g_object_unref (async);
 }
 
-static gboolean
-sssd_config_change_login_policy (RealmIniConfig *config,
-                                 const gchar *section,
-                                 const gchar *access_provider,
-                                 const gchar **add_names,
-                                 const gchar **remove_names,
-                                 GError **error)
-{
-	if (!realm_ini_config_begin_change (config, error))
-		return FALSE;
-
-	if (access_provider)
-		realm_ini_config_set (config, section, "access_provider", access_provider);
-	realm_ini_config_set_list_diff (config, section, "simple_allow_users", ",",
-	                                add_names, remove_names);
-	return realm_ini_config_finish_change (config, error);
-}
-
 static void
 realm_sssd_logins_async (RealmKerberos *realm,
                          GDBusMethodInvocation *invocation,
@@ -140,13 +128,17 @@ realm_sssd_logins_async (RealmKerberos *realm,
 	}
 
 	if (add_names && remove_names) {
-		ret = sssd_config_change_login_policy (self->pv->config,
-		                                       self->pv->section,
-		                                       access_provider,
-		                                       (const gchar **)add_names,
-		                                       (const gchar **)remove_names,
-		                                       &error);
-
+		ret = realm_sssd_config_change_login_policy (self->pv->config,
+		                                             self->pv->domain,
+		                                             access_provider,
+		                                             (const gchar **)add_names,
+		                                             (const gchar **)remove_names,
+		                                             &error);
+
+		/*
+		 * sssd only reads its config at startup, a SIGHUP just reopens
+		 * its logs. So it has to be restarted for access changes.
+		 */
 		if (ret) {
 			realm_service_restart ("sssd", invocation,
 			                       on_logins_restarted,
@@ -193,7 +185,7 @@ update_realm_name (RealmSssd *self)
 		realm = g_strdup (realm_discovery_get_string (realm_kerberos_get_discovery (kerberos),
 		                                              REALM_DBUS_DISCOVERY_REALM));
 	} else {
-		realm = realm_ini_config_get (self->pv->config, self->pv->section, "krb5_realm");
+		realm = realm_sssd_config_get (self->pv->config, self->pv->domain, "krb5_realm");
 	}
 
 	if (realm == NULL) {
@@ -216,7 +208,7 @@ update_domain (RealmSssd *self)
 		domain = g_strdup (realm_discovery_get_string (realm_kerberos_get_discovery (kerberos),
 		                                               REALM_DBUS_DISCOVERY_DOMAIN));
 	} else {
-		domain = realm_ini_config_get (self->pv->config, self->pv->section, "dns_discovery_domain");
+		domain = realm_sssd_config_get (self->pv->config, self->pv->domain, "dns_discovery_domain");
 	}
 
 	if (domain == NULL) {
@@ -261,7 +253,7 @@ update_login_formats (RealmSssd *self)
 	}
 
 	/* Setup the login formats */
-	format = realm_ini_config_get (self->pv->config, self->pv->section, "full_name_format");
+	format = realm_sssd_config_get (self->pv->config, self->pv->domain, "full_name_format");
 
 	/* Here we place a '%s' in the place of the user in the format */
 	login_formats[0] = build_login_format (format, "%U", self->pv->domain);
@@ -282,10 +274,10 @@ update_login_policy (RealmSssd *self)
 
 	permitted = g_ptr_array_new_full (0, g_free);
 	if (self->pv->section != NULL)
-		access = realm_ini_config_get (self->pv->config, self->pv->section, "access_provider");
+		access = realm_sssd_config_get (self->pv->config, self->pv->domain, "access_provider");
 	if (g_strcmp0 (access, "simple") == 0) {
-		values = realm_ini_config_get_list (self->pv->config, self->pv->section,
-		                                    "simple_allow_users", ",");
+		values = realm_sssd_config_get_list (self->pv->config, self->pv->domain,
+		                                     "simple_allow_users", ",");
 		for (i = 0; values != NULL && values[i] != NULL; i++)
 			g_ptr_array_add (permitted, realm_kerberos_format_login (kerberos, values[i]));
 		g_strfreev (values);
@@ -325,19 +317,23 @@ update_properties (RealmSssd *self)
 	name = realm_kerberos_get_name (REALM_KERBEROS (self));
 	for (i = 0; domains && domains[i]; i++) {
 		section = realm_sssd_config_domain_to_section (domains[i]);
-		realm = realm_ini_config_get (self->pv->config, section, "krb5_realm");
+		realm = realm_sssd_config_get (self->pv->config, domains[i], "krb5_realm");
 		if (realm && name && g_ascii_strcasecmp (realm, name) == 0) {
 			domain = g_strdup (domains[i]);
+			g_free (realm);
 			break;
 		} else {
 			g_free (section);
 			section = NULL;
 		}
+		g_free (realm);
 	}
 	g_strfreev (domains);
 
 	g_free (self->pv->section);
 	self->pv->section = section;
+	if (g_strcmp0 (domain, self->pv->domain) != 0)
+		update_snippet (self, domain);
 	g_free (self->pv->domain);
 	self->pv->domain = domain;
 
@@ -352,10 +348,79 @@ update_properties (RealmSssd *self)
 }
 
 static void
-on_config_changed (RealmIniConfig *config,
-                   gpointer user_data)
+on_config_section_changed (RealmIniConfig *config,
+                           const gchar *section,
+                           gpointer user_data)
+{
+	/* Domains may have been added, removed or rewritten */
+	if (g_ascii_strcasecmp (section, "sssd") == 0 ||
+	    g_ascii_strncasecmp (section, "domain/", 7) == 0)
+		update_properties (REALM_SSSD (user_data));
+}
+
+static void
+on_config_key_changed (RealmIniConfig *config,
+                       const gchar *section,
+                       const gchar *name,
+                       gpointer user_data)
+{
+	RealmSssd *self = REALM_SSSD (user_data);
+	GObject *obj = G_OBJECT (self);
+
+	/* These change which domain section is ours */
+	if ((g_ascii_strcasecmp (section, "sssd") == 0 &&
+	     g_ascii_strcasecmp (name, "domains") == 0) ||
+	    g_ascii_strcasecmp (name, "krb5_realm") == 0) {
+		update_properties (self);
+		return;
+	}
+
+	if (self->pv->section == NULL ||
+	    g_ascii_strcasecmp (section, self->pv->section) != 0)
+		return;
+
+	g_object_freeze_notify (obj);
+
+	if (g_ascii_strcasecmp (name, "dns_discovery_domain") == 0) {
+		update_domain (self);
+
+	/* Permitted logins are formatted with the login format */
+	} else if (g_ascii_strcasecmp (name, "full_name_format") == 0) {
+		update_login_formats (self);
+		update_login_policy (self);
+
+	} else if (g_ascii_strcasecmp (name, "access_provider") == 0 ||
+	           g_ascii_strcasecmp (name, "simple_allow_users") == 0) {
+		update_login_policy (self);
+	}
+
+	g_object_thaw_notify (obj);
+}
+
+static void
+update_snippet (RealmSssd *self,
+                const gchar *domain)
 {
-	update_properties (REALM_SSSD (user_data));
+	if (self->pv->snippet) {
+		g_signal_handler_disconnect (self->pv->snippet, self->pv->snippet_section_sig);
+		g_signal_handler_disconnect (self->pv->snippet, self->pv->snippet_key_sig);
+		g_object_unref (self->pv->snippet);
+		self->pv->snippet = NULL;
+	}
+
+	if (domain == NULL)
+		return;
+
+	/* Hold on to our domain's conf.d snippet, if configured, to watch it */
+	self->pv->snippet = realm_sssd_config_new_snippet (domain, NULL);
+	if (self->pv->snippet) {
+		self->pv->snippet_section_sig = g_signal_connect (self->pv->snippet, "section-changed",
+		                                                  G_CALLBACK (on_config_section_changed),
+		                                                  self);
+		self->pv->snippet_key_sig = g_signal_connect (self->pv->snippet, "key-changed",
+		                                              G_CALLBACK (on_config_key_changed),
+		                                              self);
+	}
 }
 
 static void
@@ -371,9 +436,12 @@ realm_sssd_set_property (GObject *obj,
 	case PROP_PROVIDER:
 		provider = g_value_get_object (value);
 		g_object_get (provider, "sssd-config", &self->pv->config, NULL);
-		self->pv->config_sig = g_signal_connect (self->pv->config, "changed",
-		                                         G_CALLBACK (on_config_changed),
-		                                         self);
+		self->pv->section_sig = g_signal_connect (self->pv->config, "section-changed",
+		                                          G_CALLBACK (on_config_section_changed),
+		                                          self);
+		self->pv->key_sig = g_signal_connect (self->pv->config, "key-changed",
+		                                      G_CALLBACK (on_config_key_changed),
+		                                      self);
 		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
@@ -397,9 +465,14 @@ realm_sssd_finalize (GObject *obj)
 {
 	RealmSssd *self = REALM_SSSD (obj);
 
+	update_snippet (self, NULL);
 	g_free (self->pv->section);
-	if (self->pv->config)
+	g_free (self->pv->domain);
+	if (self->pv->config) {
+		g_signal_handler_disconnect (self->pv->config, self->pv->section_sig);
+		g_signal_handler_disconnect (self->pv->config, self->pv->key_sig);
 		g_object_unref (self->pv->config);
+	}
 
 	G_OBJECT_CLASS (realm_sssd_parent_class)->finalize (obj);
 }
@@ -413,6 +486,9 @@ realm_sssd_class_init (RealmSssdClass *klass)
 	kerberos_class->logins_async = realm_sssd_logins_async;
 	kerberos_class->logins_finish = realm_sssd_generic_finish;
 
+	/* All sssd realms share sssd.conf, and the sssd service restarted after */
+	kerberos_class->logins_lock = "service:sssd";
+
 	object_class->set_property = realm_sssd_set_property;
 	object_class->notify = realm_sssd_notify;
 	object_class->finalize = realm_sssd_finalize;
@@ -0,0 +1,465 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-diagnostics.h"
+#include "realm-settings.h"
+#include "realm-trace.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Spans record when each stage of an operation, such as a DNS lookup,
+ * kinit or subprocess, started and ended. Finished spans are kept per
+ * client and operation id, until the client goes away. They can be
+ * retrieved as Chrome trace-event JSON, which chrome://tracing and
+ * similar tools can load.
+ */
+
+#define MAX_SPANS       1024  /* per operation */
+#define MAX_OPERATIONS  32    /* per client */
+
+struct _RealmTraceSpan {
+	gchar *sender;
+	gchar *operation;
+	const gchar *category;
+	gchar *name;
+	gint64 start;
+	gint64 end;
+	RealmTraceTotals *totals;
+};
+
+/*
+ * Totals add up the spans of each category as they end, for spans begun
+ * on an invocation after the totals were attached to it. Unlike stored
+ * spans, these are never evicted.
+ */
+struct _RealmTraceTotals {
+	gint refs;
+	GHashTable *categories;  /* category -> TraceTotal, under the traces lock */
+};
+
+typedef struct {
+	gint64 total;
+	guint count;
+} TraceTotal;
+
+typedef struct {
+	gchar *operation;
+	GPtrArray *spans;
+	guint dropped;
+	gint64 updated;
+} TraceOperation;
+
+/* Sender -> GHashTable of operation id -> TraceOperation */
+G_LOCK_DEFINE_STATIC (traces);
+static GHashTable *traces = NULL;
+static guint trace_file_serial = 0;
+
+static GQuark
+trace_totals_quark (void)
+{
+	static GQuark quark = 0;
+	if (quark == 0)
+		quark = g_quark_from_static_string ("realm-trace-totals");
+	return quark;
+}
+
+static RealmTraceTotals *
+trace_totals_ref (RealmTraceTotals *totals)
+{
+	g_atomic_int_inc (&totals->refs);
+	return totals;
+}
+
+static void
+trace_total_free (gpointer data)
+{
+	g_slice_free (TraceTotal, data);
+}
+
+/* Called with the lock held */
+static void
+trace_totals_add (RealmTraceTotals *totals,
+                  RealmTraceSpan *span)
+{
+	TraceTotal *total;
+
+	total = g_hash_table_lookup (totals->categories, span->category);
+	if (total == NULL) {
+		total = g_slice_new0 (TraceTotal);
+		g_hash_table_insert (totals->categories, (gpointer)span->category, total);
+	}
+
+	total->total += span->end - span->start;
+	total->count++;
+}
+
+static void
+trace_span_free (gpointer data)
+{
+	RealmTraceSpan *span = data;
+	if (span->totals)
+		realm_trace_totals_unref (span->totals);
+	g_free (span->sender);
+	g_free (span->operation);
+	g_free (span->name);
+	g_slice_free (RealmTraceSpan, span);
+}
+
+static void
+trace_operation_free (gpointer data)
+{
+	TraceOperation *op = data;
+	g_free (op->operation);
+	g_ptr_array_free (op->spans, TRUE);
+	g_slice_free (TraceOperation, op);
+}
+
+/* Called with the lock held, to make room for a new operation */
+static void
+evict_oldest_operation (GHashTable *operations)
+{
+	TraceOperation *oldest = NULL;
+	GHashTableIter iter;
+	TraceOperation *op;
+
+	g_hash_table_iter_init (&iter, operations);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&op)) {
+		if (oldest == NULL || op->updated < oldest->updated)
+			oldest = op;
+	}
+
+	if (oldest != NULL) {
+		g_debug ("forgetting trace for operation: %s", oldest->operation);
+		g_hash_table_remove (operations, oldest->operation);
+	}
+}
+
+/*
+ * The category is not copied, and should be a static string such
+ * as "dns", "kinit" or "command".
+ */
+RealmTraceSpan *
+realm_trace_begin (GDBusMethodInvocation *invocation,
+                   const gchar *category,
+                   const gchar *format,
+                   ...)
+{
+	RealmTraceSpan *span;
+	const gchar *operation;
+	const gchar *sender;
+	va_list va;
+
+	g_return_val_if_fail (category != NULL, NULL);
+	g_return_val_if_fail (format != NULL, NULL);
+
+	/* Only operations on behalf of a client are traced */
+	if (invocation == NULL)
+		return NULL;
+
+	sender = g_dbus_method_invocation_get_sender (invocation);
+	if (sender == NULL)
+		return NULL;
+
+	operation = realm_diagnostics_get_operation_id (invocation);
+
+	span = g_slice_new0 (RealmTraceSpan);
+	span->sender = g_strdup (sender);
+	span->operation = g_strdup (operation ? operation : "");
+	span->category = category;
+
+	va_start (va, format);
+	span->name = g_strdup_vprintf (format, va);
+	va_end (va);
+
+	span->totals = g_object_get_qdata (G_OBJECT (invocation), trace_totals_quark ());
+	if (span->totals)
+		trace_totals_ref (span->totals);
+
+	span->start = g_get_monotonic_time ();
+	return span;
+}
+
+void
+realm_trace_end (RealmTraceSpan *span)
+{
+	RealmTraceTotals *totals;
+	GHashTable *operations;
+	TraceOperation *op;
+
+	if (span == NULL)
+		return;
+
+	span->end = g_get_monotonic_time ();
+
+	/* Released below, as the span may be freed once the lock is dropped */
+	totals = span->totals;
+	span->totals = NULL;
+
+	G_LOCK (traces);
+
+	if (totals)
+		trace_totals_add (totals, span);
+
+	if (traces == NULL) {
+		traces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+		                                (GDestroyNotify)g_hash_table_unref);
+	}
+
+	operations = g_hash_table_lookup (traces, span->sender);
+	if (operations == NULL) {
+		operations = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, trace_operation_free);
+		g_hash_table_insert (traces, g_strdup (span->sender), operations);
+	}
+
+	op = g_hash_table_lookup (operations, span->operation);
+	if (op == NULL) {
+		if (g_hash_table_size (operations) >= MAX_OPERATIONS)
+			evict_oldest_operation (operations);
+		op = g_slice_new0 (TraceOperation);
+		op->operation = g_strdup (span->operation);
+		op->spans = g_ptr_array_new_with_free_func (trace_span_free);
+		g_hash_table_insert (operations, op->operation, op);
+	}
+
+	op->updated = span->end;
+
+	if (op->spans->len >= MAX_SPANS) {
+		op->dropped++;
+		trace_span_free (span);
+	} else {
+		g_ptr_array_add (op->spans, span);
+	}
+
+	G_UNLOCK (traces);
+
+	if (totals)
+		realm_trace_totals_unref (totals);
+}
+
+/*
+ * Spans begun on @invocation from now on are added to the returned
+ * totals when they end, until the invocation goes away.
+ */
+RealmTraceTotals *
+realm_trace_totals_new (GDBusMethodInvocation *invocation)
+{
+	RealmTraceTotals *totals;
+
+	g_return_val_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation), NULL);
+
+	totals = g_slice_new0 (RealmTraceTotals);
+	totals->refs = 1;
+	totals->categories = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, trace_total_free);
+
+	g_object_set_qdata_full (G_OBJECT (invocation), trace_totals_quark (),
+	                         trace_totals_ref (totals),
+	                         (GDestroyNotify)realm_trace_totals_unref);
+	return totals;
+}
+
+/* Adds up the duration of the finished spans in @category */
+gint64
+realm_trace_totals_get (RealmTraceTotals *totals,
+                        const gchar *category,
+                        guint *count)
+{
+	TraceTotal *total;
+	gint64 ret = 0;
+	guint n = 0;
+
+	g_return_val_if_fail (totals != NULL, 0);
+	g_return_val_if_fail (category != NULL, 0);
+
+	G_LOCK (traces);
+	total = g_hash_table_lookup (totals->categories, category);
+	if (total) {
+		ret = total->total;
+		n = total->count;
+	}
+	G_UNLOCK (traces);
+
+	if (count)
+		*count = n;
+	return ret;
+}
+
+void
+realm_trace_totals_unref (RealmTraceTotals *totals)
+{
+	g_return_if_fail (totals != NULL);
+
+	if (g_atomic_int_dec_and_test (&totals->refs)) {
+		g_hash_table_destroy (totals->categories);
+		g_slice_free (RealmTraceTotals, totals);
+	}
+}
+
+static void
+append_json_string (GString *json,
+                    const gchar *string)
+{
+	const gchar *at;
+
+	g_string_append_c (json, '"');
+	for (at = string; *at != '\0'; at++) {
+		if (*at == '"' || *at == '\\')
+			g_string_append_printf (json, "\\%c", *at);
+		else if ((guchar)*at < 0x20)
+			g_string_append_printf (json, "\\u%04x", (guint)(guchar)*at);
+		else
+			g_string_append_c (json, *at);
+	}
+	g_string_append_c (json, '"');
+}
+
+static gint
+compare_span_start (gconstpointer a,
+                    gconstpointer b)
+{
+	const RealmTraceSpan *one = *((RealmTraceSpan **)a);
+	const RealmTraceSpan *two = *((RealmTraceSpan **)b);
+
+	if (one->start == two->start)
+		return 0;
+	return one->start < two->start ? -1 : 1;
+}
+
+/* Called with the lock held */
+static void
+append_operation_events (GString *json,
+                         TraceOperation *op,
+                         guint tid)
+{
+	RealmTraceSpan *span;
+	guint i;
+
+	g_ptr_array_sort (op->spans, compare_span_start);
+
+	for (i = 0; i < op->spans->len; i++) {
+		span = op->spans->pdata[i];
+		if (json->str[json->len - 1] != '[')
+			g_string_append (json, ",\n");
+		g_string_append (json, "{\"name\":");
+		append_json_string (json, span->name);
+		g_string_append (json, ",\"cat\":");
+		append_json_string (json, span->category);
+		g_string_append_printf (json, ",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+		                        ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%u",
+		                        span->start, span->end - span->start, (int)getpid (), tid);
+		g_string_append (json, ",\"args\":{\"operation\":");
+		append_json_string (json, op->operation);
+		g_string_append (json, "}}");
+	}
+
+	if (op->dropped > 0) {
+		g_debug ("dropped %u trace spans for operation: %s",
+		         op->dropped, op->operation);
+	}
+}
+
+gchar *
+realm_trace_to_json (const gchar *sender,
+                     const gchar *operation_id)
+{
+	GHashTable *operations;
+	TraceOperation *op = NULL;
+	GString *json;
+
+	g_return_val_if_fail (sender != NULL, NULL);
+
+	if (operation_id == NULL)
+		operation_id = "";
+
+	json = g_string_new ("{\"traceEvents\":[");
+
+	G_LOCK (traces);
+	operations = traces ? g_hash_table_lookup (traces, sender) : NULL;
+	if (operations)
+		op = g_hash_table_lookup (operations, operation_id);
+	if (op)
+		append_operation_events (json, op, 1);
+	G_UNLOCK (traces);
+
+	g_string_append (json, "],\"displayTimeUnit\":\"ms\"}\n");
+	return g_string_free (json, FALSE);
+}
+
+static void
+write_trace_file (const gchar *directory,
+                  const gchar *json)
+{
+	GError *error = NULL;
+	gchar *filename;
+	gchar *name;
+
+	name = g_strdup_printf ("realmd-trace-%" G_GINT64_FORMAT "-%u.json",
+	                        g_get_real_time () / G_USEC_PER_SEC, ++trace_file_serial);
+	filename = g_build_filename (directory, name, NULL);
+	g_free (name);
+
+	if (!g_file_set_contents (filename, json, -1, &error)) {
+		g_warning ("Couldn't write trace file: %s", error->message);
+		g_error_free (error);
+	} else {
+		g_debug ("wrote trace file: %s", filename);
+	}
+
+	g_free (filename);
+}
+
+gboolean
+realm_trace_forget_sender (const gchar *sender)
+{
+	GHashTable *operations = NULL;
+	const gchar *directory;
+	gchar *key = NULL;
+	GHashTableIter iter;
+	TraceOperation *op;
+	GString *json;
+	guint tid = 0;
+
+	g_return_val_if_fail (sender != NULL, FALSE);
+
+	G_LOCK (traces);
+	if (traces && g_hash_table_lookup_extended (traces, sender, (gpointer *)&key,
+	                                            (gpointer *)&operations))
+		g_hash_table_steal (traces, sender);
+	G_UNLOCK (traces);
+
+	g_free (key);
+
+	if (operations == NULL)
+		return FALSE;
+
+	/* If configured, keep traces of everything this client did */
+	directory = realm_settings_value ("service", "trace-directory");
+	if (directory && directory[0] != '\0') {
+		json = g_string_new ("{\"traceEvents\":[");
+		g_hash_table_iter_init (&iter, operations);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&op))
+			append_operation_events (json, op, ++tid);
+		g_string_append (json, "],\"displayTimeUnit\":\"ms\"}\n");
+		write_trace_file (directory, json->str);
+		g_string_free (json, TRUE);
+	}
+
+	g_hash_table_unref (operations);
+	return TRUE;
+}
@@ -0,0 +1,50 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_TRACE_H__
+#define __REALM_TRACE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RealmTraceSpan RealmTraceSpan;
+
+typedef struct _RealmTraceTotals RealmTraceTotals;
+
+RealmTraceSpan *     realm_trace_begin                       (GDBusMethodInvocation *invocation,
+                                                              const gchar *category,
+                                                              const gchar *format,
+                                                              ...) G_GNUC_PRINTF (3, 4);
+
+void                 realm_trace_end                         (RealmTraceSpan *span);
+
+RealmTraceTotals *   realm_trace_totals_new                  (GDBusMethodInvocation *invocation);
+
+gint64               realm_trace_totals_get                  (RealmTraceTotals *totals,
+                                                              const gchar *category,
+                                                              guint *count);
+
+void                 realm_trace_totals_unref                (RealmTraceTotals *totals);
+
+gchar *              realm_trace_to_json                     (const gchar *sender,
+                                                              const gchar *operation_id);
+
+gboolean             realm_trace_forget_sender               (const gchar *sender);
+
+G_END_DECLS
+
+#endif /* __REALM_TRACE_H__ */
@@ -0,0 +1,185 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm-metrics.h"
+#include "realm-settings.h"
+#include "realm-worker.h"
+
+#include <string.h>
+
+/*
+ * Blocking kerberos and LDAP calls run here, rather than in the shared
+ * GIO thread pool, so that a slow KDC can't hold up DNS lookups and
+ * other async I/O the daemon is doing. Work beyond the number of
+ * threads waits in the queue.
+ */
+
+#define DEFAULT_THREADS 4
+
+typedef struct {
+	GSimpleAsyncResult *async;
+	GSimpleAsyncThreadFunc func;
+	GCancellable *cancellable;
+	gint64 queued_at;
+} WorkerJob;
+
+G_LOCK_DEFINE_STATIC (worker);
+static GThreadPool *worker_pool = NULL;
+static RealmWorkerStats worker_stats = { 0, };
+
+static void
+worker_job_free (WorkerJob *job)
+{
+	g_object_unref (job->async);
+	if (job->cancellable)
+		g_object_unref (job->cancellable);
+	g_slice_free (WorkerJob, job);
+}
+
+static void
+worker_thread_func (gpointer data,
+                    gpointer unused)
+{
+	WorkerJob *job = data;
+	const gchar *outcome;
+	gboolean completed;
+	GObject *source;
+	GError *error = NULL;
+	gint64 waited;
+
+	waited = g_get_monotonic_time () - job->queued_at;
+
+	G_LOCK (worker);
+	worker_stats.queued--;
+	worker_stats.running++;
+	worker_stats.total_wait += waited;
+	G_UNLOCK (worker);
+
+	if (g_cancellable_set_error_if_cancelled (job->cancellable, &error)) {
+		g_simple_async_result_take_error (job->async, error);
+		outcome = "cancelled";
+		completed = FALSE;
+
+	} else {
+		outcome = "completed";
+		completed = TRUE;
+		source = g_async_result_get_source_object (G_ASYNC_RESULT (job->async));
+		(job->func) (job->async, source, job->cancellable);
+		if (source)
+			g_object_unref (source);
+
+		/* Whatever it returned, nobody wants it if cancelled meanwhile */
+		if (g_cancellable_set_error_if_cancelled (job->cancellable, &error)) {
+			g_simple_async_result_take_error (job->async, error);
+			outcome = "cancelled";
+		}
+	}
+
+	g_simple_async_result_complete_in_idle (job->async);
+
+	G_LOCK (worker);
+	worker_stats.running--;
+	if (completed)
+		worker_stats.completed++;
+	G_UNLOCK (worker);
+
+	realm_metrics_increment (REALM_METRIC_WORKER_JOBS, outcome);
+
+	worker_job_free (job);
+}
+
+static guint
+worker_threads_setting (void)
+{
+	const gchar *value;
+	gchar *end = NULL;
+	guint64 threads;
+
+	value = realm_settings_value ("service", "worker-threads");
+	if (value == NULL || value[0] == '\0')
+		return DEFAULT_THREADS;
+
+	threads = g_ascii_strtoull (value, &end, 10);
+	if (!end || end[0] != '\0' || threads == 0 || threads > 64) {
+		g_warning ("Invalid worker-threads setting: %s", value);
+		return DEFAULT_THREADS;
+	}
+
+	return threads;
+}
+
+static GThreadPool *
+worker_pool_get (void)
+{
+	GError *error = NULL;
+	guint threads;
+
+	/* Called with the lock held */
+	if (worker_pool == NULL) {
+		threads = worker_threads_setting ();
+		worker_pool = g_thread_pool_new (worker_thread_func, NULL, threads, FALSE, &error);
+		if (error != NULL)
+			g_error ("Couldn't create worker threads: %s", error->message);
+		worker_stats.threads = threads;
+	}
+
+	return worker_pool;
+}
+
+void
+realm_worker_run_in_thread (GSimpleAsyncResult *async,
+                            GSimpleAsyncThreadFunc func,
+                            GCancellable *cancellable)
+{
+	GThreadPool *pool;
+	WorkerJob *job;
+	guint threads;
+	guint running;
+	guint queued;
+
+	g_return_if_fail (G_IS_SIMPLE_ASYNC_RESULT (async));
+	g_return_if_fail (func != NULL);
+
+	job = g_slice_new0 (WorkerJob);
+	job->async = g_object_ref (async);
+	job->func = func;
+	job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+	job->queued_at = g_get_monotonic_time ();
+
+	G_LOCK (worker);
+	pool = worker_pool_get ();
+	queued = ++worker_stats.queued;
+	if (queued > worker_stats.peak_queued)
+		worker_stats.peak_queued = queued;
+	running = worker_stats.running;
+	threads = worker_stats.threads;
+	G_UNLOCK (worker);
+
+	if (running + queued > threads)
+		g_debug ("Worker queue depth is %u, with %u threads busy", queued, running);
+
+	g_thread_pool_push (pool, job, NULL);
+}
+
+void
+realm_worker_get_stats (RealmWorkerStats *stats)
+{
+	g_return_if_fail (stats != NULL);
+
+	G_LOCK (worker);
+	memcpy (stats, &worker_stats, sizeof (RealmWorkerStats));
+	G_UNLOCK (worker);
+}
@@ -0,0 +1,41 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#ifndef __REALM_WORKER_H__
+#define __REALM_WORKER_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+	guint threads;
+	guint running;
+	guint queued;
+	guint peak_queued;
+	guint64 completed;
+	gint64 total_wait;
+} RealmWorkerStats;
+
+void             realm_worker_run_in_thread               (GSimpleAsyncResult *async,
+                                                           GSimpleAsyncThreadFunc func,
+                                                           GCancellable *cancellable);
+
+void             realm_worker_get_stats                   (RealmWorkerStats *stats);
+
+G_END_DECLS
+
+#endif /* __REALM_WORKER_H__ */
@@ -0,0 +1,349 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "service/realm-ini-config.h"
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks parsing and modifying large synthetic smb.conf and
+ * sssd.conf files. Results are printed one per line, tab separated:
+ *
+ * benchmark  file  iterations  seconds  per-second  allocations-per-op
+ */
+
+static gint sections = 2000;
+static gint users = 10000;
+static gint continuations = 50;
+static gint iterations = 0;
+
+static GOptionEntry options[] = {
+	{ "sections", 's', 0, G_OPTION_ARG_INT, &sections, "Number of sections to generate", "N" },
+	{ "users", 'u', 0, G_OPTION_ARG_INT, &users, "Number of users in simple_allow_users", "N" },
+	{ "continuations", 'c', 0, G_OPTION_ARG_INT, &continuations, "Number of continued lines per value", "N" },
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Force number of iterations", "N" },
+	{ NULL }
+};
+
+static volatile gint allocations = 0;
+
+/*
+ * Count allocations by interposing on the C library allocator. GLib
+ * no longer lets us hook its allocator, and g_slice is backed by malloc
+ * when G_SLICE=always-malloc is set, as we do below. This relies on
+ * glibc exporting its allocator as __libc_malloc() and friends, so
+ * elsewhere allocations aren't counted.
+ */
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+void *
+malloc (size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+	__libc_free (ptr);
+}
+
+#endif /* __GLIBC__ */
+
+typedef struct {
+	const gchar *benchmark;
+	const gchar *file;
+	GTimer *timer;
+	gint allocations;
+	gint count;
+} Bench;
+
+static void
+bench_begin (Bench *bench,
+             const gchar *benchmark,
+             const gchar *file)
+{
+	bench->benchmark = benchmark;
+	bench->file = file;
+	bench->count = 0;
+	bench->timer = g_timer_new ();
+	bench->allocations = g_atomic_int_get (&allocations);
+}
+
+/* Returns TRUE while more iterations should run */
+static gboolean
+bench_next (Bench *bench)
+{
+	if (iterations > 0)
+		return bench->count++ < iterations;
+
+	/* Run for at least a second, and at least three times */
+	return bench->count++ < 3 || g_timer_elapsed (bench->timer, NULL) < 1.0;
+}
+
+static void
+bench_end (Bench *bench)
+{
+	gdouble seconds;
+	gint count;
+
+	seconds = g_timer_elapsed (bench->timer, NULL);
+	count = bench->count - 1;
+
+#ifdef COUNT_ALLOCATIONS
+	g_print ("%s\t%s\t%d\t%.6f\t%.2f\t%.1f\n", bench->benchmark, bench->file,
+	         count, seconds, count / seconds,
+	         (gdouble)(g_atomic_int_get (&allocations) - bench->allocations) / count);
+#else
+	g_print ("%s\t%s\t%d\t%.6f\t%.2f\t-\n", bench->benchmark, bench->file,
+	         count, seconds, count / seconds);
+#endif
+
+	g_timer_destroy (bench->timer);
+}
+
+static gchar *
+generate_user_list (gint count)
+{
+	GString *list;
+	gint i;
+
+	list = g_string_new ("");
+	for (i = 0; i < count; i++)
+		g_string_append_printf (list, "%suser%d@example.com", i > 0 ? ", " : "", i);
+	return g_string_free (list, FALSE);
+}
+
+static gchar *
+generate_smb_conf (void)
+{
+	GString *data;
+	gint i, j;
+
+	data = g_string_new ("# Generated for benchmarking\n"
+	                     "[global]\n"
+	                     "\tworkgroup = EXAMPLE\n"
+	                     "\trealm = EXAMPLE.COM\n"
+	                     "\tsecurity = ads\n"
+	                     "\tidmap config * : range = 10000-20000\n");
+
+	g_string_append (data, "\tinterfaces = ");
+	for (i = 0; i < continuations; i++)
+		g_string_append_printf (data, "192.168.%d.0/24 \\\n\t\t", i % 256);
+	g_string_append (data, "lo\n");
+
+	for (i = 0; i < sections; i++) {
+		g_string_append_printf (data, "\n; Share number %d\n[share%d]\n", i, i);
+		g_string_append_printf (data, "\tpath = /srv/share/%d\n", i);
+		g_string_append (data, "\tread only = no\n\tbrowseable = yes\n");
+		g_string_append (data, "\tvalid users = ");
+		for (j = 0; j < continuations / 10; j++)
+			g_string_append_printf (data, "@group%d \\\n\t\t", j);
+		g_string_append (data, "@admins\n");
+	}
+
+	return g_string_free (data, FALSE);
+}
+
+static gchar *
+generate_sssd_conf (void)
+{
+	GString *data;
+	gchar *list;
+	gint i;
+
+	data = g_string_new ("[sssd]\nservices = nss, pam\nconfig_file_version = 2\n");
+
+	g_string_append (data, "domains = ");
+	for (i = 0; i < sections; i++)
+		g_string_append_printf (data, "%sdomain%d.example.com", i > 0 ? ", " : "", i);
+	g_string_append (data, "\n");
+
+	list = generate_user_list (users);
+
+	for (i = 0; i < sections; i++) {
+		g_string_append_printf (data, "\n[domain/domain%d.example.com]\n", i);
+		g_string_append (data, "id_provider = ad\naccess_provider = simple\n");
+		g_string_append_printf (data, "ad_domain = domain%d.example.com\n", i);
+		g_string_append_printf (data, "krb5_realm = DOMAIN%d.EXAMPLE.COM\n", i);
+
+		/* Only the first domain has the huge list */
+		g_string_append_printf (data, "simple_allow_users = %s\n",
+		                        i == 0 ? list : "admin@example.com");
+	}
+
+	g_free (list);
+	return g_string_free (data, FALSE);
+}
+
+/* Change one line in the middle, as an external edit would */
+static gchar *
+modify_middle_line (const gchar *data)
+{
+	const gchar *middle;
+	const gchar *eol;
+
+	middle = data + strlen (data) / 2;
+	eol = strchr (middle, '\n');
+	g_assert (eol != NULL);
+
+	return g_strdup_printf ("%.*s\n# modified%s", (gint)(eol - data), data, eol);
+}
+
+static void
+bench_file (const gchar *file,
+            RealmIniFlags flags,
+            const gchar *data,
+            const gchar *list_section,
+            const gchar *list_key,
+            const gchar *get_section,
+            const gchar *get_key)
+{
+	const gchar *add[] = { "newuser@example.com", NULL };
+	const gchar *remove[] = { "user1@example.com", NULL };
+	RealmIniConfig *config;
+	GError *error = NULL;
+	gchar *modified;
+	gchar *filename;
+	GBytes *bytes;
+	Bench bench;
+	gchar *value;
+	gint fd;
+
+	bench_begin (&bench, "parse", file);
+	while (bench_next (&bench)) {
+		config = realm_ini_config_new (flags);
+		realm_ini_config_read_string (config, data);
+		g_object_unref (config);
+	}
+	bench_end (&bench);
+
+	config = realm_ini_config_new (flags);
+	realm_ini_config_read_string (config, data);
+
+	bench_begin (&bench, "get", file);
+	while (bench_next (&bench)) {
+		value = realm_ini_config_get (config, get_section, get_key);
+		g_assert (value != NULL);
+		g_free (value);
+	}
+	bench_end (&bench);
+
+	bench_begin (&bench, "set_list_diff", file);
+	while (bench_next (&bench)) {
+		realm_ini_config_set_list_diff (config, list_section, list_key, ",", add, remove);
+		realm_ini_config_set_list_diff (config, list_section, list_key, ",", remove, add);
+	}
+	bench_end (&bench);
+
+	bench_begin (&bench, "write_bytes", file);
+	while (bench_next (&bench)) {
+		bytes = realm_ini_config_write_bytes (config);
+		g_bytes_unref (bytes);
+	}
+	bench_end (&bench);
+
+	g_object_unref (config);
+
+	/* Reload alternates between the original and an edited file */
+	fd = g_file_open_tmp ("bench-ini-config.XXXXXX", &filename, &error);
+	g_assert_no_error (error);
+	close (fd);
+
+	modified = modify_middle_line (data);
+	config = realm_ini_config_new (flags | REALM_INI_NO_WATCH);
+	g_file_set_contents (filename, data, -1, &error);
+	g_assert_no_error (error);
+	realm_ini_config_read_file (config, filename, &error);
+	g_assert_no_error (error);
+
+	bench_begin (&bench, "reload", file);
+	while (bench_next (&bench)) {
+		g_file_set_contents (filename, (bench.count % 2) ? modified : data, -1, &error);
+		g_assert_no_error (error);
+		realm_ini_config_reload (config);
+	}
+	bench_end (&bench);
+
+	g_object_unref (config);
+	g_unlink (filename);
+	g_free (filename);
+	g_free (modified);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gchar *data;
+
+	/* So that g_slice allocations are counted */
+	g_setenv ("G_SLICE", "always-malloc", TRUE);
+
+	g_type_init ();
+
+	context = g_option_context_new ("- benchmark ini config parsing");
+	g_option_context_add_main_entries (context, options, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("bench-ini-config: %s\n", error->message);
+		g_option_context_free (context);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	g_print ("# benchmark\tfile\titerations\tseconds\tper_second\tallocations_per_op\n");
+
+	data = generate_smb_conf ();
+	bench_file ("smb.conf", REALM_INI_LINE_CONTINUATIONS, data,
+	            "share0", "valid users", "global", "interfaces");
+	g_free (data);
+
+	data = generate_sssd_conf ();
+	bench_file ("sssd.conf", REALM_INI_NONE, data,
+	            "domain/domain0.example.com", "simple_allow_users", "sssd", "domains");
+	g_free (data);
+
+	return 0;
+}
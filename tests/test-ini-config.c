@@ -287,6 +287,261 @@ test_file_watch (Test *test,
 	g_free (value);
 }
 
+static void
+test_new_shared (void)
+{
+	const gchar *filename = "/tmp/test-samba-config.shared";
+	RealmIniConfig *one;
+	RealmIniConfig *two;
+	RealmIniConfig *three;
+	GError *error = NULL;
+
+	g_file_set_contents (filename, "[section]\nkey=one\n", -1, &error);
+	g_assert_no_error (error);
+
+	one = realm_ini_config_new_shared (filename, REALM_INI_NO_WATCH, &error);
+	g_assert_no_error (error);
+	g_assert (one != NULL);
+
+	/* Same file, even through a different path */
+	two = realm_ini_config_new_shared ("/tmp/../tmp/test-samba-config.shared",
+	                                   REALM_INI_NO_WATCH, &error);
+	g_assert_no_error (error);
+	g_assert (two == one);
+
+	/* Different flags, not shared */
+	three = realm_ini_config_new_shared (filename, REALM_INI_NO_WATCH | REALM_INI_PRIVATE, &error);
+	g_assert_no_error (error);
+	g_assert (three != one);
+	g_object_unref (three);
+
+	g_object_unref (two);
+	g_object_unref (one);
+
+	/* All gone, so a new one is created */
+	one = realm_ini_config_new_shared (filename, REALM_INI_NO_WATCH, &error);
+	g_assert_no_error (error);
+	g_assert (one != NULL);
+	g_object_unref (one);
+
+	g_unlink (filename);
+}
+
+static void
+test_transaction (void)
+{
+	const gchar *one = "/tmp/test-samba-config.trans1";
+	const gchar *two = "/tmp/test-samba-config.trans2";
+	RealmIniTransaction *trans;
+	RealmIniConfig *first;
+	RealmIniConfig *second;
+	GError *error = NULL;
+	gchar *output;
+	gchar *value;
+	gboolean ret;
+
+	g_file_set_contents (one, "[section]\nkey=one\n", -1, &error);
+	g_assert_no_error (error);
+	g_unlink (two);
+
+	first = realm_ini_config_new (REALM_INI_NO_WATCH);
+	realm_ini_config_read_file (first, one, &error);
+	g_assert_no_error (error);
+	second = realm_ini_config_new (REALM_INI_NO_WATCH);
+	realm_ini_config_read_file (second, two, &error);
+	g_assert_no_error (error);
+
+	/* Aborting leaves the files, and goes back to what's on disk */
+	trans = realm_ini_transaction_new ();
+	ret = realm_ini_transaction_add (trans, first, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	realm_ini_config_set (first, "section", "key", "changed");
+	realm_ini_transaction_free (trans);
+
+	value = realm_ini_config_get (first, "section", "key");
+	g_assert_cmpstr (value, ==, "one");
+	g_free (value);
+
+	/* Both files written together on commit */
+	trans = realm_ini_transaction_new ();
+	realm_ini_transaction_add (trans, first, &error);
+	g_assert_no_error (error);
+	realm_ini_transaction_add (trans, second, &error);
+	g_assert_no_error (error);
+
+	realm_ini_config_set (first, "section", "key", "uno");
+	realm_ini_config_set (second, "other", "key", "dos");
+
+	g_assert (!g_file_test (two, G_FILE_TEST_EXISTS));
+	ret = realm_ini_transaction_commit (trans, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	realm_ini_transaction_free (trans);
+
+	g_file_get_contents (one, &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (output, ==, "[section]\nkey = uno\n");
+	g_free (output);
+
+	g_file_get_contents (two, &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (output, ==, "\n[other]\nkey = dos\n");
+	g_free (output);
+
+	g_object_unref (first);
+	g_object_unref (second);
+	g_unlink (one);
+	g_unlink (two);
+}
+
+static void
+test_transaction_rollback (void)
+{
+	const gchar *one = "/tmp/test-samba-config.rollback1";
+	const gchar *two = "/tmp/test-samba-config.rollback2";
+	RealmIniTransaction *trans;
+	RealmIniConfig *first;
+	RealmIniConfig *second;
+	GError *error = NULL;
+	gchar *output;
+	gchar *value;
+	gboolean ret;
+
+	g_file_set_contents (one, "[section]\nkey=one\n", -1, &error);
+	g_assert_no_error (error);
+	g_file_set_contents (two, "[section]\nkey=two\n", -1, &error);
+	g_assert_no_error (error);
+
+	first = realm_ini_config_new (REALM_INI_NO_WATCH);
+	realm_ini_config_read_file (first, one, &error);
+	g_assert_no_error (error);
+	second = realm_ini_config_new (REALM_INI_NO_WATCH);
+	realm_ini_config_read_file (second, two, &error);
+	g_assert_no_error (error);
+
+	trans = realm_ini_transaction_new ();
+	realm_ini_transaction_add (trans, first, &error);
+	g_assert_no_error (error);
+	realm_ini_transaction_add (trans, second, &error);
+	g_assert_no_error (error);
+
+	realm_ini_config_set (first, "section", "key", "uno");
+	realm_ini_config_set (second, "section", "key", "dos");
+
+	/* Renaming over a directory fails, after the first was renamed */
+	g_unlink (two);
+	g_assert_cmpint (g_mkdir (two, 0700), ==, 0);
+
+	ret = realm_ini_transaction_commit (trans, &error);
+	g_assert (error != NULL);
+	g_assert (ret == FALSE);
+	g_clear_error (&error);
+	realm_ini_transaction_free (trans);
+
+	/* The first file was put back, on disk and in memory */
+	g_file_get_contents (one, &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (output, ==, "[section]\nkey=one\n");
+	g_free (output);
+
+	value = realm_ini_config_get (first, "section", "key");
+	g_assert_cmpstr (value, ==, "one");
+	g_free (value);
+
+	g_assert (!g_file_test ("/tmp/test-samba-config.rollback1.realmd-bak", G_FILE_TEST_EXISTS));
+
+	g_object_unref (first);
+	g_object_unref (second);
+	g_unlink (one);
+	g_rmdir (two);
+}
+
+static void
+on_config_section_changed (RealmIniConfig *config,
+                           const gchar *section,
+                           gpointer user_data)
+{
+	GString *changes = user_data;
+	g_string_append_printf (changes, "[%s]", section);
+}
+
+static void
+on_config_key_changed (RealmIniConfig *config,
+                       const gchar *section,
+                       const gchar *name,
+                       gpointer user_data)
+{
+	GString *changes = user_data;
+	g_string_append_printf (changes, "%s:%s", section, name);
+}
+
+static void
+test_reload_key_changed (Test *test,
+                         gconstpointer unused)
+{
+	const gchar *data = "[section]\n1=one\n2=two\n\n[another]\n4=four";
+	const gchar *update = "[section]\n1=one\n2=deux\n\n[another]\n4=four";
+	GString *changes;
+	gchar *value;
+
+	realm_ini_config_read_string (test->config, data);
+
+	changes = g_string_new ("");
+	g_signal_connect (test->config, "section-changed", G_CALLBACK (on_config_section_changed), changes);
+	g_signal_connect (test->config, "key-changed", G_CALLBACK (on_config_key_changed), changes);
+
+	realm_ini_config_read_string (test->config, update);
+	g_assert_cmpstr (changes->str, ==, "section:2");
+
+	value = realm_ini_config_get (test->config, "section", "2");
+	g_assert_cmpstr (value, ==, "deux");
+	g_free (value);
+	value = realm_ini_config_get (test->config, "another", "4");
+	g_assert_cmpstr (value, ==, "four");
+	g_free (value);
+
+	/* Reading the same thing again, changes nothing */
+	g_string_set_size (changes, 0);
+	realm_ini_config_read_string (test->config, update);
+	g_assert_cmpstr (changes->str, ==, "");
+
+	g_string_free (changes, TRUE);
+}
+
+static void
+test_reload_section_changed (Test *test,
+                             gconstpointer unused)
+{
+	const gchar *data = "[section]\n1=one\n\n[another]\n4=four";
+	const gchar *update = "[section]\n1=one\n\n[renamed]\n4=four";
+	GString *changes;
+	gchar *value;
+	gchar *output;
+
+	realm_ini_config_read_string (test->config, data);
+
+	changes = g_string_new ("");
+	g_signal_connect (test->config, "section-changed", G_CALLBACK (on_config_section_changed), changes);
+	g_signal_connect (test->config, "key-changed", G_CALLBACK (on_config_key_changed), changes);
+
+	realm_ini_config_read_string (test->config, update);
+	g_assert (strstr (changes->str, "[another]") != NULL);
+	g_assert (strstr (changes->str, "[renamed]") != NULL);
+	g_assert (strstr (changes->str, ":") == NULL);
+
+	g_assert (realm_ini_config_have_section (test->config, "another") == FALSE);
+	value = realm_ini_config_get (test->config, "renamed", "4");
+	g_assert_cmpstr (value, ==, "four");
+	g_free (value);
+
+	output = realm_ini_config_write_string (test->config);
+	g_assert_cmpstr (output, ==, update);
+	g_free (output);
+
+	g_string_free (changes, TRUE);
+}
+
 static void
 test_set (Test *test,
           gconstpointer unused)
@@ -374,6 +629,42 @@ test_set_all (Test *test,
 	g_free (output);
 }
 
+static void
+test_set_list_diff (Test *test,
+                    gconstpointer unused)
+{
+	const gchar *data = "[section]\nusers = one,Two, ,three, one\n";
+	const gchar *add_four[] = { "four", "TWO", NULL };
+	const gchar *remove_one[] = { "one", NULL };
+	const gchar *add_one[] = { "one", NULL };
+	const gchar *remove_two[] = { "two", NULL };
+	gchar *output;
+	gchar *value;
+
+	realm_ini_config_read_string (test->config, data);
+
+	/* Duplicates are all removed, existing items not added again */
+	realm_ini_config_set_list_diff (test->config, "section", "users", ",",
+	                                add_four, remove_one);
+	output = realm_ini_config_write_string (test->config);
+	g_assert_cmpstr (output, ==, "[section]\nusers = Two, three, four\n");
+	g_free (output);
+
+	realm_ini_config_set_list_diff (test->config, "section", "users", ",",
+	                                add_one, remove_two);
+	value = realm_ini_config_get (test->config, "section", "users");
+	g_assert_cmpstr (value, ==, "three, four, one");
+	g_free (value);
+
+	/* Setting the whole value replaces the list */
+	realm_ini_config_set (test->config, "section", "users", "five");
+	realm_ini_config_set_list_diff (test->config, "section", "users", ",",
+	                                add_one, NULL);
+	output = realm_ini_config_write_string (test->config);
+	g_assert_cmpstr (output, ==, "[section]\nusers = five, one\n");
+	g_free (output);
+}
+
 static void
 test_have_section (Test *test,
                    gconstpointer unused)
@@ -622,10 +913,14 @@ main (int argc,
 	g_test_add ("/realmd/ini-config/write-file", Test, NULL, setup, test_write_file, teardown);
 	g_test_add ("/realmd/ini-config/write-empty-no-create", Test, NULL, setup, test_write_empty_no_create, teardown);
 
+	g_test_add ("/realmd/ini-config/reload-key-changed", Test, NULL, setup, test_reload_key_changed, teardown);
+	g_test_add ("/realmd/ini-config/reload-section-changed", Test, NULL, setup, test_reload_section_changed, teardown);
+
 	g_test_add ("/realmd/ini-config/set", Test, NULL, setup, test_set, teardown);
 	g_test_add ("/realmd/ini-config/set-middle", Test, NULL, setup, test_set_middle, teardown);
 	g_test_add ("/realmd/ini-config/set-section", Test, NULL, setup, test_set_section, teardown);
 	g_test_add ("/realmd/ini-config/set-all", Test, NULL, setup, test_set_all, teardown);
+	g_test_add ("/realmd/ini-config/set-list-diff", Test, NULL, setup, test_set_list_diff, teardown);
 
 	g_test_add ("/realmd/ini-config/have-section", Test, NULL, setup, test_have_section, teardown);
 	g_test_add ("/realmd/ini-config/remove-section-first", Test, NULL, setup, test_remove_section_first, teardown);
@@ -637,6 +932,9 @@ main (int argc,
 	g_test_add ("/realmd/ini-config/file-not-exist", Test, NULL, setup, test_file_not_exist, teardown);
 	if (!g_test_quick ())
 		g_test_add ("/realmd/ini-config/file-watch", Test, NULL, setup, test_file_watch, teardown);
+	g_test_add_func ("/realmd/ini-config/new-shared", test_new_shared);
+	g_test_add_func ("/realmd/ini-config/transaction", test_transaction);
+	g_test_add_func ("/realmd/ini-config/transaction-rollback", test_transaction_rollback);
 
 	g_test_add ("/realmd/ini-config/change", Test, NULL, setup, test_change, teardown);
 	g_test_add ("/realmd/ini-config/change-list", Test, NULL, setup, test_change_list, teardown);
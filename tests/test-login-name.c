@@ -125,6 +125,45 @@ test_parse_all_failed (Test *test,
 	g_strfreev (changed);
 }
 
+static void
+test_matcher_domain (Test *test,
+                     gconstpointer unused)
+{
+	RealmLoginMatcher *matcher;
+	const gchar *failed = NULL;
+	const gchar *original[] = {
+		"DOMAIN.EXAMPLE\\User",
+		"two@domain.example",
+		NULL,
+	};
+	const gchar *const formats[] = {
+		"%D\\%U",
+		"%U@%D",
+		NULL
+	};
+
+	gchar **changed;
+	gchar *login;
+
+	matcher = realm_login_matcher_new (formats, "domain.example");
+
+	changed = realm_login_matcher_parse_all (matcher, TRUE, original, &failed);
+	g_assert (changed != NULL);
+	g_assert_cmpstr (changed[0], ==, "user");
+	g_assert_cmpstr (changed[1], ==, "two");
+	g_assert (changed[2] == NULL);
+	g_assert (failed == NULL);
+	g_strfreev (changed);
+
+	login = realm_login_matcher_parse (matcher, FALSE, "other.example\\User");
+	g_assert (login == NULL);
+
+	login = realm_login_matcher_format (matcher, "User");
+	g_assert_cmpstr (login, ==, "domain.example\\User");
+	g_free (login);
+
+	realm_login_matcher_free (matcher);
+}
 
 int
 main (int argc,
@@ -183,6 +222,7 @@ main (int argc,
 
 	g_test_add ("/realmd/login-name/parse-all", Test, NULL, setup, test_parse_all, teardown);
 	g_test_add ("/realmd/login-name/parse-all-failed", Test, NULL, setup, test_parse_all_failed, teardown);
+	g_test_add ("/realmd/login-name/matcher-domain", Test, NULL, setup, test_matcher_domain, teardown);
 
 	return g_test_run ();
 }
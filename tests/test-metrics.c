@@ -0,0 +1,151 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "service/realm-metrics.h"
+
+#include <string.h>
+
+static void
+setup (gpointer unused,
+       gconstpointer data)
+{
+	realm_metrics_reset ();
+}
+
+static void
+teardown (gpointer unused,
+          gconstpointer data)
+{
+	realm_metrics_reset ();
+}
+
+static void
+test_counter (gpointer unused,
+              gconstpointer data)
+{
+	GVariant *metrics;
+	GVariant *value;
+	const gchar *name;
+	const gchar *label;
+	guint64 count;
+
+	realm_metrics_increment (REALM_METRIC_DISCOVER, "SssdAd");
+	realm_metrics_increment (REALM_METRIC_DISCOVER, "SssdAd");
+	realm_metrics_increment (REALM_METRIC_DISCOVER, "Samba");
+
+	metrics = realm_metrics_to_variant ();
+	g_assert_cmpuint (g_variant_n_children (metrics), ==, 2);
+
+	/* Sorted by label */
+	g_variant_get_child (metrics, 0, "(&s&sv)", &name, &label, &value);
+	g_assert_cmpstr (name, ==, "realmd_discover_total");
+	g_assert_cmpstr (label, ==, "Samba");
+	g_assert_cmpuint (g_variant_get_uint64 (value), ==, 1);
+	g_variant_unref (value);
+
+	g_variant_get_child (metrics, 1, "(&s&sv)", &name, &label, &value);
+	g_assert_cmpstr (label, ==, "SssdAd");
+	g_variant_get (value, "t", &count);
+	g_assert_cmpuint (count, ==, 2);
+	g_variant_unref (value);
+
+	g_variant_unref (metrics);
+}
+
+static void
+test_histogram (gpointer unused,
+                gconstpointer data)
+{
+	GVariant *metrics;
+	GVariant *value;
+	GVariant *buckets;
+	const gdouble *bounds;
+	guint n_bounds;
+	guint64 count;
+	gdouble sum;
+
+	realm_metrics_observe (REALM_METRIC_COMMAND, "adcli", G_USEC_PER_SEC / 1000);
+	realm_metrics_observe (REALM_METRIC_COMMAND, "adcli", 2 * G_USEC_PER_SEC);
+	realm_metrics_observe (REALM_METRIC_COMMAND, "adcli", 1000 * G_USEC_PER_SEC);
+
+	metrics = realm_metrics_to_variant ();
+	g_assert_cmpuint (g_variant_n_children (metrics), ==, 1);
+	g_variant_get_child (metrics, 0, "(&s&sv)", NULL, NULL, &value);
+	g_variant_get (value, "(td@at)", &count, &sum, &buckets);
+
+	g_assert_cmpuint (count, ==, 3);
+	g_assert_cmpfloat (sum, >, 1002.0);
+	g_assert_cmpfloat (sum, <, 1002.01);
+
+	/* Cumulative, and the last observation is above all the bounds */
+	bounds = realm_metrics_get_buckets (&n_bounds);
+	g_assert_cmpuint (g_variant_n_children (buckets), ==, n_bounds);
+	g_assert_cmpfloat (bounds[0], >=, 0.001);
+	g_variant_get_child (buckets, 0, "t", &count);
+	g_assert_cmpuint (count, ==, 1);
+	g_variant_get_child (buckets, n_bounds - 1, "t", &count);
+	g_assert_cmpuint (count, ==, 2);
+
+	g_variant_unref (buckets);
+	g_variant_unref (value);
+	g_variant_unref (metrics);
+}
+
+static void
+test_prometheus (gpointer unused,
+                 gconstpointer data)
+{
+	gchar *text;
+
+	realm_metrics_increment (REALM_METRIC_CACHE_HIT, "tgt");
+	realm_metrics_set (REALM_METRIC_WORKER, "threads", 4);
+	realm_metrics_increment (REALM_METRIC_WORKER_JOBS, "completed");
+	realm_metrics_observe (REALM_METRIC_LOCK_WAIT, "granted", G_USEC_PER_SEC * 3 / 2);
+	realm_metrics_increment (REALM_METRIC_SRV_LOOKUP, "with \"quote\"\\");
+
+	text = realm_metrics_to_prometheus ();
+
+	g_assert (strstr (text, "# TYPE realmd_cache_hits_total counter\n") != NULL);
+	g_assert (strstr (text, "realmd_cache_hits_total{cache=\"tgt\"} 1\n") != NULL);
+	g_assert (strstr (text, "# TYPE realmd_worker_jobs gauge\n") != NULL);
+	g_assert (strstr (text, "realmd_worker_jobs{state=\"threads\"} 4\n") != NULL);
+	g_assert (strstr (text, "# TYPE realmd_worker_jobs_total counter\n") != NULL);
+	g_assert (strstr (text, "realmd_worker_jobs_total{outcome=\"completed\"} 1\n") != NULL);
+	g_assert (strstr (text, "# TYPE realmd_lock_wait_seconds histogram\n") != NULL);
+	g_assert (strstr (text, "realmd_lock_wait_seconds_bucket{outcome=\"granted\",le=\"1\"} 0\n") != NULL);
+	g_assert (strstr (text, "realmd_lock_wait_seconds_bucket{outcome=\"granted\",le=\"5\"} 1\n") != NULL);
+	g_assert (strstr (text, "realmd_lock_wait_seconds_bucket{outcome=\"granted\",le=\"+Inf\"} 1\n") != NULL);
+	g_assert (strstr (text, "realmd_lock_wait_seconds_sum{outcome=\"granted\"} 1.5\n") != NULL);
+	g_assert (strstr (text, "realmd_lock_wait_seconds_count{outcome=\"granted\"} 1\n") != NULL);
+	g_assert (strstr (text, "realmd_srv_lookups_total{outcome=\"with \\\"quote\\\"\\\\\"} 1\n") != NULL);
+
+	g_free (text);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+	g_type_init ();
+	g_test_init (&argc, &argv, NULL);
+	g_set_prgname ("test-metrics");
+
+	g_test_add ("/realmd/metrics/counter", gpointer, NULL, setup, test_counter, teardown);
+	g_test_add ("/realmd/metrics/histogram", gpointer, NULL, setup, test_histogram, teardown);
+	g_test_add ("/realmd/metrics/prometheus", gpointer, NULL, setup, test_prometheus, teardown);
+
+	return g_test_run ();
+}
@@ -163,6 +163,147 @@ test_add_domain_only (Test *test,
 	g_free (output);
 }
 
+static void
+test_add_domain_snippet (Test *test,
+                         gconstpointer unused)
+{
+	const gchar *check = "\n[sssd]\ndomains = two\nconfig_file_version = 2\nservices = nss, pam\n";
+	const gchar *snippet = "\n[domain/two]\ndos = 2\n";
+	GError *error = NULL;
+	gchar *output;
+	gboolean ret;
+
+	/* Domain settings go into conf.d snippets */
+	realm_settings_add ("paths", "sssd.conf.d", "/tmp");
+	g_unlink ("/tmp/realmd-two.conf");
+	g_unlink ("/tmp/test-sssd.conf");
+
+	ret = realm_ini_config_write_file (test->config, "/tmp/test-sssd.conf", &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	ret = realm_sssd_config_add_domain (test->config, "two", &error,
+	                                    "dos", "2",
+	                                    NULL);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	ret = g_file_get_contents ("/tmp/test-sssd.conf", &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (check, ==, output);
+	g_free (output);
+
+	ret = g_file_get_contents ("/tmp/realmd-two.conf", &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (snippet, ==, output);
+	g_free (output);
+
+	output = realm_sssd_config_get (test->config, "two", "dos");
+	g_assert_cmpstr (output, ==, "2");
+	g_free (output);
+
+	ret = realm_sssd_config_remove_domain (test->config, "two", &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	g_assert (!g_file_test ("/tmp/realmd-two.conf", G_FILE_TEST_EXISTS));
+
+	realm_settings_add ("paths", "sssd.conf.d", "");
+}
+
+static void
+test_add_domain_orphaned_snippet (Test *test,
+                                  gconstpointer unused)
+{
+	GError *error = NULL;
+	gchar *output;
+	gboolean ret;
+
+	realm_settings_add ("paths", "sssd.conf.d", "/tmp");
+	g_unlink ("/tmp/test-sssd.conf");
+
+	/* Left behind from an earlier domain, but sssd.conf doesn't list it */
+	g_file_set_contents ("/tmp/realmd-two.conf", "[domain/two]\nold = 1\n", -1, &error);
+	g_assert_no_error (error);
+
+	ret = realm_ini_config_write_file (test->config, "/tmp/test-sssd.conf", &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	ret = realm_sssd_config_add_domain (test->config, "two", &error,
+	                                    "dos", "2",
+	                                    NULL);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	output = realm_sssd_config_get (test->config, "two", "dos");
+	g_assert_cmpstr (output, ==, "2");
+	g_free (output);
+
+	output = realm_sssd_config_get (test->config, "two", "old");
+	g_assert_cmpstr (output, ==, NULL);
+	g_free (output);
+
+	ret = realm_sssd_config_remove_domain (test->config, "two", &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	g_assert (!g_file_test ("/tmp/realmd-two.conf", G_FILE_TEST_EXISTS));
+
+	realm_settings_add ("paths", "sssd.conf.d", "");
+}
+
+static void
+test_login_policy_in_sssd_conf (Test *test,
+                                gconstpointer unused)
+{
+	const gchar *data = "[sssd]\ndomains = one\n[domain/one]\naccess_provider = simple\nsimple_allow_users = alice\n";
+	const gchar *check = "[sssd]\ndomains = one\n[domain/one]\naccess_provider = deny\nsimple_allow_users = bob\n";
+	const gchar *permit[] = { "bob", NULL };
+	const gchar *deny[] = { "alice", NULL };
+	GError *error = NULL;
+	gchar **values;
+	gchar *output;
+	gboolean ret;
+
+	g_unlink ("/tmp/realmd-one.conf");
+
+	/* Joined before conf.d was configured */
+	realm_ini_config_read_string (test->config, data);
+	ret = realm_ini_config_write_file (test->config, "/tmp/test-sssd.conf", &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	realm_settings_add ("paths", "sssd.conf.d", "/tmp");
+
+	ret = realm_sssd_config_change_login_policy (test->config, "one", "simple",
+	                                             permit, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	values = realm_sssd_config_get_list (test->config, "one", "simple_allow_users", ",");
+	g_assert (values != NULL);
+	g_assert_cmpstr (values[0], ==, "alice");
+	g_assert_cmpstr (values[1], ==, "bob");
+	g_assert (values[2] == NULL);
+	g_strfreev (values);
+
+	ret = realm_sssd_config_change_login_policy (test->config, "one", "deny",
+	                                             NULL, deny, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	/* Still all in sssd.conf, rather than a new snippet */
+	ret = g_file_get_contents ("/tmp/test-sssd.conf", &output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (check, ==, output);
+	g_free (output);
+
+	g_assert (!g_file_test ("/tmp/realmd-one.conf", G_FILE_TEST_EXISTS));
+
+	realm_settings_add ("paths", "sssd.conf.d", "");
+}
+
 static void
 test_remove_domain (Test *test,
                     gconstpointer unused)
@@ -265,6 +406,9 @@ main (int argc,
 	g_test_add ("/realmd/sssd-config/add-domain", Test, NULL, setup, test_add_domain, teardown);
 	g_test_add ("/realmd/sssd-config/add-domain-already", Test, NULL, setup, test_add_domain_already, teardown);
 	g_test_add ("/realmd/sssd-config/add-domain-only", Test, NULL, setup, test_add_domain_only, teardown);
+	g_test_add ("/realmd/sssd-config/add-domain-snippet", Test, NULL, setup, test_add_domain_snippet, teardown);
+	g_test_add ("/realmd/sssd-config/add-domain-orphaned-snippet", Test, NULL, setup, test_add_domain_orphaned_snippet, teardown);
+	g_test_add ("/realmd/sssd-config/login-policy-in-sssd-conf", Test, NULL, setup, test_login_policy_in_sssd_conf, teardown);
 	g_test_add ("/realmd/sssd-config/remove-domain", Test, NULL, setup, test_remove_domain, teardown);
 	g_test_add ("/realmd/sssd-config/remove-domain-not-exist", Test, NULL, setup, test_remove_domain_not_exist, teardown);
 	g_test_add ("/realmd/sssd-config/remove-domain-only", Test, NULL, setup, test_remove_domain_only, teardown);
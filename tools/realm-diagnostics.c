@@ -0,0 +1,97 @@
+/* realmd -- Realm configuration service
+ *
+ * Copyright 2012 Red Hat Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Author: Stef Walter <stefw@gnome.org>
+ */
+
+#include "config.h"
+
+#include "realm.h"
+#include "realm-dbus-constants.h"
+#include "realm-dbus-generated.h"
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+static int
+perform_diagnostics (const gchar *operation_id)
+{
+	RealmDbusMetrics *metrics;
+	GError *error = NULL;
+	gchar **lines = NULL;
+	gint i;
+
+	metrics = realm_dbus_metrics_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
+	                                                     G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+	                                                     REALM_DBUS_BUS_NAME,
+	                                                     REALM_DBUS_SERVICE_PATH,
+	                                                     NULL, &error);
+	if (error != NULL) {
+		realm_handle_error (error, _("Couldn't connect to realm service"));
+		return 1;
+	}
+
+	realm_dbus_metrics_call_get_diagnostics_sync (metrics, operation_id, &lines, NULL, &error);
+	g_object_unref (metrics);
+
+	/* Not realm_handle_error(), which would point back here */
+	if (error != NULL) {
+		g_dbus_error_strip_remote_error (error);
+		realm_print_error ("%s: %s", _("Couldn't retrieve diagnostics"), error->message);
+		g_error_free (error);
+		return 1;
+	}
+
+	if (lines[0] == NULL) {
+		realm_print_error (_("No diagnostics kept for operation: %s"), operation_id);
+		g_strfreev (lines);
+		return 1;
+	}
+
+	for (i = 0; lines[i] != NULL; i++)
+		g_print ("%s", lines[i]);
+
+	g_strfreev (lines);
+	return 0;
+}
+
+int
+realm_diagnostics (int argc,
+                   char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gint ret = 0;
+
+	GOptionEntry option_entries[] = {
+		{ NULL, }
+	};
+
+	context = g_option_context_new ("operation-id");
+	g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
+	g_option_context_add_main_entries (context, option_entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+		g_error_free (error);
+		ret = 2;
+
+	} else if (argc != 2) {
+		g_printerr ("%s: %s\n", _("Specify one operation id"), g_get_prgname ());
+		ret = 2;
+
+	} else {
+		ret = perform_diagnostics (argv[1]);
+	}
+
+	g_option_context_free (context);
+	return ret;
+}
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <unistd.h>
 
 struct {
 	const char *name;
@@ -40,8 +41,12 @@ struct {
 	{ "list", realm_list, "realm list", N_("List known realms") },
 	{ "permit", realm_permit, "realm permit [-a] [-R realm] user ...", N_("Permit user logins") },
 	{ "deny", realm_deny, "realm deny [-a] [-R realm] user ...", N_("Deny user logins") },
+	{ "diagnostics", realm_diagnostics, "realm diagnostics operation-id", N_("Show diagnostics of an earlier operation") },
 };
 
+/* Set once a call has been built with our operation id */
+static gboolean operation_id_sent = FALSE;
+
 void
 realm_print_error (const gchar *format,
                    ...)
@@ -67,6 +72,7 @@ realm_handle_error (GError *error,
                     const gchar *format,
                     ...)
 {
+	gchar *remote = NULL;
 	GString *message;
 	va_list va;
 
@@ -80,6 +86,7 @@ realm_handle_error (GError *error,
 	}
 
 	if (error) {
+		remote = g_dbus_error_get_remote_error (error);
 		g_dbus_error_strip_remote_error (error);
 		if (format)
 			g_string_append (message, ": ");
@@ -89,6 +96,35 @@ realm_handle_error (GError *error,
 
 	g_printerr ("%s\n", message->str);
 	g_string_free (message, TRUE);
+
+	/*
+	 * The service keeps the diagnostics of a failed operation, if it was
+	 * given our operation id. Other errors come from the bus itself.
+	 */
+	if (operation_id_sent && remote && g_str_has_prefix (remote, REALM_DBUS_ERROR_PREFIX)) {
+		g_printerr (_("%s: See 'realm diagnostics %s' for details\n"),
+		            g_get_prgname (), realm_get_operation_id ());
+	}
+
+	g_free (remote);
+}
+
+/*
+ * Every call made by this run of the tool uses the same operation id,
+ * so that the service keeps its diagnostics for later.
+ */
+const gchar *
+realm_get_operation_id (void)
+{
+	static gchar *operation_id = NULL;
+
+	if (operation_id == NULL) {
+		operation_id = g_strdup_printf ("realm-%lu-%" G_GINT64_FORMAT,
+		                                (gulong)getpid (),
+		                                g_get_real_time () / G_USEC_PER_SEC);
+	}
+
+	return operation_id;
 }
 
 GVariant *
@@ -116,6 +152,11 @@ realm_build_options (const gchar *first,
 
 	va_end (va);
 
+	option = g_variant_new ("{sv}", REALM_DBUS_OPTION_OPERATION,
+	                        g_variant_new_string (realm_get_operation_id ()));
+	g_ptr_array_add (opts, option);
+	operation_id_sent = TRUE;
+
 	options = g_variant_new_array (G_VARIANT_TYPE ("{sv}"), (GVariant * const*)opts->pdata, opts->len);
 	g_ptr_array_free (opts, TRUE);
 
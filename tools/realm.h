@@ -43,6 +43,11 @@ int                   realm_permit                 (int argc,
 int                   realm_deny                   (int argc,
                                                     char *argv[]);
 
+int                   realm_diagnostics            (int argc,
+                                                    char *argv[]);
+
+const gchar *         realm_get_operation_id       (void);
+
 GVariant *            realm_build_options          (const gchar *first,
                                                     ...) G_GNUC_NULL_TERMINATED;
 